@@ -10,6 +10,8 @@ layout (set = 0, binding = 0) uniform SceneData {
 layout (set = 1, binding = 0) uniform GLFTMaterialData {
   vec4 colorFactors;
   vec4 metal_rough_factors;
+  // Alpha mask cutoff in x
+  vec4 alpha_cutoff;
 } materialData;
 
 layout (set = 1, binding = 1) uniform sampler2D colorTex;
@@ -9,11 +9,18 @@ layout (location = 2) in vec2 inUV;
 
 layout (location = 0) out vec4 outFragColor;
 
+// Material features, see MaterialPipelineKey. The defaults are the generic variant
+layout (constant_id = 0) const bool AlphaTest = true;
+layout (constant_id = 1) const bool ColorTexture = true;
+
 void main()
 {
+  vec4 texColor = ColorTexture ? texture(colorTex, inUV) : vec4(1.f);
+  if (AlphaTest && texColor.a * materialData.colorFactors.a < materialData.alpha_cutoff.x) discard;
+
   float lightValue = max(dot(inNormal, sceneData.sunlightDirection.xyz), 0.1f);
 
-  vec3 color = inColor * texture(colorTex, inUV).xyz;
+  vec3 color = inColor * texColor.xyz;
   vec3 ambient = color * sceneData.ambientColor.xyz;
 
   outFragColor = vec4(color * lightValue * sceneData.sunlightColor.w + ambient, 1.0f);
@@ -4,37 +4,25 @@
 #extension GL_EXT_buffer_reference : require
 
 #include "input_structures.glsl"
+#include "mesh_object.glsl"
+
+// The depth pre-pass in mesh_depth.vert has to produce the same depth
+invariant gl_Position;
 
 layout (location = 0) out vec3 outNormal;
 layout (location = 1) out vec3 outColor;
 layout (location = 2) out vec2 outUV;
 
-struct Vertex {
-  vec3 position;
-  float uv_x;
-  vec3 normal;
-  float uv_y;
-  vec4 color;
-};
-
-layout(buffer_reference, std430) readonly buffer VertexBuffer {
-  Vertex vertices[];
-};
-
-layout (push_constant) uniform constants {
-  mat4 render_matrix;
-  VertexBuffer vertexBuffer;
-} PushConstants;
-
 void main()
 {
-  Vertex v = PushConstants.vertexBuffer.vertices[gl_VertexIndex];
+  ObjectData object = objectBuffer.objects[gl_InstanceIndex];
+  Vertex v = object.vertexBuffer.vertices[gl_VertexIndex];
 
   vec4 position = vec4(v.position, 1.0f);
 
-  gl_Position = sceneData.viewproj * PushConstants.render_matrix *position;
+  gl_Position = sceneData.viewproj * object.worldMatrix * position;
 
-  outNormal = (PushConstants.render_matrix * vec4(v.normal, 0.f)).xyz;
+  outNormal = mat3(object.normalMatrix) * v.normal;
   outColor = v.color.xyz * materialData.colorFactors.xyz;
   outUV.x = v.uv_x;
   outUV.y = v.uv_y;
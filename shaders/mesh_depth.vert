@@ -0,0 +1,19 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+#extension GL_EXT_buffer_reference : require
+
+#include "input_structures.glsl"
+#include "mesh_object.glsl"
+
+// Has to match mesh.vert bit for bit, the opaque pass tests against this depth with EQUAL
+invariant gl_Position;
+
+void main()
+{
+  ObjectData object = objectBuffer.objects[gl_InstanceIndex];
+
+  vec4 position = vec4(object.vertexBuffer.vertices[gl_VertexIndex].position, 1.0f);
+
+  gl_Position = sceneData.viewproj * object.worldMatrix * position;
+}
@@ -0,0 +1,25 @@
+// Per-object data of the frame's mesh draws, written by prepare_geometry. Draws pass their entry as the first
+// instance, so gl_InstanceIndex picks it. Needs GL_EXT_buffer_reference
+
+struct Vertex {
+  vec3 position;
+  float uv_x;
+  vec3 normal;
+  float uv_y;
+  vec4 color;
+};
+
+layout(buffer_reference, std430) readonly buffer VertexBuffer {
+  Vertex vertices[];
+};
+
+struct ObjectData {
+  mat4 worldMatrix;
+  // Inverse transpose of the world matrix
+  mat4 normalMatrix;
+  VertexBuffer vertexBuffer;
+};
+
+layout (set = 0, binding = 1, std430) readonly buffer ObjectBuffer {
+  ObjectData objects[];
+} objectBuffer;
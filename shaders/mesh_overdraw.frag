@@ -0,0 +1,20 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "input_structures.glsl"
+
+// Only fragments that pass the depth test are counted, the same ones the shading pass would pay for
+layout (early_fragment_tests) in;
+
+layout (set = 2, binding = 0, r32ui) uniform uimage2D overdrawImage;
+
+layout (location = 0) out vec4 outFragColor;
+
+void main()
+{
+  imageAtomicAdd(overdrawImage, ivec2(gl_FragCoord.xy), 1);
+
+  // The heatmap replaces the color afterwards
+  outFragColor = vec4(0.f);
+}
@@ -0,0 +1,25 @@
+#version 450
+
+#extension GL_GOOGLE_include_directive : require
+
+#include "input_structures.glsl"
+
+// Alpha tested materials have to discard before counting, so the depth test can't run ahead of the shader and
+// fragments it would reject are counted too, like the shading pass pays for them
+
+layout (location = 2) in vec2 inUV;
+
+layout (set = 2, binding = 0, r32ui) uniform uimage2D overdrawImage;
+
+layout (location = 0) out vec4 outFragColor;
+
+void main()
+{
+  vec4 texColor = texture(colorTex, inUV);
+  if (texColor.a * materialData.colorFactors.a < materialData.alpha_cutoff.x) discard;
+
+  imageAtomicAdd(overdrawImage, ivec2(gl_FragCoord.xy), 1);
+
+  // The heatmap replaces the color afterwards
+  outFragColor = vec4(0.f);
+}
@@ -0,0 +1,99 @@
+#include "vk_barriers.h"
+
+#include <vk_initializers.h>
+
+void vkutil::ImageStateTracker::track(VkImage image, VkImageAspectFlags aspect, ImageState state)
+{
+  images[image] = Entry{ aspect, state };
+}
+
+void vkutil::ImageStateTracker::forget(VkImage image)
+{
+  images.erase(image);
+}
+
+void vkutil::ImageStateTracker::discard(VkImage image)
+{
+  images.at(image).state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+}
+
+void vkutil::ImageStateTracker::acquired(VkImage image, VkPipelineStageFlags2 waitStage)
+{
+  images.at(image).state = ImageState{ VK_IMAGE_LAYOUT_UNDEFINED, waitStage, VK_ACCESS_2_NONE };
+}
+
+void vkutil::BarrierBatch::image(VkImage image, VkImageLayout newLayout, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+  ImageState current = tracker.state(image);
+
+  bool sameLayout = current.layout == newLayout;
+  bool readOnly = !(current.access & vkutil::WriteAccess) && !(dstAccess & vkutil::WriteAccess);
+
+  if (sameLayout && readOnly) {
+    // Another read of the same data, only needs a barrier when the earlier one didn't cover these stages
+    bool covered = !(dstStage & ~current.stage) && !(dstAccess & ~current.access);
+    tracker.set_state(image, ImageState{ newLayout, current.stage | dstStage, current.access | dstAccess });
+    if (covered) return;
+  } else {
+    tracker.set_state(image, ImageState{ newLayout, dstStage, dstAccess });
+  }
+
+  VkImageMemoryBarrier2 barrier = { .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+  barrier.srcStageMask = current.stage;
+  barrier.srcAccessMask = current.access & vkutil::WriteAccess;
+  barrier.dstStageMask = dstStage;
+  barrier.dstAccessMask = dstAccess;
+  barrier.oldLayout = current.layout;
+  barrier.newLayout = newLayout;
+  barrier.image = image;
+  barrier.subresourceRange = vkinit::image_subresource_range(tracker.aspect(image));
+
+  imageBarriers.push_back(barrier);
+}
+
+void vkutil::BarrierBatch::buffer(VkBuffer buffer, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage,
+                                  VkAccessFlags2 dstAccess, VkDeviceSize offset, VkDeviceSize size)
+{
+  VkBufferMemoryBarrier2 barrier = { .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
+  barrier.srcStageMask = srcStage;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstStageMask = dstStage;
+  barrier.dstAccessMask = dstAccess;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = buffer;
+  barrier.offset = offset;
+  barrier.size = size;
+
+  bufferBarriers.push_back(barrier);
+}
+
+void vkutil::BarrierBatch::memory(VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+  VkMemoryBarrier2 barrier = { .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+  barrier.srcStageMask = srcStage;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstStageMask = dstStage;
+  barrier.dstAccessMask = dstAccess;
+
+  memoryBarriers.push_back(barrier);
+}
+
+void vkutil::BarrierBatch::flush(VkCommandBuffer cmd)
+{
+  if (imageBarriers.empty() && bufferBarriers.empty() && memoryBarriers.empty()) return;
+
+  VkDependencyInfo depInfo = { .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+  depInfo.imageMemoryBarrierCount = (uint32_t)imageBarriers.size();
+  depInfo.pImageMemoryBarriers = imageBarriers.data();
+  depInfo.bufferMemoryBarrierCount = (uint32_t)bufferBarriers.size();
+  depInfo.pBufferMemoryBarriers = bufferBarriers.data();
+  depInfo.memoryBarrierCount = (uint32_t)memoryBarriers.size();
+  depInfo.pMemoryBarriers = memoryBarriers.data();
+
+  vkCmdPipelineBarrier2(cmd, &depInfo);
+
+  imageBarriers.clear();
+  bufferBarriers.clear();
+  memoryBarriers.clear();
+}
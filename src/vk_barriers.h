@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vk_types.h>
+#include <unordered_map>
+
+namespace vkutil {
+  // Only writes have to be made available, a barrier after reads just needs the execution dependency
+  constexpr VkAccessFlags2 WriteAccess = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                                         VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                         VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+  // Layout an image was left in, and the stages and accesses of its last use the next barrier has to wait for
+  struct ImageState {
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags2 stage = VK_PIPELINE_STAGE_2_NONE;
+    VkAccessFlags2 access = VK_ACCESS_2_NONE;
+  };
+
+  // Current state of every image the frame transitions, so barriers take their source from here instead of the caller.
+  // States follow recording order. Where that differs from execution order, across the async compute queue, the render
+  // graph resets them after the semaphore wait
+  struct ImageStateTracker {
+    void track(VkImage image, VkImageAspectFlags aspect, ImageState state = {});
+    void forget(VkImage image);
+
+    // The contents are not needed anymore, the next transition starts from UNDEFINED but still waits for the last use
+    void discard(VkImage image);
+    // Freshly acquired swapchain image, the first transition has to wait for the stages the acquire semaphore unblocks
+    void acquired(VkImage image, VkPipelineStageFlags2 waitStage);
+
+    const ImageState& state(VkImage image) const { return images.at(image).state; }
+    VkImageAspectFlags aspect(VkImage image) const { return images.at(image).aspect; }
+    void set_state(VkImage image, const ImageState& state) { images.at(image).state = state; }
+
+  private:
+    struct Entry {
+      VkImageAspectFlags aspect;
+      ImageState state;
+    };
+
+    std::unordered_map<VkImage, Entry> images;
+  };
+
+  // Collects image, buffer and global barriers and records them with one vkCmdPipelineBarrier2.
+  // Barriers of one batch are not ordered against each other, so an image or buffer range should only appear once
+  struct BarrierBatch {
+    BarrierBatch(ImageStateTracker& tracker) : tracker(tracker) {}
+
+    // Moves an image from its tracked state to the next use. Reads in the same layout that an earlier barrier
+    // already made visible are skipped, other reads are merged in so the next write waits for all of them
+    void image(VkImage image, VkImageLayout newLayout, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess);
+    void buffer(VkBuffer buffer, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage,
+                VkAccessFlags2 dstAccess, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+    void memory(VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess);
+
+    // Records everything collected so far and starts a new batch, does nothing when empty
+    void flush(VkCommandBuffer cmd);
+
+    const std::vector<VkImageMemoryBarrier2>& image_barriers() const { return imageBarriers; }
+    const std::vector<VkBufferMemoryBarrier2>& buffer_barriers() const { return bufferBarriers; }
+
+  private:
+    ImageStateTracker& tracker;
+
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+    std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+    std::vector<VkMemoryBarrier2> memoryBarriers;
+  };
+};
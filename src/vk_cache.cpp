@@ -0,0 +1,452 @@
+#include "vk_cache.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+uint64_t vkutil::hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+  const uint8_t* bytes = (const uint8_t*)data;
+  uint64_t hash = seed;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+std::optional<AllocatedImage> ImageCache::acquire(uint64_t hash)
+{
+  auto it = entries.find(hash);
+  if (it == entries.end()) return {};
+
+  it->second.refCount++;
+  return it->second.image;
+}
+
+void ImageCache::insert(uint64_t hash, const AllocatedImage& image)
+{
+  entries[hash] = Entry{ image, 1 };
+  hashByImage[image.image] = hash;
+}
+
+void ImageCache::release(VulkanEngine* engine, VkImage image)
+{
+  auto hashIt = hashByImage.find(image);
+  if (hashIt == hashByImage.end()) return;
+
+  auto it = entries.find(hashIt->second);
+  if (--it->second.refCount > 0) return;
+
+  // Last user is gone, so the image can be freed
+  engine->destroy_image(it->second.image);
+  entries.erase(it);
+  hashByImage.erase(hashIt);
+}
+
+void ImageCache::destroy(VulkanEngine* engine)
+{
+  if (!entries.empty()) fmt::print("Image cache still holds {} images at shutdown\n", entries.size());
+
+  for (auto& [hash, entry] : entries) {
+    engine->destroy_image(entry.image);
+  }
+  entries.clear();
+  hashByImage.clear();
+}
+
+bool SamplerCache::Key::operator==(const Key& other) const
+{
+  return memcmp(this, &other, sizeof(Key)) == 0;
+}
+
+VkSampler SamplerCache::get(VkDevice device, const VkSamplerCreateInfo& info)
+{
+  // Extension structs aren't part of the key, so they can't be shared safely
+  assert(info.pNext == nullptr);
+
+  Key key{};
+  key.flags = info.flags;
+  key.magFilter = info.magFilter;
+  key.minFilter = info.minFilter;
+  key.mipmapMode = info.mipmapMode;
+  key.addressModeU = info.addressModeU;
+  key.addressModeV = info.addressModeV;
+  key.addressModeW = info.addressModeW;
+  key.mipLodBias = info.mipLodBias;
+  key.anisotropyEnable = info.anisotropyEnable;
+  key.maxAnisotropy = info.maxAnisotropy;
+  key.compareEnable = info.compareEnable;
+  key.compareOp = info.compareOp;
+  key.minLod = info.minLod;
+  key.maxLod = info.maxLod;
+  key.borderColor = info.borderColor;
+  key.unnormalizedCoordinates = info.unnormalizedCoordinates;
+
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    it->second.refCount++;
+    return it->second.sampler;
+  }
+
+  VkSampler newSampler;
+  VK_CHECK(vkCreateSampler(device, &info, nullptr, &newSampler));
+
+  entries[key] = Entry{ newSampler, 1 };
+  keyBySampler[newSampler] = key;
+
+  return newSampler;
+}
+
+void SamplerCache::release(VkDevice device, VkSampler sampler)
+{
+  auto keyIt = keyBySampler.find(sampler);
+  if (keyIt == keyBySampler.end()) return;
+
+  auto it = entries.find(keyIt->second);
+  if (--it->second.refCount > 0) return;
+
+  vkDestroySampler(device, sampler, nullptr);
+  entries.erase(it);
+  keyBySampler.erase(keyIt);
+}
+
+void SamplerCache::destroy(VkDevice device)
+{
+  if (!entries.empty()) fmt::print("Sampler cache still holds {} samplers at shutdown\n", entries.size());
+
+  for (auto& [key, entry] : entries) {
+    vkDestroySampler(device, entry.sampler, nullptr);
+  }
+  entries.clear();
+  keyBySampler.clear();
+}
+
+void DescriptorSetCache::init(VkDevice device, uint32_t initialSets, std::span<DescriptorAllocatorGrowable::PoolSizeRatio> poolRatios,
+                              const PoolProfile& learned)
+{
+  allocator.init(device, initialSets, poolRatios, learned);
+}
+
+VkDescriptorSet DescriptorSetCache::get(VkDevice device, VkDescriptorSetLayout layout, DescriptorWriter& writer)
+{
+  Key key;
+  key.push_back((uint64_t)layout);
+  for (const VkWriteDescriptorSet& write : writer.get_writes()) {
+    key.push_back(write.dstBinding);
+    key.push_back(write.descriptorType);
+    if (write.pImageInfo) {
+      key.push_back((uint64_t)write.pImageInfo->sampler);
+      key.push_back((uint64_t)write.pImageInfo->imageView);
+      key.push_back(write.pImageInfo->imageLayout);
+    } else {
+      key.push_back((uint64_t)write.pBufferInfo->buffer);
+      key.push_back(write.pBufferInfo->offset);
+      key.push_back(write.pBufferInfo->range);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    it->second.refCount++;
+    return it->second.set;
+  }
+
+  // Reuse a released set of the same layout before growing the pools
+  VkDescriptorSet set;
+  std::vector<VkDescriptorSet>& free = freeSets[layout];
+  if (!free.empty()) {
+    set = free.back();
+    free.pop_back();
+  } else {
+    set = allocator.allocate(device, layout);
+  }
+
+  writer.update_set(device, set);
+
+  entries[key] = Entry{ set, 1 };
+  keyBySet[set] = std::move(key);
+
+  return set;
+}
+
+void DescriptorSetCache::release(VkDescriptorSet set)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto keyIt = keyBySet.find(set);
+  if (keyIt == keyBySet.end()) return;
+
+  auto it = entries.find(keyIt->second);
+  if (--it->second.refCount > 0) return;
+
+  freeSets[(VkDescriptorSetLayout)keyIt->second[0]].push_back(set);
+  entries.erase(it);
+  keyBySet.erase(keyIt);
+}
+
+void DescriptorSetCache::destroy(VkDevice device)
+{
+  if (!entries.empty()) fmt::print("Descriptor set cache still holds {} sets at shutdown\n", entries.size());
+
+  // Sets go away with their pools
+  allocator.destroy_pools(device);
+  entries.clear();
+  keyBySet.clear();
+  freeSets.clear();
+}
+
+VkDescriptorSetLayout LayoutCache::get_set_layout(VkDevice device, DescriptorLayoutBuilder builder, VkShaderStageFlags stages,
+                                                  VkDescriptorSetLayoutCreateFlags flags)
+{
+  std::sort(builder.bindings.begin(), builder.bindings.end(),
+            [](const VkDescriptorSetLayoutBinding& a, const VkDescriptorSetLayoutBinding& b) { return a.binding < b.binding; });
+
+  Key key;
+  key.push_back(flags);
+  for (VkDescriptorSetLayoutBinding& binding : builder.bindings) {
+    binding.stageFlags |= stages;
+
+    key.push_back(binding.binding);
+    key.push_back(binding.descriptorType);
+    key.push_back(binding.descriptorCount);
+    key.push_back(binding.stageFlags);
+  }
+
+  auto it = setLayouts.find(key);
+  if (it != setLayouts.end()) return it->second;
+
+  VkDescriptorSetLayout layout = builder.build(device, 0, nullptr, flags);
+  setLayouts[key] = layout;
+  return layout;
+}
+
+VkDescriptorSetLayout LayoutCache::get_set_layout(VkDevice device, const ShaderReflection& reflection, uint32_t set,
+                                                  VkDescriptorSetLayoutCreateFlags flags)
+{
+  DescriptorLayoutBuilder builder;
+  if (const ShaderReflection::Set* reflected = reflection.find_set(set)) builder.bindings = reflected->bindings;
+
+  return get_set_layout(device, builder, 0, flags);
+}
+
+VkPipelineLayout LayoutCache::get_pipeline_layout(VkDevice device, std::span<const VkDescriptorSetLayout> setLayouts,
+                                                  std::span<const VkPushConstantRange> pushConstantRanges)
+{
+  Key key;
+  key.push_back(setLayouts.size());
+  for (VkDescriptorSetLayout layout : setLayouts) {
+    key.push_back((uint64_t)layout);
+  }
+  for (const VkPushConstantRange& range : pushConstantRanges) {
+    key.push_back(range.stageFlags);
+    key.push_back(range.offset);
+    key.push_back(range.size);
+  }
+
+  auto it = pipelineLayouts.find(key);
+  if (it != pipelineLayouts.end()) return it->second;
+
+  VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+  layoutInfo.setLayoutCount = (uint32_t)setLayouts.size();
+  layoutInfo.pSetLayouts = setLayouts.data();
+  layoutInfo.pushConstantRangeCount = (uint32_t)pushConstantRanges.size();
+  layoutInfo.pPushConstantRanges = pushConstantRanges.data();
+
+  VkPipelineLayout layout;
+  VK_CHECK(vkCreatePipelineLayout(device, &layoutInfo, nullptr, &layout));
+
+  pipelineLayouts[key] = layout;
+  return layout;
+}
+
+VkPipelineLayout LayoutCache::get_pipeline_layout(VkDevice device, const ShaderReflection& reflection, VkDescriptorSetLayoutCreateFlags flags)
+{
+  std::vector<VkDescriptorSetLayout> layouts;
+  uint32_t setCount = reflection.sets.empty() ? 0 : reflection.sets.back().set + 1;
+  for (uint32_t set = 0; set < setCount; set++) {
+    layouts.push_back(get_set_layout(device, reflection, set, flags));
+  }
+
+  std::span<const VkPushConstantRange> ranges;
+  if (reflection.pushConstants.size > 0) ranges = { &reflection.pushConstants, 1 };
+
+  return get_pipeline_layout(device, layouts, ranges);
+}
+
+void LayoutCache::destroy(VkDevice device)
+{
+  for (auto& [key, layout] : pipelineLayouts) {
+    vkDestroyPipelineLayout(device, layout, nullptr);
+  }
+  for (auto& [key, layout] : setLayouts) {
+    vkDestroyDescriptorSetLayout(device, layout, nullptr);
+  }
+  pipelineLayouts.clear();
+  setLayouts.clear();
+}
+
+void PipelineVariantCache::init(VkDevice device, Build&& build)
+{
+  this->device = device;
+  this->build = std::move(build);
+
+  stopping = false;
+  worker = std::thread(&PipelineVariantCache::run, this);
+}
+
+void PipelineVariantCache::enqueue(uint64_t key)
+{
+  if (queued.contains(key) || failed.contains(key)) return;
+
+  queued.insert(key);
+  queue.push_back(key);
+  wake.notify_one();
+}
+
+VkPipeline PipelineVariantCache::find(uint64_t key)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = pipelines.find(key);
+  if (it != pipelines.end()) return it->second;
+
+  enqueue(key);
+  return VK_NULL_HANDLE;
+}
+
+VkPipeline PipelineVariantCache::get(uint64_t key)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pipelines.find(key);
+    if (it != pipelines.end()) return it->second;
+  }
+
+  VkPipeline pipeline = build(key);
+  if (pipeline == VK_NULL_HANDLE) return VK_NULL_HANDLE;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto [it, inserted] = pipelines.try_emplace(key, pipeline);
+  // The background thread finished the same key first
+  if (!inserted) vkDestroyPipeline(device, pipeline, nullptr);
+  return it->second;
+}
+
+void PipelineVariantCache::precompile(uint64_t key)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!pipelines.contains(key)) enqueue(key);
+}
+
+std::unordered_map<uint64_t, VkPipeline> PipelineVariantCache::build_all()
+{
+  std::vector<uint64_t> keys;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& [key, pipeline] : pipelines) {
+      keys.push_back(key);
+    }
+  }
+
+  std::unordered_map<uint64_t, VkPipeline> rebuilt;
+  for (uint64_t key : keys) {
+    VkPipeline pipeline = build(key);
+    if (pipeline == VK_NULL_HANDLE) {
+      for (auto& [k, p] : rebuilt) {
+        vkDestroyPipeline(device, p, nullptr);
+      }
+      return {};
+    }
+    rebuilt[key] = pipeline;
+  }
+  return rebuilt;
+}
+
+void PipelineVariantCache::replace(std::unordered_map<uint64_t, VkPipeline>&& rebuilt, const std::function<void(VkPipeline)>& retire)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  generation++;
+  failed.clear();
+
+  for (auto& [key, pipeline] : pipelines) {
+    retire(pipeline);
+    if (!rebuilt.contains(key)) enqueue(key);
+  }
+  pipelines = std::move(rebuilt);
+}
+
+void PipelineVariantCache::run()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (true) {
+    wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+    if (stopping) return;
+
+    uint64_t key = queue.front();
+    queue.pop_front();
+
+    if (pipelines.contains(key)) {
+      queued.erase(key);
+      continue;
+    }
+
+    uint64_t startGeneration = generation;
+    lock.unlock();
+    VkPipeline pipeline = build(key);
+    lock.lock();
+
+    // Built from the shaders that were just replaced
+    if (startGeneration != generation) {
+      vkDestroyPipeline(device, pipeline, nullptr);
+      queue.push_back(key);
+      continue;
+    }
+
+    queued.erase(key);
+    if (pipeline == VK_NULL_HANDLE) {
+      failed.insert(key);
+      continue;
+    }
+
+    auto [it, inserted] = pipelines.try_emplace(key, pipeline);
+    if (!inserted) vkDestroyPipeline(device, pipeline, nullptr);
+  }
+}
+
+void PipelineVariantCache::destroy()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  if (worker.joinable()) worker.join();
+
+  for (auto& [key, pipeline] : pipelines) {
+    vkDestroyPipeline(device, pipeline, nullptr);
+  }
+  pipelines.clear();
+  queue.clear();
+  queued.clear();
+  failed.clear();
+}
+
+size_t PipelineVariantCache::size()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return pipelines.size();
+}
+
+size_t PipelineVariantCache::pending()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return queued.size();
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <vk_types.h>
+#include <vk_descriptors.h>
+#include <vk_reflect.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// Forward declaration
+class VulkanEngine;
+
+namespace vkutil {
+  // FNV-1a, used for content hashing of asset data and cache keys
+  uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
+};
+
+// Engine-wide cache of decoded textures, keyed by a hash of the encoded file contents.
+// Every acquire/insert takes a reference that must be given back through release
+struct ImageCache {
+  struct Entry {
+    AllocatedImage image;
+    uint32_t refCount;
+  };
+
+  std::optional<AllocatedImage> acquire(uint64_t hash);
+  void insert(uint64_t hash, const AllocatedImage& image);
+  void release(VulkanEngine* engine, VkImage image);
+
+  void destroy(VulkanEngine* engine);
+
+  size_t size() const { return entries.size(); }
+
+private:
+  std::unordered_map<uint64_t, Entry> entries;
+  std::unordered_map<VkImage, uint64_t> hashByImage;
+};
+
+// Engine-wide cache of samplers, keyed by the VkSamplerCreateInfo fields that define them
+struct SamplerCache {
+  struct Key {
+    VkSamplerCreateFlags flags;
+    VkFilter magFilter;
+    VkFilter minFilter;
+    VkSamplerMipmapMode mipmapMode;
+    VkSamplerAddressMode addressModeU;
+    VkSamplerAddressMode addressModeV;
+    VkSamplerAddressMode addressModeW;
+    float mipLodBias;
+    VkBool32 anisotropyEnable;
+    float maxAnisotropy;
+    VkBool32 compareEnable;
+    VkCompareOp compareOp;
+    float minLod;
+    float maxLod;
+    VkBorderColor borderColor;
+    VkBool32 unnormalizedCoordinates;
+
+    bool operator==(const Key& other) const;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return vkutil::hash_bytes(&key, sizeof(Key)); }
+  };
+
+  struct Entry {
+    VkSampler sampler;
+    uint32_t refCount;
+  };
+
+  VkSampler get(VkDevice device, const VkSamplerCreateInfo& info);
+  void release(VkDevice device, VkSampler sampler);
+
+  void destroy(VkDevice device);
+
+  size_t size() const { return entries.size(); }
+
+private:
+  std::unordered_map<Key, Entry, KeyHash> entries;
+  std::unordered_map<VkSampler, Key> keyBySampler;
+};
+
+// Engine-wide cache of descriptor sets, keyed by the layout and everything written into the set, so sets binding the
+// same resources are shared and only written once. Every get takes a reference that must be given back through
+// release. Unreferenced sets are kept per layout and rewritten on a later miss, so a set may only be released once no
+// frame in flight binds it. Locked, loader threads can share it
+struct DescriptorSetCache {
+  void init(VkDevice device, uint32_t initialSets, std::span<DescriptorAllocatorGrowable::PoolSizeRatio> poolRatios,
+            const PoolProfile& learned = {});
+
+  VkDescriptorSet get(VkDevice device, VkDescriptorSetLayout layout, DescriptorWriter& writer);
+  void release(VkDescriptorSet set);
+
+  void destroy(VkDevice device);
+
+  size_t size() const { return entries.size(); }
+  PoolProfile profile() const { return allocator.profile(); }
+
+private:
+  // Layout, then binding, type and resource handles of every write
+  using Key = std::vector<uint64_t>;
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return vkutil::hash_bytes(key.data(), key.size() * sizeof(uint64_t)); }
+  };
+
+  struct Entry {
+    VkDescriptorSet set;
+    uint32_t refCount;
+  };
+
+  std::mutex mutex;
+  DescriptorAllocatorGrowable allocator;
+
+  std::unordered_map<Key, Entry, KeyHash> entries;
+  std::unordered_map<VkDescriptorSet, Key> keyBySet;
+  std::unordered_map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> freeSets;
+};
+
+// Engine-wide cache of descriptor set and pipeline layouts, keyed by their contents. Pipelines with the same interface
+// share one VkPipelineLayout and sets with the same bindings one VkDescriptorSetLayout, so switching between them keeps
+// the bound sets valid. Layouts live until shutdown
+struct LayoutCache {
+  // Bindings get the stages on top of their own
+  VkDescriptorSetLayout get_set_layout(VkDevice device, DescriptorLayoutBuilder builder, VkShaderStageFlags stages = 0,
+                                       VkDescriptorSetLayoutCreateFlags flags = 0);
+  // Empty layout when the shaders don't use the set
+  VkDescriptorSetLayout get_set_layout(VkDevice device, const ShaderReflection& reflection, uint32_t set,
+                                       VkDescriptorSetLayoutCreateFlags flags = 0);
+
+  VkPipelineLayout get_pipeline_layout(VkDevice device, std::span<const VkDescriptorSetLayout> setLayouts,
+                                       std::span<const VkPushConstantRange> pushConstantRanges);
+  // Sets up to the highest one the shaders use, the flags apply to all of them
+  VkPipelineLayout get_pipeline_layout(VkDevice device, const ShaderReflection& reflection, VkDescriptorSetLayoutCreateFlags flags = 0);
+
+  void destroy(VkDevice device);
+
+private:
+  using Key = std::vector<uint64_t>;
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return vkutil::hash_bytes(key.data(), key.size() * sizeof(uint64_t)); }
+  };
+
+  std::unordered_map<Key, VkDescriptorSetLayout, KeyHash> setLayouts;
+  std::unordered_map<Key, VkPipelineLayout, KeyHash> pipelineLayouts;
+};
+
+// Pipelines of one family by permutation key, each created by the family's build function the first time it's asked
+// for. Missing pipelines are compiled on a background thread, so the render loop never waits on one it only finds
+struct PipelineVariantCache {
+  // Called from the background thread and whoever calls get or build_all, VK_NULL_HANDLE when the build fails
+  using Build = std::function<VkPipeline(uint64_t key)>;
+
+  void init(VkDevice device, Build&& build);
+
+  // VK_NULL_HANDLE until the pipeline is ready, the first call queues it for the background thread
+  VkPipeline find(uint64_t key);
+  // Builds the pipeline on the calling thread when it's not ready yet, never from the render loop
+  VkPipeline get(uint64_t key);
+  void precompile(uint64_t key);
+
+  // Builds every pipeline in the cache again, for when the shaders changed. Nothing is replaced yet, an empty map
+  // means one of them failed
+  std::unordered_map<uint64_t, VkPipeline> build_all();
+  // Swaps in the rebuilt pipelines, the old ones go to retire. Keys the background thread finished in the meantime
+  // are compiled again
+  void replace(std::unordered_map<uint64_t, VkPipeline>&& rebuilt, const std::function<void(VkPipeline)>& retire);
+
+  void destroy();
+
+  size_t size();
+  size_t pending();
+
+private:
+  void run();
+  // With the mutex held
+  void enqueue(uint64_t key);
+
+  VkDevice device;
+  Build build;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::unordered_map<uint64_t, VkPipeline> pipelines;
+  // Waiting for or being compiled by the background thread
+  std::deque<uint64_t> queue;
+  std::unordered_set<uint64_t> queued;
+  // Not queued again until the pipelines are replaced
+  std::unordered_set<uint64_t> failed;
+  // Bumped when the pipelines are replaced, background builds that started before are dropped
+  uint64_t generation = 0;
+  bool stopping = false;
+  std::thread worker;
+};
@@ -1,5 +1,82 @@
 #include "vk_descriptors.h"
 
+#include <stdexcept>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+
+namespace {
+  std::shared_mutex layoutCountsMutex;
+  std::unordered_map<VkDescriptorSetLayout, DescriptorCounts> layoutCounts;
+
+  // Room on top of a learned peak, so small variations between frames still fit
+  constexpr float ProfileHeadroom = 1.25f;
+}
+
+void PoolProfile::add(const PoolProfile& other)
+{
+  sets += other.sets;
+  for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+    descriptors[i] += other.descriptors[i];
+  }
+}
+
+void PoolProfile::merge(const PoolProfile& other)
+{
+  sets = std::max(sets, other.sets);
+  for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+    descriptors[i] = std::max(descriptors[i], other.descriptors[i]);
+  }
+}
+
+DescriptorCounts vkutil::layout_descriptor_counts(VkDescriptorSetLayout layout)
+{
+  std::shared_lock lock(layoutCountsMutex);
+
+  auto it = layoutCounts.find(layout);
+  return it != layoutCounts.end() ? it->second : DescriptorCounts{};
+}
+
+std::unordered_map<std::string, PoolProfile> vkutil::load_pool_profiles(const char* path)
+{
+  std::unordered_map<std::string, PoolProfile> profiles;
+
+  // One allocator per line: name, sets, then the descriptor count of every type
+  std::ifstream file(path);
+  std::string name;
+  while (file >> name) {
+    PoolProfile profile;
+    file >> profile.sets;
+    for (uint32_t& count : profile.descriptors) {
+      file >> count;
+    }
+    if (!file) break;
+
+    profiles[name] = profile;
+  }
+
+  return profiles;
+}
+
+void vkutil::save_pool_profiles(const char* path, const std::unordered_map<std::string, PoolProfile>& profiles)
+{
+  std::ofstream file(path);
+  if (!file.is_open()) {
+    fmt::print("Failed to write descriptor pool profiles to {}\n", path);
+    return;
+  }
+
+  for (auto& [name, profile] : profiles) {
+    file << name << " " << profile.sets;
+    for (uint32_t count : profile.descriptors) {
+      file << " " << count;
+    }
+    file << "\n";
+  }
+}
+
 void DescriptorLayoutBuilder::add_binding(uint32_t binding, VkDescriptorType type)
 {
   VkDescriptorSetLayoutBinding newbind {};
@@ -31,6 +108,14 @@ VkDescriptorSetLayout DescriptorLayoutBuilder::build(VkDevice device, VkShaderSt
   VkDescriptorSetLayout set;
   VK_CHECK(vkCreateDescriptorSetLayout(device, &info, nullptr, &set));
 
+  DescriptorCounts counts{};
+  for (auto& b : bindings) {
+    if (b.descriptorType < DescriptorTypeCount) counts[b.descriptorType] += b.descriptorCount;
+  }
+
+  std::unique_lock lock(layoutCountsMutex);
+  layoutCounts[set] = counts;
+
   return set;
 }
 
@@ -96,27 +181,56 @@ VkDescriptorPool DescriptorAllocatorGrowable::get_pool(VkDevice device)
 
 VkDescriptorPool DescriptorAllocatorGrowable::create_pool(VkDevice device, uint32_t setCount, std::span<PoolSizeRatio> poolRatios)
 {
-  std::vector<VkDescriptorPoolSize> poolSizes;
+  PoolProfile capacity;
+  capacity.sets = setCount;
   for (PoolSizeRatio ratio : poolRatios) {
+    capacity.descriptors[ratio.type] = uint32_t(std::ceil(ratio.ratio * setCount));
+  }
+
+  return create_pool(device, capacity);
+}
+
+VkDescriptorPool DescriptorAllocatorGrowable::create_pool(VkDevice device, const PoolProfile& capacity)
+{
+  std::vector<VkDescriptorPoolSize> poolSizes;
+  for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+    if (capacity.descriptors[i] == 0) continue;
     poolSizes.push_back(VkDescriptorPoolSize{
-        .type = ratio.type,
-        .descriptorCount = uint32_t(ratio.ratio * setCount)
+        .type = (VkDescriptorType)i,
+        .descriptorCount = capacity.descriptors[i]
       });
   }
 
   VkDescriptorPoolCreateInfo pool_info = {};
   pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
   pool_info.flags = 0;
-  pool_info.maxSets = setCount;
+  pool_info.maxSets = capacity.sets;
   pool_info.poolSizeCount = (uint32_t)poolSizes.size();
   pool_info.pPoolSizes = poolSizes.data();
 
   VkDescriptorPool newPool;
   vkCreateDescriptorPool(device, &pool_info, nullptr, &newPool);
+
+  usage[newPool] = PoolUsage{ capacity, {} };
+  poolStats.poolsCreated++;
+
   return newPool;
 }
 
-void DescriptorAllocatorGrowable::init(VkDevice device, uint32_t maxSets, std::span<PoolSizeRatio> poolRatios)
+void DescriptorAllocatorGrowable::learn_ratios()
+{
+  // Types the workload used get their observed share, the others keep the configured ratio in case they show up
+  for (PoolSizeRatio& ratio : ratios) {
+    if (peak.descriptors[ratio.type] > 0) ratio.ratio = float(peak.descriptors[ratio.type]) / peak.sets;
+  }
+  for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+    if (peak.descriptors[i] == 0) continue;
+    bool known = std::any_of(ratios.begin(), ratios.end(), [&](const PoolSizeRatio& r) { return r.type == (VkDescriptorType)i; });
+    if (!known) ratios.push_back({ (VkDescriptorType)i, float(peak.descriptors[i]) / peak.sets });
+  }
+}
+
+void DescriptorAllocatorGrowable::init(VkDevice device, uint32_t maxSets, std::span<PoolSizeRatio> poolRatios, const PoolProfile& learned)
 {
   ratios.clear();
 
@@ -124,23 +238,72 @@ void DescriptorAllocatorGrowable::init(VkDevice device, uint32_t maxSets, std::s
     ratios.push_back(r);
   }
 
-  VkDescriptorPool newPool = create_pool(device, maxSets, poolRatios);
+  peak = learned;
+  if (peak.sets > 0) learn_ratios();
 
-  setsPerPool = maxSets * 1.5;
+  uint32_t setCount = std::max(maxSets, uint32_t(peak.sets * ProfileHeadroom));
+  VkDescriptorPool newPool = create_pool(device, setCount, ratios);
+
+  setsPerPool = setCount * 1.5;
+  if (setsPerPool > 4092) setsPerPool = 4092;
 
   readyPools.push_back(newPool);
 }
 
 void DescriptorAllocatorGrowable::clear_pools(VkDevice device)
 {
-  for (auto p : readyPools) {
-    vkResetDescriptorPool(device, p, 0);
+  // Usage of the period that just ended
+  PoolProfile used;
+  PoolProfile reserved;
+  for (auto& [pool, poolUsage] : usage) {
+    used.add(poolUsage.used);
+    reserved.add(poolUsage.capacity);
   }
+
+  uint32_t fullReserved = 0;
+  uint32_t fullUnused = 0;
   for (auto p : fullPools) {
+    const PoolUsage& poolUsage = usage[p];
+    for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+      fullReserved += poolUsage.capacity.descriptors[i];
+      fullUnused += poolUsage.capacity.descriptors[i] - poolUsage.used.descriptors[i];
+    }
+  }
+
+  poolStats.used = used;
+  poolStats.reserved = reserved;
+  poolStats.fragmentation = fullReserved > 0 ? float(fullUnused) / fullReserved : 0.f;
+
+  peak.merge(used);
+
+  if (!fullPools.empty()) {
+    // The period outgrew its first pool, replace them all with one that holds the peak
+    destroy_pools(device);
+    learn_ratios();
+
+    uint32_t setCount = uint32_t(peak.sets * ProfileHeadroom);
+    readyPools.push_back(create_pool(device, setCount, ratios));
+
+    setsPerPool = std::min(uint32_t(setCount * 1.5), 4092u);
+    return;
+  }
+
+  for (auto p : readyPools) {
     vkResetDescriptorPool(device, p, 0);
-    readyPools.push_back(p);
+    usage[p].used = {};
   }
-  fullPools.clear();
+}
+
+PoolProfile DescriptorAllocatorGrowable::profile() const
+{
+  PoolProfile current;
+  for (auto& [pool, poolUsage] : usage) {
+    current.add(poolUsage.used);
+  }
+
+  PoolProfile result = peak;
+  result.merge(current);
+  return result;
 }
 
 void DescriptorAllocatorGrowable::destroy_pools(VkDevice device)
@@ -153,6 +316,7 @@ void DescriptorAllocatorGrowable::destroy_pools(VkDevice device)
     vkDestroyDescriptorPool(device, p, nullptr);
   }
   fullPools.clear();
+  usage.clear();
 }
 
 VkDescriptorSet DescriptorAllocatorGrowable::allocate(VkDevice device, VkDescriptorSetLayout layout, void* pNext)
@@ -170,6 +334,9 @@ VkDescriptorSet DescriptorAllocatorGrowable::allocate(VkDevice device, VkDescrip
   VkResult result = vkAllocateDescriptorSets(device, &allocInfo, &ds);
 
   if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL) {
+    if (result == VK_ERROR_OUT_OF_POOL_MEMORY) poolStats.outOfPoolMemory++;
+    else poolStats.fragmentedPool++;
+
     fullPools.push_back(poolToUse);
 
     poolToUse = get_pool(device);
@@ -178,58 +345,274 @@ VkDescriptorSet DescriptorAllocatorGrowable::allocate(VkDevice device, VkDescrip
     VK_CHECK(vkAllocateDescriptorSets(device, &allocInfo, &ds));
   }
 
+  PoolProfile& used = usage[poolToUse].used;
+  DescriptorCounts counts = vkutil::layout_descriptor_counts(layout);
+  used.sets++;
+  for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+    used.descriptors[i] += counts[i];
+  }
+
   readyPools.push_back(poolToUse);
   return ds;
 }
 
-void DescriptorWriter::write_image(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type)
+namespace {
+  std::mutex threadSlotMutex;
+  std::vector<uint32_t> freeThreadSlots;
+  uint32_t nextThreadSlot = 0;
+
+  // Slot of the calling thread in every DescriptorAllocatorPerThread, taken on its first allocation. It goes back to
+  // the free list when the thread exits, so the next thread reuses that slot's allocator and pools
+  struct ThreadSlot {
+    uint32_t index;
+
+    ThreadSlot()
+    {
+      std::lock_guard lock(threadSlotMutex);
+      if (!freeThreadSlots.empty()) {
+        index = freeThreadSlots.back();
+        freeThreadSlots.pop_back();
+      } else {
+        if (nextThreadSlot == DescriptorAllocatorPerThread::MaxThreads) {
+          throw std::runtime_error("Too many threads allocating descriptors at once");
+        }
+        index = nextThreadSlot++;
+      }
+    }
+
+    ~ThreadSlot()
+    {
+      std::lock_guard lock(threadSlotMutex);
+      freeThreadSlots.push_back(index);
+    }
+  };
+
+  thread_local ThreadSlot threadSlot;
+}
+
+void DescriptorAllocatorPerThread::init(VkDevice device, uint32_t initialSets, std::span<PoolSizeRatio> poolRatios, const PoolProfile& learned)
 {
-  VkDescriptorImageInfo& info = imageInfos.emplace_back(VkDescriptorImageInfo{
-      .sampler = sampler,
-      .imageView = image,
-      .imageLayout = layout
-    });
+  ratios.assign(poolRatios.begin(), poolRatios.end());
+  this->initialSets = initialSets;
+  this->learned = learned;
+
+  // The thread setting it up is usually the one recording, no need to wait for its first allocation
+  local(device);
+}
+
+DescriptorAllocatorGrowable& DescriptorAllocatorPerThread::local(VkDevice device)
+{
+  uint32_t slot = threadSlot.index;
+
+  // Only this thread ever touches its slot while allocating
+  if (!initialized[slot]) {
+    allocators[slot].init(device, initialSets, ratios, learned);
+    initialized[slot] = true;
+  }
 
-  VkWriteDescriptorSet write = { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+  return allocators[slot];
+}
+
+VkDescriptorSet DescriptorAllocatorPerThread::allocate(VkDevice device, VkDescriptorSetLayout layout, void* pNext)
+{
+  return local(device).allocate(device, layout, pNext);
+}
+
+void DescriptorAllocatorPerThread::clear_pools(VkDevice device)
+{
+  for (uint32_t i = 0; i < MaxThreads; i++) {
+    if (initialized[i]) allocators[i].clear_pools(device);
+  }
+}
+
+DescriptorAllocatorGrowable::Stats DescriptorAllocatorPerThread::stats() const
+{
+  DescriptorAllocatorGrowable::Stats total;
+  for (uint32_t i = 0; i < MaxThreads; i++) {
+    if (!initialized[i]) continue;
+
+    const DescriptorAllocatorGrowable::Stats& threadStats = allocators[i].stats();
+    total.poolsCreated += threadStats.poolsCreated;
+    total.outOfPoolMemory += threadStats.outOfPoolMemory;
+    total.fragmentedPool += threadStats.fragmentedPool;
+    total.used.add(threadStats.used);
+    total.reserved.add(threadStats.reserved);
+    total.fragmentation = std::max(total.fragmentation, threadStats.fragmentation);
+  }
+  return total;
+}
+
+PoolProfile DescriptorAllocatorPerThread::profile() const
+{
+  PoolProfile peak = learned;
+  for (uint32_t i = 0; i < MaxThreads; i++) {
+    if (initialized[i]) peak.merge(allocators[i].profile());
+  }
+  return peak;
+}
+
+void DescriptorAllocatorPerThread::destroy_pools(VkDevice device)
+{
+  for (uint32_t i = 0; i < MaxThreads; i++) {
+    if (initialized[i]) allocators[i].destroy_pools(device);
+    initialized[i] = false;
+  }
+}
+
+VkWriteDescriptorSet& DescriptorWriter::next_write(int binding, VkDescriptorType type)
+{
+  if (writeCount == MaxWrites) throw std::runtime_error("Too many writes in one descriptor writer");
+
+  VkWriteDescriptorSet& write = writes[writeCount];
+  write = { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
   write.dstBinding = binding;
   write.dstSet = VK_NULL_HANDLE; // to be filled later
   write.descriptorCount = 1;
   write.descriptorType = type;
-  write.pImageInfo = &info;
 
-  writes.push_back(write);
+  return write;
+}
+
+void DescriptorWriter::write_image(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type)
+{
+  VkWriteDescriptorSet& write = next_write(binding, type);
+
+  imageInfos[writeCount] = VkDescriptorImageInfo{
+    .sampler = sampler,
+    .imageView = image,
+    .imageLayout = layout
+  };
+  write.pImageInfo = &imageInfos[writeCount];
+
+  writeCount++;
 }
 
 void DescriptorWriter::write_buffer(int binding, VkBuffer buffer, size_t size, size_t offset, VkDescriptorType type)
 {
-  VkDescriptorBufferInfo& info = bufferInfos.emplace_back(VkDescriptorBufferInfo{
-      .buffer = buffer,
-      .offset = offset,
-      .range = size
-    });
+  VkWriteDescriptorSet& write = next_write(binding, type);
 
-  VkWriteDescriptorSet write = { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-  write.dstBinding = binding;
-  write.dstSet = VK_NULL_HANDLE; // to be filled later
-  write.descriptorCount = 1;
-  write.descriptorType = type;
-  write.pBufferInfo = &info;
+  bufferInfos[writeCount] = VkDescriptorBufferInfo{
+    .buffer = buffer,
+    .offset = offset,
+    .range = size
+  };
+  write.pBufferInfo = &bufferInfos[writeCount];
 
-  writes.push_back(write);
+  writeCount++;
 }
 
 void DescriptorWriter::clear()
 {
-  imageInfos.clear();
-  writes.clear();
-  bufferInfos.clear();
+  writeCount = 0;
 }
 
 void DescriptorWriter::update_set(VkDevice device, VkDescriptorSet set)
 {
-  for (VkWriteDescriptorSet& write : writes) {
-    write.dstSet = set;
+  for (uint32_t i = 0; i < writeCount; i++) {
+    writes[i].dstSet = set;
   }
 
-  vkUpdateDescriptorSets(device, (uint32_t)writes.size(), writes.data(), 0, nullptr);
+  vkUpdateDescriptorSets(device, writeCount, writes.data(), 0, nullptr);
+}
+
+void DescriptorBufferAllocator::init(VkDevice device, const VkPhysicalDeviceDescriptorBufferPropertiesEXT& properties,
+                                     const AllocatedBuffer& buffer, VkDeviceSize size)
+{
+  this->properties = properties;
+  this->size = size;
+  head = 0;
+
+  mapped = (uint8_t*)buffer.info.pMappedData;
+
+  VkBufferDeviceAddressInfo addressInfo = { .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, .buffer = buffer.buffer };
+  address = vkGetBufferDeviceAddress(device, &addressInfo);
+
+  // Extension entry points aren't exported by the loader
+  getLayoutSize = (PFN_vkGetDescriptorSetLayoutSizeEXT)vkGetDeviceProcAddr(device, "vkGetDescriptorSetLayoutSizeEXT");
+  getBindingOffset = (PFN_vkGetDescriptorSetLayoutBindingOffsetEXT)vkGetDeviceProcAddr(device, "vkGetDescriptorSetLayoutBindingOffsetEXT");
+  getDescriptor = (PFN_vkGetDescriptorEXT)vkGetDeviceProcAddr(device, "vkGetDescriptorEXT");
+  cmdBindBuffers = (PFN_vkCmdBindDescriptorBuffersEXT)vkGetDeviceProcAddr(device, "vkCmdBindDescriptorBuffersEXT");
+  cmdSetOffsets = (PFN_vkCmdSetDescriptorBufferOffsetsEXT)vkGetDeviceProcAddr(device, "vkCmdSetDescriptorBufferOffsetsEXT");
+}
+
+VkDeviceSize DescriptorBufferAllocator::allocate(VkDevice device, VkDescriptorSetLayout layout)
+{
+  VkDeviceSize layoutSize;
+  getLayoutSize(device, layout, &layoutSize);
+
+  VkDeviceSize alignment = properties.descriptorBufferOffsetAlignment;
+  VkDeviceSize current = head.load(std::memory_order_relaxed);
+  VkDeviceSize offset;
+
+  do {
+    offset = (current + alignment - 1) / alignment * alignment;
+
+    // Sized for a frame's worth of sets up front, there's no growing a buffer that's already bound
+    if (offset + layoutSize > size) throw std::runtime_error("Descriptor buffer is full");
+  } while (!head.compare_exchange_weak(current, offset + layoutSize, std::memory_order_relaxed));
+
+  return offset;
+}
+
+void DescriptorBufferAllocator::write(VkDevice device, VkDescriptorSetLayout layout, VkDeviceSize offset, const DescriptorWriter& writer)
+{
+  for (const VkWriteDescriptorSet& write : writer.get_writes()) {
+    VkDeviceSize bindingOffset;
+    getBindingOffset(device, layout, write.dstBinding, &bindingOffset);
+
+    VkDescriptorGetInfoEXT getInfo = { .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_GET_INFO_EXT };
+    getInfo.type = write.descriptorType;
+
+    VkDescriptorAddressInfoEXT addressInfo = { .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_ADDRESS_INFO_EXT };
+    size_t descriptorSize = 0;
+
+    switch (write.descriptorType) {
+    case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+      getInfo.data.pCombinedImageSampler = write.pImageInfo;
+      descriptorSize = properties.combinedImageSamplerDescriptorSize;
+      break;
+    case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+      getInfo.data.pSampledImage = write.pImageInfo;
+      descriptorSize = properties.sampledImageDescriptorSize;
+      break;
+    case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+      getInfo.data.pStorageImage = write.pImageInfo;
+      descriptorSize = properties.storageImageDescriptorSize;
+      break;
+    case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+    case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER: {
+      // Buffers are referenced by address, so they need VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+      VkBufferDeviceAddressInfo bufferAddress = { .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, .buffer = write.pBufferInfo->buffer };
+      addressInfo.address = vkGetBufferDeviceAddress(device, &bufferAddress) + write.pBufferInfo->offset;
+      addressInfo.range = write.pBufferInfo->range;
+
+      bool uniform = write.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      if (uniform) getInfo.data.pUniformBuffer = &addressInfo;
+      else getInfo.data.pStorageBuffer = &addressInfo;
+      descriptorSize = uniform ? properties.uniformBufferDescriptorSize : properties.storageBufferDescriptorSize;
+      break;
+    }
+    default:
+      fmt::print("Descriptor type {} isn't supported in descriptor buffers\n", string_VkDescriptorType(write.descriptorType));
+      continue;
+    }
+
+    getDescriptor(device, &getInfo, descriptorSize, mapped + offset + bindingOffset);
+  }
+}
+
+void DescriptorBufferAllocator::bind_buffer(VkCommandBuffer cmd)
+{
+  VkDescriptorBufferBindingInfoEXT bindingInfo = { .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_BUFFER_BINDING_INFO_EXT };
+  bindingInfo.address = address;
+  bindingInfo.usage = VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT;
+
+  cmdBindBuffers(cmd, 1, &bindingInfo);
+}
+
+void DescriptorBufferAllocator::bind_set(VkCommandBuffer cmd, VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t set,
+                                         VkDeviceSize offset)
+{
+  uint32_t bufferIndex = 0;
+  cmdSetOffsets(cmd, bindPoint, layout, set, 1, &bufferIndex, &offset);
 }
@@ -2,8 +2,32 @@
 
 #include <vector>
 #include <vk_types.h>
-#include <deque>
 #include <span>
+#include <atomic>
+#include <unordered_map>
+
+// Core descriptor types, enough to index counts by VkDescriptorType
+constexpr uint32_t DescriptorTypeCount = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT + 1;
+using DescriptorCounts = std::array<uint32_t, DescriptorTypeCount>;
+
+// Sets and descriptors of each type, what a workload used between two clears or what pools reserved
+struct PoolProfile {
+  uint32_t sets = 0;
+  DescriptorCounts descriptors{};
+
+  void add(const PoolProfile& other);
+  // Peak of both
+  void merge(const PoolProfile& other);
+};
+
+namespace vkutil {
+  // Descriptors of each type in a layout, recorded by DescriptorLayoutBuilder so allocators can account for them
+  DescriptorCounts layout_descriptor_counts(VkDescriptorSetLayout layout);
+
+  // Learned pool profiles by allocator name, kept between runs. A missing or unreadable file is just an empty set
+  std::unordered_map<std::string, PoolProfile> load_pool_profiles(const char* path);
+  void save_pool_profiles(const char* path, const std::unordered_map<std::string, PoolProfile>& profiles);
+};
 
 struct DescriptorLayoutBuilder {
   std::vector<VkDescriptorSetLayoutBinding> bindings;
@@ -28,6 +52,9 @@ struct DescriptorAllocator {
   VkDescriptorSet allocate(VkDevice device, VkDescriptorSetLayout layout);
 };
 
+// Learns its sizing from the workload: the peak usage between clears is kept as a profile, and when a period had to
+// grow into more pools, clear_pools replaces them with a single pool that fits the peak, so the same workload never
+// creates a pool again. Profiles from earlier runs can be passed to init, the ratios are then derived from them
 struct DescriptorAllocatorGrowable {
 public:
   struct PoolSizeRatio {
@@ -35,29 +62,132 @@ public:
     float ratio;
   };
 
-  void init(VkDevice device, uint32_t initialSets, std::span<PoolSizeRatio> poolRatios);
+  struct Stats {
+    uint32_t poolsCreated = 0;
+    // Allocations that didn't fit the pool they tried and moved on to another one
+    uint32_t outOfPoolMemory = 0;
+    uint32_t fragmentedPool = 0;
+    // Usage of the last period between clears and what its pools reserved
+    PoolProfile used;
+    PoolProfile reserved;
+    // Share of the descriptors reserved by pools that filled up that was left unused
+    float fragmentation = 0.f;
+  };
+
+  void init(VkDevice device, uint32_t initialSets, std::span<PoolSizeRatio> poolRatios, const PoolProfile& learned = {});
   void clear_pools(VkDevice device);
   void destroy_pools(VkDevice device);
 
   VkDescriptorSet allocate(VkDevice device, VkDescriptorSetLayout layout, void* pNext = nullptr);
+
+  const Stats& stats() const { return poolStats; }
+  // Peak usage between clears so far, including the current period and the profile it was initialized with
+  PoolProfile profile() const;
 private:
+  struct PoolUsage {
+    PoolProfile capacity;
+    PoolProfile used;
+  };
+
   VkDescriptorPool get_pool(VkDevice device);
   VkDescriptorPool create_pool(VkDevice device, uint32_t setCount, std::span<PoolSizeRatio> poolRatios);
+  VkDescriptorPool create_pool(VkDevice device, const PoolProfile& capacity);
+  void learn_ratios();
 
   std::vector<PoolSizeRatio> ratios;
   std::vector<VkDescriptorPool> fullPools;
   std::vector<VkDescriptorPool> readyPools;
   uint32_t setsPerPool;
+
+  std::unordered_map<VkDescriptorPool, PoolUsage> usage;
+  PoolProfile peak;
+  Stats poolStats;
 };
 
+// A growable allocator for every thread that allocates from it, picked by a slot each thread gets on its first
+// allocation, so allocating never shares pools or takes a lock. Threads' allocators are created on first use and
+// a slot is reused once its thread exits, more than MaxThreads threads allocating at the same time throws.
+// Clearing and destroying touch every thread's pools and must not overlap with allocations
+struct DescriptorAllocatorPerThread {
+public:
+  using PoolSizeRatio = DescriptorAllocatorGrowable::PoolSizeRatio;
+
+  static constexpr uint32_t MaxThreads = 32;
+
+  void init(VkDevice device, uint32_t initialSets, std::span<PoolSizeRatio> poolRatios, const PoolProfile& learned = {});
+  void clear_pools(VkDevice device);
+  void destroy_pools(VkDevice device);
+
+  VkDescriptorSet allocate(VkDevice device, VkDescriptorSetLayout layout, void* pNext = nullptr);
+  // The calling thread's allocator
+  DescriptorAllocatorGrowable& local(VkDevice device);
+
+  // Summed over threads, the profile is the peak of any single thread since each has its own pools
+  DescriptorAllocatorGrowable::Stats stats() const;
+  PoolProfile profile() const;
+private:
+  std::vector<PoolSizeRatio> ratios;
+  uint32_t initialSets;
+  PoolProfile learned;
+
+  std::array<DescriptorAllocatorGrowable, MaxThreads> allocators;
+  std::array<bool, MaxThreads> initialized{};
+};
+
+// Writes for one set, kept inline so a writer lives on the stack of whichever thread fills it. Infos are stored next
+// to their write, which points into the writer, so writers can't be copied
 struct DescriptorWriter {
-  std::deque<VkDescriptorImageInfo> imageInfos;
-  std::deque<VkDescriptorBufferInfo> bufferInfos;
-  std::vector<VkWriteDescriptorSet> writes;
+  static constexpr uint32_t MaxWrites = 16;
+
+  DescriptorWriter() = default;
+  DescriptorWriter(const DescriptorWriter&) = delete;
+  DescriptorWriter& operator=(const DescriptorWriter&) = delete;
 
   void write_image(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type);
   void write_buffer(int binding, VkBuffer buffer, size_t size, size_t offset, VkDescriptorType type);
 
   void clear();
   void update_set(VkDevice device, VkDescriptorSet set);
+
+  std::span<const VkWriteDescriptorSet> get_writes() const { return { writes.data(), writeCount }; }
+
+private:
+  VkWriteDescriptorSet& next_write(int binding, VkDescriptorType type);
+
+  std::array<VkWriteDescriptorSet, MaxWrites> writes;
+  std::array<VkDescriptorImageInfo, MaxWrites> imageInfos;
+  std::array<VkDescriptorBufferInfo, MaxWrites> bufferInfos;
+  uint32_t writeCount = 0;
+};
+
+// Sets as ranges of a mapped buffer with VK_EXT_descriptor_buffer, allocated linearly and reset once the frame using
+// them is done. Allocation is a compare-exchange on the head, any thread can allocate and write its own sets. Layouts need VK_DESCRIPTOR_SET_LAYOUT_CREATE_DESCRIPTOR_BUFFER_BIT_EXT and the pipelines using them
+// VK_PIPELINE_CREATE_DESCRIPTOR_BUFFER_BIT_EXT, so a pipeline can't mix them with pool allocated sets
+struct DescriptorBufferAllocator {
+public:
+  // The buffer needs the resource and sampler descriptor buffer usages and a device address, and stays owned by the caller
+  void init(VkDevice device, const VkPhysicalDeviceDescriptorBufferPropertiesEXT& properties, const AllocatedBuffer& buffer,
+            VkDeviceSize size);
+  void clear() { head = 0; }
+
+  // Offset of a new set in the buffer
+  VkDeviceSize allocate(VkDevice device, VkDescriptorSetLayout layout);
+  void write(VkDevice device, VkDescriptorSetLayout layout, VkDeviceSize offset, const DescriptorWriter& writer);
+
+  // Once per command buffer, before any set of it is bound
+  void bind_buffer(VkCommandBuffer cmd);
+  void bind_set(VkCommandBuffer cmd, VkPipelineBindPoint bindPoint, VkPipelineLayout layout, uint32_t set, VkDeviceSize offset);
+
+private:
+  VkPhysicalDeviceDescriptorBufferPropertiesEXT properties;
+  uint8_t* mapped;
+  VkDeviceAddress address;
+  VkDeviceSize size;
+  std::atomic<VkDeviceSize> head;
+
+  PFN_vkGetDescriptorSetLayoutSizeEXT getLayoutSize;
+  PFN_vkGetDescriptorSetLayoutBindingOffsetEXT getBindingOffset;
+  PFN_vkGetDescriptorEXT getDescriptor;
+  PFN_vkCmdBindDescriptorBuffersEXT cmdBindBuffers;
+  PFN_vkCmdSetDescriptorBufferOffsetsEXT cmdSetOffsets;
 };
@@ -19,11 +19,25 @@
 #define VMA_IMPLEMENTATION
 #include "vk_mem_alloc.h"
 
+#include <algorithm>
 #include <chrono>
 #include <thread>
 
 constexpr bool bUseValidationLayers = false;
 
+// Reverse-Z clip planes, the near plane maps to depth 1
+constexpr float CameraNear = 0.1f;
+constexpr float CameraFar = 10000.f;
+
+// Descriptor pool usage learned by earlier runs, so the first frames already get pools of the right size
+constexpr const char* DescriptorProfilePath = "descriptor_pools.txt";
+constexpr const char* PipelineCachePath = "pipeline_cache.bin";
+
+// The cache pipelines of the background effects turn the depth test off through specialization constant 0
+constexpr VkBool32 BackgroundCacheDepthTest = VK_FALSE;
+constexpr VkSpecializationMapEntry BackgroundCacheEntry = { 0, 0, sizeof(VkBool32) };
+const VkSpecializationInfo BackgroundCacheSpecialization = { 1, &BackgroundCacheEntry, sizeof(VkBool32), &BackgroundCacheDepthTest };
+
 VulkanEngine* loadedEngine = nullptr;
 
 VulkanEngine& VulkanEngine::Get() { return *loadedEngine; }
@@ -47,33 +61,58 @@ void VulkanEngine::init()
 
   if (!_window) throw std::runtime_error(SDL_GetError());
 
-  init_vulkan();
+  // How long each part of startup takes, printed once it's done
+  std::vector<std::pair<const char*, float>> phases;
+  auto timed = [&](const char* name, auto&& phase) {
+    auto start = std::chrono::system_clock::now();
+    phase();
+    auto end = std::chrono::system_clock::now();
+    phases.emplace_back(name, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.f);
+  };
+
+  timed("vulkan", [this]() { init_vulkan(); });
+
+  timed("swapchain", [this]() { init_swapchain(); });
 
-  init_swapchain();
+  timed("commands", [this]() { init_commands(); });
 
-  init_commands();
+  timed("sync", [this]() { init_sync_structures(); });
 
-  init_sync_structures();
+  timed("descriptors", [this]() { init_descriptors(); });
 
-  init_descriptors();
+  // Only sets the pipelines up, they compile on worker threads through the rest of init
+  timed("pipelines", [this]() { init_pipelines(); });
 
-  init_pipelines();
+  timed("imgui", [this]() { init_imgui(); });
 
-  init_imgui();
+  timed("default data", [this]() { init_default_data(); });
 
-  init_default_data();
+  timed("shader reload", [this]() { init_shader_reload(); });
 
   mainCamera.velocity = glm::vec3(0.f);
   mainCamera.position = glm::vec3(30.f, -00.f, -085.f);
   mainCamera.pitch = 0;
   mainCamera.yaw = 0;
 
-  std::string structurePath = { "assets/structure.glb" };
-  auto structureFile = loadGltf(this, structurePath);
+  timed("scene", [this]() {
+    std::string structurePath = { "assets/structure.glb" };
+    auto structureFile = loadGltf(this, structurePath);
 
-  assert(structureFile.has_value());
+    assert(structureFile.has_value());
 
-  loadedScenes["structure"] = *structureFile;
+    loadedScenes["structure"] = *structureFile;
+  });
+
+  // What the workers haven't finished while everything else was loading
+  timed("pipeline wait", [this]() { _pipelineCompiler.wait(); });
+
+  float total = 0.f;
+  std::string report;
+  for (auto& [name, time] : phases) {
+    total += time;
+    report += fmt::format(", {} {:.1f} ms", name, time);
+  }
+  fmt::println("Startup took {:.1f} ms{}", total, report);
 
   _isInitialized = true;
 }
@@ -108,28 +147,94 @@ void VulkanEngine::init_vulkan()
   features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
 	features12.bufferDeviceAddress = true;
 	features12.descriptorIndexing = true;
+  // Timestamp queries are reset once from the host so the first readback of each frame sees them as unavailable
+	features12.hostQueryReset = true;
+  // Graphics and async compute submissions wait on frame numbers
+  features12.timelineSemaphore = true;
+
+  // Culled clusters are drawn with one indirect call per object, their first instance picks the object's data
+  VkPhysicalDeviceFeatures features = {};
+  features.multiDrawIndirect = true;
+  features.drawIndirectFirstInstance = true;
+  // The overdraw view counts fragments with image atomics
+  features.fragmentStoresAndAtomics = true;
+  // The composite pass writes the BGRA swapchain through an image without a format qualifier
+  features.shaderStorageImageWriteWithoutFormat = true;
 
   vkb::PhysicalDeviceSelector selector{ vkb_inst };
   vkb::PhysicalDevice physicalDevice = selector
     .set_minimum_version(1, 3)
+    .set_required_features(features)
     .set_required_features_13(features13)
     .set_required_features_12(features12)
     .set_surface(_surface)
     .select()
     .value();
 
+  // Descriptor buffers for the per-frame compute sets, the pools stay as the fallback
+  VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferSupport = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT };
+  if (physicalDevice.enable_extension_if_present(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME)) {
+    VkPhysicalDeviceFeatures2 supported = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &descriptorBufferSupport };
+    vkGetPhysicalDeviceFeatures2(physicalDevice.physical_device, &supported);
+  }
+  _useDescriptorBuffer = descriptorBufferSupport.descriptorBuffer;
+
+  VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferFeatures = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT };
+  descriptorBufferFeatures.descriptorBuffer = true;
+
+  // Dynamic blending and polygon mode for the material pipelines, baked pipelines per state stay as the fallback
+  VkPhysicalDeviceExtendedDynamicState3FeaturesEXT dynamicStateSupport = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT };
+  if (physicalDevice.enable_extension_if_present(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME)) {
+    VkPhysicalDeviceFeatures2 supported = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &dynamicStateSupport };
+    vkGetPhysicalDeviceFeatures2(physicalDevice.physical_device, &supported);
+  }
+  _supportsDynamicState = dynamicStateSupport.extendedDynamicState3ColorBlendEnable && dynamicStateSupport.extendedDynamicState3ColorBlendEquation &&
+                          dynamicStateSupport.extendedDynamicState3PolygonMode;
+
+  VkPhysicalDeviceExtendedDynamicState3FeaturesEXT dynamicStateFeatures = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT };
+  dynamicStateFeatures.extendedDynamicState3ColorBlendEnable = true;
+  dynamicStateFeatures.extendedDynamicState3ColorBlendEquation = true;
+  dynamicStateFeatures.extendedDynamicState3PolygonMode = true;
+
   vkb::DeviceBuilder deviceBuilder{ physicalDevice };
+  if (_useDescriptorBuffer) deviceBuilder.add_pNext(&descriptorBufferFeatures);
+  if (_supportsDynamicState) deviceBuilder.add_pNext(&dynamicStateFeatures);
   auto dev_ret = deviceBuilder.build();
   if (!dev_ret.has_value()) throw std::runtime_error("Failed to build device");
   vkb::Device vkbDevice = dev_ret.value();
 
   _device = vkbDevice.device;
   _chosenGPU = physicalDevice.physical_device;
+  _timestampPeriod = physicalDevice.properties.limits.timestampPeriod;
+
+  if (_useDescriptorBuffer) {
+    _descriptorBufferProperties = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_PROPERTIES_EXT };
+    VkPhysicalDeviceProperties2 properties = { .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &_descriptorBufferProperties };
+    vkGetPhysicalDeviceProperties2(_chosenGPU, &properties);
+
+    _computeSetLayoutFlags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_DESCRIPTOR_BUFFER_BIT_EXT;
+    _computePipelineFlags = VK_PIPELINE_CREATE_DESCRIPTOR_BUFFER_BIT_EXT;
+  }
+
+  if (_supportsDynamicState) {
+    _cmdSetColorBlendEnable = (PFN_vkCmdSetColorBlendEnableEXT)vkGetDeviceProcAddr(_device, "vkCmdSetColorBlendEnableEXT");
+    _cmdSetColorBlendEquation = (PFN_vkCmdSetColorBlendEquationEXT)vkGetDeviceProcAddr(_device, "vkCmdSetColorBlendEquationEXT");
+    _cmdSetPolygonMode = (PFN_vkCmdSetPolygonModeEXT)vkGetDeviceProcAddr(_device, "vkCmdSetPolygonModeEXT");
+  }
 
   // Graphics queue
   _graphicsQueue = vkbDevice.get_queue(vkb::QueueType::graphics).value();
   _graphicsQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::graphics).value();
 
+  // Compute queue, only from a family without graphics so it can actually run alongside it
+  auto computeQueue = vkbDevice.get_queue(vkb::QueueType::compute);
+  if (computeQueue.has_value()) {
+    _computeQueue = computeQueue.value();
+    _computeQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::compute).value();
+  } else {
+    useAsyncCompute = false;
+  }
+
   // Memory Allocator
   VmaAllocatorCreateInfo allocatorInfo = {};
   allocatorInfo.physicalDevice = _chosenGPU;
@@ -143,7 +248,7 @@ void VulkanEngine::init_vulkan()
   });
 }
 
-AllocatedImage VulkanEngine::create_image(VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped)
+AllocatedImage VulkanEngine::create_image(VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped, bool shared)
 {
   AllocatedImage newImage;
   newImage.imageFormat = format;
@@ -152,6 +257,13 @@ AllocatedImage VulkanEngine::create_image(VkExtent3D size, VkFormat format, VkIm
   VkImageCreateInfo img_info = vkinit::image_create_info(format, usage, size);
   if (mipmapped) img_info.mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(size.width, size.height)))) + 1;
 
+  uint32_t queueFamilies[] = { _graphicsQueueFamily, _computeQueueFamily };
+  if (shared && _computeQueue != VK_NULL_HANDLE) {
+    img_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    img_info.queueFamilyIndexCount = 2;
+    img_info.pQueueFamilyIndices = queueFamilies;
+  }
+
   // Always allocate image on dedicated GPU memory
   VmaAllocationCreateInfo allocinfo = {};
   allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
@@ -210,13 +322,21 @@ void VulkanEngine::destroy_image(const AllocatedImage& img)
   vmaDestroyImage(_allocator, img.image, img.allocation);
 }
 
-AllocatedBuffer VulkanEngine::create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage)
+AllocatedBuffer VulkanEngine::create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, bool shared)
 {
   VkBufferCreateInfo bufferInfo = { .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
   bufferInfo.pNext = nullptr;
   bufferInfo.size = allocSize;
   bufferInfo.usage = usage;
 
+  // Concurrent sharing spares the ownership transfers between the queue families
+  uint32_t queueFamilies[] = { _graphicsQueueFamily, _computeQueueFamily };
+  if (shared && _computeQueue != VK_NULL_HANDLE) {
+    bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferInfo.queueFamilyIndexCount = 2;
+    bufferInfo.pQueueFamilyIndices = queueFamilies;
+  }
+
   VmaAllocationCreateInfo vmaallocInfo = {};
   vmaallocInfo.usage = memoryUsage;
   vmaallocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
@@ -239,11 +359,19 @@ void VulkanEngine::create_swapchain(uint32_t width, uint32_t height)
 
   _swapchainImageFormat = VK_FORMAT_B8G8R8A8_UNORM;
 
+  // The composite pass writes straight into the swapchain when the surface and format allow storage use
+  VkSurfaceCapabilitiesKHR surfaceCapabilities;
+  VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_chosenGPU, _surface, &surfaceCapabilities));
+  VkFormatProperties formatProperties;
+  vkGetPhysicalDeviceFormatProperties(_chosenGPU, _swapchainImageFormat, &formatProperties);
+  _swapchainStorage = (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT) &&
+                      (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
+
   vkb::Swapchain vkbSwapchain = swapchainBuilder
     .set_desired_format(VkSurfaceFormatKHR{.format = _swapchainImageFormat, .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR})
     .set_desired_present_mode(VK_PRESENT_MODE_FIFO_KHR)
     .set_desired_extent(width, height)
-    .add_image_usage_flags(VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+    .add_image_usage_flags(VK_IMAGE_USAGE_TRANSFER_DST_BIT | (_swapchainStorage ? VK_IMAGE_USAGE_STORAGE_BIT : 0))
     .build()
     .value();
 
@@ -252,6 +380,10 @@ void VulkanEngine::create_swapchain(uint32_t width, uint32_t height)
   _swapchain = vkbSwapchain.swapchain;
   _swapchainImages = vkbSwapchain.get_images().value();
   _swapchainImageViews = vkbSwapchain.get_image_views().value();
+
+  for (VkImage image : _swapchainImages) {
+    _imageStates.track(image, VK_IMAGE_ASPECT_COLOR_BIT);
+  }
 }
 
 void VulkanEngine::resize_swapchain()
@@ -291,6 +423,8 @@ void VulkanEngine::init_swapchain()
   drawImageUsages += VK_IMAGE_USAGE_TRANSFER_DST_BIT;
   drawImageUsages += VK_IMAGE_USAGE_STORAGE_BIT;
   drawImageUsages += VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+  // Read by the upscale pass
+  drawImageUsages += VK_IMAGE_USAGE_SAMPLED_BIT;
 
   VkImageCreateInfo rimg_info = vkinit::image_create_info(_drawImage.imageFormat, drawImageUsages, drawImageExtent);
 
@@ -312,6 +446,8 @@ void VulkanEngine::init_swapchain()
   _depthImage.imageExtent = drawImageExtent;
   VkImageUsageFlags depthImageUsages{};
   depthImageUsages |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+  // Read when building the depth pyramid
+  depthImageUsages |= VK_IMAGE_USAGE_SAMPLED_BIT;
 
   VkImageCreateInfo dimg_info = vkinit::image_create_info(_depthImage.imageFormat, depthImageUsages, drawImageExtent);
 
@@ -323,6 +459,11 @@ void VulkanEngine::init_swapchain()
 
   VK_CHECK(vkCreateImageView(_device, &dview_info, nullptr, &_depthImage.imageView));
 
+  _imageStates.track(_drawImage.image, VK_IMAGE_ASPECT_COLOR_BIT);
+  _imageStates.track(_depthImage.image, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+  _renderGraph.init(this);
+
   // add to deletion queues
   _mainDeletionQueue.push_function([this]() {
     vkDestroyImageView(_device, _drawImage.imageView, nullptr);
@@ -330,6 +471,8 @@ void VulkanEngine::init_swapchain()
 
     vkDestroyImageView(_device, _depthImage.imageView, nullptr);
     vmaDestroyImage(_allocator, _depthImage.image, _depthImage.allocation);
+
+    _renderGraph.destroy();
   });
 }
 
@@ -345,6 +488,22 @@ void VulkanEngine::init_commands()
     VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_frames[i]._commandPool, 1);
 
     VK_CHECK(vkAllocateCommandBuffers(_device, &cmdAllocInfo, &_frames[i]._mainCommandBuffer));
+
+    if (_computeQueue != VK_NULL_HANDLE) {
+      VkCommandPoolCreateInfo computePoolInfo = vkinit::command_pool_create_info(_computeQueueFamily,
+                                                                                 VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+      VK_CHECK(vkCreateCommandPool(_device, &computePoolInfo, nullptr, &_frames[i]._computeCommandPool));
+
+      VkCommandBufferAllocateInfo computeAllocInfo = vkinit::command_buffer_allocate_info(_frames[i]._computeCommandPool, 1);
+      VK_CHECK(vkAllocateCommandBuffers(_device, &computeAllocInfo, &_frames[i]._computeCommandBuffer));
+    }
+
+    VkQueryPoolCreateInfo queryPoolInfo = { .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = TimestampCount;
+
+    VK_CHECK(vkCreateQueryPool(_device, &queryPoolInfo, nullptr, &_frames[i]._timestampPool));
+    vkResetQueryPool(_device, _frames[i]._timestampPool, 0, TimestampCount);
   }
 
   // imgui command pool
@@ -377,37 +536,62 @@ void VulkanEngine::init_sync_structures()
 
   VK_CHECK(vkCreateFence(_device, &fenceCreateInfo, nullptr, &_immFence));
   _mainDeletionQueue.push_function([this]() { vkDestroyFence(_device, _immFence, nullptr); });
+
+  // Both count submitted frames, frame N signals N + 1
+  VkSemaphoreTypeCreateInfo timelineInfo = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+  timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  timelineInfo.initialValue = 0;
+
+  VkSemaphoreCreateInfo timelineCreateInfo = vkinit::semaphore_create_info();
+  timelineCreateInfo.pNext = &timelineInfo;
+
+  VK_CHECK(vkCreateSemaphore(_device, &timelineCreateInfo, nullptr, &_graphicsTimeline));
+  VK_CHECK(vkCreateSemaphore(_device, &timelineCreateInfo, nullptr, &_computeTimeline));
+  _mainDeletionQueue.push_function([this]() {
+    vkDestroySemaphore(_device, _graphicsTimeline, nullptr);
+    vkDestroySemaphore(_device, _computeTimeline, nullptr);
+  });
 }
 
 void VulkanEngine::init_descriptors()
 {
+  _poolProfiles = vkutil::load_pool_profiles(DescriptorProfilePath);
+
   // Create a descriptor pool that will hold 10 sets with 1 image each
   std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> sizes =
   {
     { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
     { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
     { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 }
   };
 
-  globalDescriptorAllocator.init(_device, 10, sizes);
+  globalDescriptorAllocator.init(_device, 10, sizes, _poolProfiles["global"]);
+
+  // Pushed first so every pipeline is gone by the time their layouts are destroyed
+  _mainDeletionQueue.push_function([&]() {
+    layoutCache.destroy(_device);
+  });
 
-  // Make the descriptor set layout for the compute draw
+  // Make the descriptor set layout for the compute draw. Layouts come from the cache, pipelines reflecting the same
+  // sets from their shaders get the same ones
   {
     DescriptorLayoutBuilder builder;
     builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
-    _drawImageDescriptorLayout = builder.build(_device, VK_SHADER_STAGE_COMPUTE_BIT);
+    _drawImageDescriptorLayout = layoutCache.get_set_layout(_device, builder, VK_SHADER_STAGE_COMPUTE_BIT);
   }
 
   {
     DescriptorLayoutBuilder builder;
     builder.add_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    _gpuSceneDataDescriptorLayout = builder.build(_device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+    builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    _gpuSceneDataDescriptorLayout = layoutCache.get_set_layout(_device, builder, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
   }
 
   {
     DescriptorLayoutBuilder builder;
     builder.add_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    _singleImageDescriptorLayout = builder.build(_device, VK_SHADER_STAGE_FRAGMENT_BIT);
+    _singleImageDescriptorLayout = layoutCache.get_set_layout(_device, builder, VK_SHADER_STAGE_FRAGMENT_BIT);
   }
 
   // Allocate a descriptor set for our draw image
@@ -429,13 +613,8 @@ void VulkanEngine::init_descriptors()
 
   vkUpdateDescriptorSets(_device, 1, &drawImageWrite, 0, nullptr);
 
-  // Make sure both the descriptor allocator and the new layout get cleaned up properly
   _mainDeletionQueue.push_function([&]() {
     globalDescriptorAllocator.destroy_pools(_device);
-
-    vkDestroyDescriptorSetLayout(_device, _drawImageDescriptorLayout, nullptr);
-    vkDestroyDescriptorSetLayout(_device, _singleImageDescriptorLayout, nullptr);
-    vkDestroyDescriptorSetLayout(_device, _gpuSceneDataDescriptorLayout, nullptr);
   });
 
   for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
@@ -447,22 +626,56 @@ void VulkanEngine::init_descriptors()
       { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4 },
     };
 
-    _frames[i]._frameDescriptors = DescriptorAllocatorGrowable{};
-    _frames[i]._frameDescriptors.init(_device, 1000, frame_size);
+    _frames[i]._frameDescriptors.init(_device, 1000, frame_size, _poolProfiles["frame"]);
+
+    // Scene uniforms stay in the same buffer, so their set is written once
+    _frames[i]._sceneDataBuffer = create_buffer(sizeof(GPUSceneData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+    _frames[i]._objectCapacity = 1024;
+    _frames[i]._objectBuffer = create_buffer(_frames[i]._objectCapacity * sizeof(GPUObjectData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                             VMA_MEMORY_USAGE_CPU_TO_GPU);
+    _frames[i]._sceneDescriptor = globalDescriptorAllocator.allocate(_device, _gpuSceneDataDescriptorLayout);
+
+    DescriptorWriter writer;
+    writer.write_buffer(0, _frames[i]._sceneDataBuffer.buffer, sizeof(GPUSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    writer.write_buffer(1, _frames[i]._objectBuffer.buffer, VK_WHOLE_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.update_set(_device, _frames[i]._sceneDescriptor);
 
     _mainDeletionQueue.push_function([&, i]() {
       _frames[i]._frameDescriptors.destroy_pools(_device);
+      destroy_buffer(_frames[i]._sceneDataBuffer);
+      destroy_buffer(_frames[i]._objectBuffer);
     });
+
+    if (_useDescriptorBuffer) {
+      // A frame binds a few dozen compute sets at most. The early culling pass reads it from the compute queue
+      const VkDeviceSize descriptorBufferSize = 64 * 1024;
+      _frames[i]._descriptorBufferMemory = create_buffer(descriptorBufferSize,
+                                                         VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT |
+                                                         VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, true);
+      _frames[i]._descriptorBuffer.init(_device, _descriptorBufferProperties, _frames[i]._descriptorBufferMemory, descriptorBufferSize);
+
+      _mainDeletionQueue.push_function([&, i]() {
+        destroy_buffer(_frames[i]._descriptorBufferMemory);
+      });
+    }
   }
 }
 
 void VulkanEngine::init_background_pipelines()
 {
+  {
+    DescriptorLayoutBuilder builder;
+    builder.add_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    _backgroundDepthDescriptorLayout = builder.build(_device, VK_SHADER_STAGE_COMPUTE_BIT);
+  }
+
+  VkDescriptorSetLayout layouts[] = { _drawImageDescriptorLayout, _backgroundDepthDescriptorLayout };
+
   VkPipelineLayoutCreateInfo computeLayout{};
   computeLayout.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
   computeLayout.pNext = nullptr;
-  computeLayout.pSetLayouts = &_drawImageDescriptorLayout;
-  computeLayout.setLayoutCount = 1;
+  computeLayout.pSetLayouts = layouts;
+  computeLayout.setLayoutCount = 2;
 
   VkPushConstantRange pushConstant{};
   pushConstant.offset = 0;
@@ -474,80 +687,95 @@ void VulkanEngine::init_background_pipelines()
 
   VK_CHECK(vkCreatePipelineLayout(_device, &computeLayout, nullptr, &_gradientPipelineLayout));
 
-  VkShaderModule gradientShader;
-  if (!vkutil::load_shader_module("build/shaders/gradient_color.comp.spv", _device, &gradientShader))
-    fmt::print("Error when building the gradient compute shader\n");
-
-  VkShaderModule skyShader;
-  if (!vkutil::load_shader_module("build/shaders/sky.comp.spv", _device, &skyShader))
-    fmt::print("Error when building the sky compute shader\n");
-
-  VkPipelineShaderStageCreateInfo stageInfo{};
-  stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  stageInfo.pNext = nullptr;
-  stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-  stageInfo.module = gradientShader;
-  stageInfo.pName = "main";
-
-  VkComputePipelineCreateInfo computePipelineCreateInfo{};
-  computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-  computePipelineCreateInfo.pNext = nullptr;
-  computePipelineCreateInfo.layout = _gradientPipelineLayout;
-  computePipelineCreateInfo.stage = stageInfo;
-
   ComputeEffect gradient;
   gradient.layout = _gradientPipelineLayout;
   gradient.name = "gradient";
+  gradient.shader = "build/shaders/gradient_color.comp.spv";
   gradient.data = {};
 
   gradient.data.data1 = glm::vec4{1, 0, 0, 1};
   gradient.data.data2 = glm::vec4{0, 0, 1, 1};
 
-  VK_CHECK(vkCreateComputePipelines(_device, VK_NULL_HANDLE, 1, &computePipelineCreateInfo, nullptr, &gradient.pipeline));
-
-  // Change the shader module to create the sky shader
-  computePipelineCreateInfo.stage.module = skyShader;
-
   ComputeEffect sky;
   sky.layout = _gradientPipelineLayout;
   sky.name = "sky";
+  sky.shader = "build/shaders/sky.comp.spv";
   sky.data = {};
   sky.data.data1 = glm::vec4{0.1, 0.2, 0.4, 0.97};
 
-  VK_CHECK(vkCreateComputePipelines(_device, VK_NULL_HANDLE, 1, &computePipelineCreateInfo, nullptr, &sky.pipeline));
-
   // Add these effects into the array
   backgroundEffects.push_back(gradient);
   backgroundEffects.push_back(sky);
 
-  // Now that the pipeline is created, the module isn't needed anymore
-  vkDestroyShaderModule(_device, gradientShader, nullptr);
-  vkDestroyShaderModule(_device, skyShader, nullptr);
+  // The vector isn't touched again until the compiler is done with the effects
+  for (ComputeEffect& effect : backgroundEffects) {
+    _pipelineCompiler.add(effect.name, &effect.pipeline, [this, &effect]() {
+      return vkutil::create_compute_pipeline(_device, _pipelineCache, effect.shader, effect.layout);
+    });
+    _pipelineCompiler.add(effect.name, &effect.cachePipeline, [this, &effect]() {
+      return vkutil::create_compute_pipeline(_device, _pipelineCache, effect.shader, effect.layout, 0, &BackgroundCacheSpecialization);
+    });
+  }
+
+  // The cache has the draw image's size and format, so the effects compute the same values into it. It's drawn
+  // at the frame start, possibly on the async compute queue
+  _backgroundCache = create_image(_drawImage.imageExtent, _drawImage.imageFormat, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                  false, true);
+  _imageStates.track(_backgroundCache.image, VK_IMAGE_ASPECT_COLOR_BIT);
+
+  _backgroundCacheDescriptors = globalDescriptorAllocator.allocate(_device, _drawImageDescriptorLayout);
+  {
+    DescriptorWriter writer;
+    writer.write_image(0, _backgroundCache.imageView, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    writer.update_set(_device, _backgroundCacheDescriptors);
+  }
+
+  // Copies the cache into the pixels the opaque geometry left uncovered
+  {
+    DescriptorLayoutBuilder builder;
+    builder.add_binding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    _backgroundResolveDescriptorLayout = builder.build(_device, VK_SHADER_STAGE_COMPUTE_BIT);
+  }
+
+  VkDescriptorSetLayout resolveLayouts[] = { _drawImageDescriptorLayout, _backgroundResolveDescriptorLayout };
 
-  _mainDeletionQueue.push_function([this, sky, gradient]() {
+  VkPipelineLayoutCreateInfo resolveLayoutInfo = vkinit::pipeline_layout_create_info();
+  resolveLayoutInfo.pSetLayouts = resolveLayouts;
+  resolveLayoutInfo.setLayoutCount = 2;
+
+  VK_CHECK(vkCreatePipelineLayout(_device, &resolveLayoutInfo, nullptr, &_backgroundResolvePipelineLayout));
+
+  _pipelineCompiler.add("background resolve", &_backgroundResolvePipeline, [this]() {
+    return vkutil::create_compute_pipeline(_device, _pipelineCache, "build/shaders/background_resolve.comp.spv", _backgroundResolvePipelineLayout);
+  });
+
+  // The effects' pipelines are read when the queue is flushed, shader reloads may have replaced them
+  _mainDeletionQueue.push_function([this]() {
     vkDestroyPipelineLayout(_device, _gradientPipelineLayout, nullptr);
-    vkDestroyPipeline(_device, sky.pipeline, nullptr);
-    vkDestroyPipeline(_device, gradient.pipeline, nullptr);
+    vkDestroyDescriptorSetLayout(_device, _backgroundDepthDescriptorLayout, nullptr);
+    for (ComputeEffect& effect : backgroundEffects) {
+      vkDestroyPipeline(_device, effect.pipeline, nullptr);
+      vkDestroyPipeline(_device, effect.cachePipeline, nullptr);
+    }
+
+    vkDestroyPipeline(_device, _backgroundResolvePipeline, nullptr);
+    vkDestroyPipelineLayout(_device, _backgroundResolvePipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(_device, _backgroundResolveDescriptorLayout, nullptr);
+
+    _imageStates.forget(_backgroundCache.image);
+    destroy_image(_backgroundCache);
   });
 }
 
 void VulkanEngine::init_triangle_pipeline()
 {
-  VkShaderModule triangleFragShader;
-  if (!vkutil::load_shader_module("build/shaders/colored_triangle.frag.spv", _device, &triangleFragShader))
-    fmt::print("Error when building the triangle fragment shader\n");
-
-  VkShaderModule triangleVertexShader;
-  if (!vkutil::load_shader_module("build/shaders/colored_triangle.vert.spv", _device, &triangleVertexShader))
-    fmt::print("Error when building the triangle vertex shader\n");
-
   VkPipelineLayoutCreateInfo pipeline_layout_info = vkinit::pipeline_layout_create_info();
   VK_CHECK(vkCreatePipelineLayout(_device, &pipeline_layout_info, nullptr, &_trianglePipelineLayout));
 
   PipelineBuilder pipelineBuilder;
 
   pipelineBuilder._pipelineLayout = _trianglePipelineLayout;
-  pipelineBuilder.set_shaders(triangleVertexShader, triangleFragShader);
   pipelineBuilder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
   pipelineBuilder.set_polygon_mode(VK_POLYGON_MODE_FILL);
   pipelineBuilder.set_cull_mode(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
@@ -558,10 +786,10 @@ void VulkanEngine::init_triangle_pipeline()
   pipelineBuilder.set_color_attachment_format(_drawImage.imageFormat);
   pipelineBuilder.set_depth_format(_depthImage.imageFormat);
 
-  _trianglePipeline = pipelineBuilder.build_pipeline(_device);
-
-  vkDestroyShaderModule(_device, triangleFragShader, nullptr);
-  vkDestroyShaderModule(_device, triangleVertexShader, nullptr);
+  _pipelineCompiler.add("triangle", &_trianglePipeline, [this, pipelineBuilder]() mutable {
+    return pipelineBuilder.build_pipeline(_device, _pipelineCache, "build/shaders/colored_triangle.vert.spv",
+                                          "build/shaders/colored_triangle.frag.spv");
+  });
 
   _mainDeletionQueue.push_function([&]() {
     vkDestroyPipelineLayout(_device, _trianglePipelineLayout, nullptr);
@@ -571,14 +799,6 @@ void VulkanEngine::init_triangle_pipeline()
 
 void VulkanEngine::init_mesh_pipeline()
 {
-  VkShaderModule triangleFragShader;
-  if (!vkutil::load_shader_module("build/shaders/tex_image.frag.spv", _device, &triangleFragShader))
-    fmt::print("Error when building the fragment shader\n");
-
-  VkShaderModule triangleVertexShader;
-  if (!vkutil::load_shader_module("build/shaders/colored_triangle_mesh.vert.spv", _device, &triangleVertexShader))
-    fmt::print("Error when building the vertex shader\n");
-
   // Build the pipeline layout that controls the inputs/outputs of the shader
   VkPushConstantRange bufferRange{};
   bufferRange.offset = 0;
@@ -597,8 +817,6 @@ void VulkanEngine::init_mesh_pipeline()
 
   // Use the triangle layout
   pipelineBuilder._pipelineLayout = _meshPipelineLayout;
-  // Connect the vertex and pixel shaders
-  pipelineBuilder.set_shaders(triangleVertexShader, triangleFragShader);
   // Draw triangles
   pipelineBuilder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
   // Fill the triangles
@@ -619,11 +837,11 @@ void VulkanEngine::init_mesh_pipeline()
   pipelineBuilder.set_color_attachment_format(_drawImage.imageFormat);
   pipelineBuilder.set_depth_format(_depthImage.imageFormat);
 
-  _meshPipeline = pipelineBuilder.build_pipeline(_device);
-
-  // Clean structures
-  vkDestroyShaderModule(_device, triangleFragShader, nullptr);
-  vkDestroyShaderModule(_device, triangleVertexShader, nullptr);
+  // Connect the vertex and pixel shaders, loaded by the compile job
+  _pipelineCompiler.add("mesh", &_meshPipeline, [this, pipelineBuilder]() mutable {
+    return pipelineBuilder.build_pipeline(_device, _pipelineCache, "build/shaders/colored_triangle_mesh.vert.spv",
+                                          "build/shaders/tex_image.frag.spv");
+  });
 
   _mainDeletionQueue.push_function([&]() {
     vkDestroyPipelineLayout(_device, _meshPipelineLayout, nullptr);
@@ -631,104 +849,473 @@ void VulkanEngine::init_mesh_pipeline()
   });
 }
 
+void VulkanEngine::init_cluster_cull_pipeline()
+{
+  ShaderReflection reflection;
+  if (!vkutil::reflect_pipeline({ "build/shaders/meshlet_cull.comp.spv" }, reflection))
+    fmt::print("Failed to reflect the cluster culling compute shader\n");
+
+  _clusterCullDescriptorLayout = layoutCache.get_set_layout(_device, reflection, 0, _computeSetLayoutFlags);
+  _clusterCullPipelineLayout = layoutCache.get_pipeline_layout(_device, reflection, _computeSetLayoutFlags);
+
+  _pipelineCompiler.add("cluster cull", &_clusterCullPipeline, [this]() {
+    return vkutil::create_compute_pipeline(_device, _pipelineCache, "build/shaders/meshlet_cull.comp.spv", _clusterCullPipelineLayout,
+                                           _computePipelineFlags);
+  });
+
+  for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
+    _frames[i]._clusterStatsBuffer = create_buffer(sizeof(GPUClusterStats),
+                                                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                                   VMA_MEMORY_USAGE_GPU_TO_CPU, true);
+    memset(_frames[i]._clusterStatsBuffer.info.pMappedData, 0, sizeof(GPUClusterStats));
+
+    _frames[i]._clusterObjectCapacity = 1024;
+    _frames[i]._clusterCommandCapacity = 16 * 1024;
+    create_cluster_buffers(_frames[i], true, true);
+  }
+
+  _mainDeletionQueue.push_function([this]() {
+    for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
+      destroy_buffer(_frames[i]._clusterStatsBuffer);
+      destroy_buffer(_frames[i]._clusterObjectBuffer);
+      destroy_buffer(_frames[i]._clusterCommandBuffer);
+      destroy_buffer(_frames[i]._lateClusterCommandBuffer);
+    }
+
+    vkDestroyPipeline(_device, _clusterCullPipeline, nullptr);
+  });
+}
+
+void VulkanEngine::init_depth_pyramid()
+{
+  // Power of two below the depth buffer, so every level halves cleanly and the first one shrinks by less than 2x
+  auto previous_pow2 = [](uint32_t v) {
+    uint32_t result = 1;
+    while (result * 2 <= v) result *= 2;
+    return result;
+  };
+
+  _depthPyramidExtent.width = previous_pow2(_depthImage.imageExtent.width);
+  _depthPyramidExtent.height = previous_pow2(_depthImage.imageExtent.height);
+
+  // Sampled by the early culling pass on the compute queue
+  _depthPyramid = create_image(VkExtent3D{ _depthPyramidExtent.width, _depthPyramidExtent.height, 1 }, VK_FORMAT_R32_SFLOAT,
+                               VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, true, true);
+  _depthPyramidLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(_depthPyramidExtent.width, _depthPyramidExtent.height)))) + 1;
+
+  for (uint32_t i = 0; i < _depthPyramidLevels; i++) {
+    VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(VK_FORMAT_R32_SFLOAT, _depthPyramid.image, VK_IMAGE_ASPECT_COLOR_BIT);
+    viewInfo.subresourceRange.baseMipLevel = i;
+    viewInfo.subresourceRange.levelCount = 1;
+
+    VK_CHECK(vkCreateImageView(_device, &viewInfo, nullptr, &_depthPyramidMips[i]));
+  }
+
+  // The pyramid stays in the general layout, it's both written and sampled by compute
+  immediate_submit([&](VkCommandBuffer cmd) {
+    vkutil::transition_image(cmd, _depthPyramid.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+  });
+  _imageStates.track(_depthPyramid.image, VK_IMAGE_ASPECT_COLOR_BIT, vkutil::ImageState{ VK_IMAGE_LAYOUT_GENERAL });
+
+  VkSamplerCreateInfo samplerInfo = { .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+  samplerInfo.magFilter = VK_FILTER_NEAREST;
+  samplerInfo.minFilter = VK_FILTER_NEAREST;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+
+  VK_CHECK(vkCreateSampler(_device, &samplerInfo, nullptr, &_depthPyramidSampler));
+
+  ShaderReflection reflection;
+  if (!vkutil::reflect_pipeline({ "build/shaders/depth_reduce.comp.spv" }, reflection))
+    fmt::print("Failed to reflect the depth reduce compute shader\n");
+
+  _depthReduceDescriptorLayout = layoutCache.get_set_layout(_device, reflection, 0, _computeSetLayoutFlags);
+  _depthReducePipelineLayout = layoutCache.get_pipeline_layout(_device, reflection, _computeSetLayoutFlags);
+
+  _pipelineCompiler.add("depth reduce", &_depthReducePipeline, [this]() {
+    return vkutil::create_compute_pipeline(_device, _pipelineCache, "build/shaders/depth_reduce.comp.spv", _depthReducePipelineLayout,
+                                           _computePipelineFlags);
+  });
+
+  _mainDeletionQueue.push_function([this]() {
+    vkDestroyPipeline(_device, _depthReducePipeline, nullptr);
+    vkDestroySampler(_device, _depthPyramidSampler, nullptr);
+
+    for (uint32_t i = 0; i < _depthPyramidLevels; i++) {
+      vkDestroyImageView(_device, _depthPyramidMips[i], nullptr);
+    }
+    destroy_image(_depthPyramid);
+  });
+}
+
+void VulkanEngine::init_overdraw()
+{
+  // The counts themselves go into a transient image of the render graph, only allocated while the view is on
+
+  // Written by the mesh fragment shaders, read by the heatmap
+  {
+    DescriptorLayoutBuilder builder;
+    builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    _overdrawDescriptorLayout = layoutCache.get_set_layout(_device, builder, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
+  }
+
+  VkDescriptorSetLayout layouts[] = { _drawImageDescriptorLayout, _overdrawDescriptorLayout };
+
+  VkPushConstantRange pushConstant{};
+  pushConstant.offset = 0;
+  pushConstant.size = sizeof(ComputePushConstants);
+  pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+  layoutInfo.pSetLayouts = layouts;
+  layoutInfo.setLayoutCount = 2;
+  layoutInfo.pPushConstantRanges = &pushConstant;
+  layoutInfo.pushConstantRangeCount = 1;
+
+  overdrawEffect.name = "overdraw";
+  overdrawEffect.shader = "build/shaders/overdraw.comp.spv";
+  overdrawEffect.data = {};
+  // Fragment count that shows as the hottest color
+  overdrawEffect.data.data1 = glm::vec4{8, 0, 0, 0};
+
+  VK_CHECK(vkCreatePipelineLayout(_device, &layoutInfo, nullptr, &overdrawEffect.layout));
+
+  _pipelineCompiler.add(overdrawEffect.name, &overdrawEffect.pipeline, [this]() {
+    return vkutil::create_compute_pipeline(_device, _pipelineCache, overdrawEffect.shader, overdrawEffect.layout);
+  });
+
+  for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
+    _frames[i]._overdrawStatsBuffer = create_buffer(sizeof(GPUOverdrawStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                                    VMA_MEMORY_USAGE_GPU_TO_CPU);
+    memset(_frames[i]._overdrawStatsBuffer.info.pMappedData, 0, sizeof(GPUOverdrawStats));
+  }
+
+  _mainDeletionQueue.push_function([this]() {
+    for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
+      destroy_buffer(_frames[i]._overdrawStatsBuffer);
+    }
+
+    vkDestroyPipeline(_device, overdrawEffect.pipeline, nullptr);
+    vkDestroyPipelineLayout(_device, overdrawEffect.layout, nullptr);
+  });
+}
+
+void VulkanEngine::init_upscale()
+{
+  // Linear for the bilinear path of the composite, the other reads use texelFetch
+  VkSamplerCreateInfo samplerInfo = { .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+  samplerInfo.magFilter = VK_FILTER_LINEAR;
+  samplerInfo.minFilter = VK_FILTER_LINEAR;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+
+  VK_CHECK(vkCreateSampler(_device, &samplerInfo, nullptr, &_upscaleSampler));
+
+  // The EASU set matches the depth reduce one, the cache hands both the same layouts
+  {
+    ShaderReflection reflection;
+    if (!vkutil::reflect_pipeline({ "build/shaders/easu.comp.spv" }, reflection))
+      fmt::print("Failed to reflect the EASU compute shader\n");
+
+    _upscaleDescriptorLayout = layoutCache.get_set_layout(_device, reflection, 0, _computeSetLayoutFlags);
+    _upscalePipelineLayout = layoutCache.get_pipeline_layout(_device, reflection, _computeSetLayoutFlags);
+  }
+
+  {
+    ShaderReflection reflection;
+    if (!vkutil::reflect_pipeline({ "build/shaders/composite.comp.spv" }, reflection))
+      fmt::print("Failed to reflect the composite compute shader\n");
+
+    _compositeDescriptorLayout = layoutCache.get_set_layout(_device, reflection, 0, _computeSetLayoutFlags);
+    _compositePipelineLayout = layoutCache.get_pipeline_layout(_device, reflection, _computeSetLayoutFlags);
+  }
+
+  _pipelineCompiler.add("easu", &_easuPipeline, [this]() {
+    return vkutil::create_compute_pipeline(_device, _pipelineCache, "build/shaders/easu.comp.spv", _upscalePipelineLayout, _computePipelineFlags);
+  });
+  _pipelineCompiler.add("composite", &_compositePipeline, [this]() {
+    return vkutil::create_compute_pipeline(_device, _pipelineCache, "build/shaders/composite.comp.spv", _compositePipelineLayout,
+                                           _computePipelineFlags);
+  });
+
+  _mainDeletionQueue.push_function([this]() {
+    vkDestroyPipeline(_device, _easuPipeline, nullptr);
+    vkDestroyPipeline(_device, _compositePipeline, nullptr);
+    vkDestroySampler(_device, _upscaleSampler, nullptr);
+  });
+}
+
+MaterialPipelineKey::FixedFunction MaterialPipelineKey::fixed_function() const
+{
+  FixedFunction state;
+
+  // glTF front faces are counter-clockwise, the flipped projection keeps them that way
+  state.cullMode = doubleSided ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT;
+  state.frontFace = (flipWinding && !doubleSided) ? VK_FRONT_FACE_CLOCKWISE : VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  state.blendAdditive = shading == Shade && pass == MaterialPass::Transparent;
+
+  // After a depth pre-pass the depth buffer already holds the closest surface, so only the fragment that wrote it passes
+  if (shading != DepthOnly && pass == MaterialPass::Transparent) {
+    state.depthWrite = false;
+    state.depthCompare = VK_COMPARE_OP_GREATER_OR_EQUAL;
+  } else if (shading != DepthOnly && depthEqual) {
+    state.depthWrite = false;
+    state.depthCompare = VK_COMPARE_OP_EQUAL;
+  } else {
+    state.depthWrite = true;
+    state.depthCompare = VK_COMPARE_OP_GREATER_OR_EQUAL;
+  }
+  return state;
+}
+
+uint64_t MaterialPipelineKey::packed() const
+{
+  MaterialPass keyPass = pass;
+  bool keyDepthEqual = depthEqual && pass == MaterialPass::MainColor;
+  bool keyDoubleSided = doubleSided;
+  bool keyFlipWinding = flipWinding && !doubleSided;
+  uint32_t keyFeatures = features;
+
+  // Depth-only pipelines have no fragment shader and the pre-pass only draws opaque surfaces. Overdraw only tells
+  // alpha tested materials apart, they have to discard before counting
+  if (shading == DepthOnly) {
+    keyPass = MaterialPass::MainColor;
+    keyDepthEqual = false;
+    keyFeatures = 0;
+  }
+  if (shading == Overdraw) keyFeatures &= MaterialAlphaTest;
+
+  // Everything fixed_function covers is left to the draw loop
+  if (dynamicState) {
+    keyPass = MaterialPass::MainColor;
+    keyDepthEqual = false;
+    keyDoubleSided = true;
+    keyFlipWinding = false;
+  }
+
+  return (uint64_t)keyPass | (uint64_t)shading << 2 | (uint64_t)keyDepthEqual << 4 | (uint64_t)keyDoubleSided << 5 |
+         (uint64_t)keyFlipWinding << 6 | (uint64_t)dynamicState << 7 | (uint64_t)keyFeatures << 8;
+}
+
+MaterialPipelineKey MaterialPipelineKey::unpack(uint64_t key)
+{
+  MaterialPipelineKey k;
+  k.pass = (MaterialPass)(key & 0x3);
+  k.shading = (Shading)((key >> 2) & 0x3);
+  k.depthEqual = (key >> 4) & 1;
+  k.doubleSided = (key >> 5) & 1;
+  k.flipWinding = (key >> 6) & 1;
+  k.dynamicState = (key >> 7) & 1;
+  k.features = (uint32_t)(key >> 8);
+  return k;
+}
+
 void GLTFMetallic_Roughness::build_pipelines(VulkanEngine* engine)
 {
-  VkShaderModule meshFragShader;
-  if (!vkutil::load_shader_module("build/shaders/mesh.frag.spv", engine->_device, &meshFragShader))
-    fmt::print("Failed to load the mesh fragment shader\n");
+  // Sets and push constants come from the shaders of every permutation, they all share one layout. Set 0 matches the
+  // scene layout and the overdraw set, only used by the overdraw pipelines, is shared with the heatmap compute pass
+  ShaderReflection reflection;
+  if (!vkutil::reflect_pipeline({ "build/shaders/mesh.vert.spv", "build/shaders/mesh.frag.spv", "build/shaders/mesh_depth.vert.spv",
+                                  "build/shaders/mesh_overdraw.frag.spv", "build/shaders/mesh_overdraw_alpha.frag.spv" }, reflection))
+    fmt::print("Failed to reflect the mesh shaders\n");
+  reflection.set_stages(2, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
+
+  materialLayout = engine->layoutCache.get_set_layout(engine->_device, reflection, 1);
+  pipelineLayout = engine->layoutCache.get_pipeline_layout(engine->_device, reflection);
+
+  pipelines.init(engine->_device, [this, engine](uint64_t key) { return create_pipeline(engine, MaterialPipelineKey::unpack(key)); });
+  dynamicStateSupported = engine->_supportsDynamicState;
+  dynamicState = dynamicStateSupported;
+
+  // The generic variant of every fixed function state, so any draw has something to fall back to while its own
+  // permutation compiles. Compiled with the engine's other pipelines, the cache keeps them. Keys that differ only in
+  // state their shading doesn't use are the same pipeline
+  std::unordered_set<uint64_t> compiled;
+  auto compile = [this, engine, &compiled](MaterialPipelineKey key) {
+    if (!compiled.insert(key.packed()).second) return;
+    engine->_pipelineCompiler.add("material", nullptr, [this, key]() { return pipelines.get(key.packed()); });
+  };
 
-  VkShaderModule meshVertexShader;
-  if (!vkutil::load_shader_module("build/shaders/mesh.vert.spv", engine->_device, &meshVertexShader))
-    fmt::print("Failed to load the mesh vertex shader\n");
+  for (bool dynamic : { false, true }) {
+    if (dynamic && !dynamicStateSupported) continue;
+
+    for (auto [doubleSided, flipWinding] : { std::pair{ true, false }, std::pair{ false, false }, std::pair{ false, true } }) {
+      for (MaterialPipelineKey::Shading shading : { MaterialPipelineKey::Shade, MaterialPipelineKey::Overdraw, MaterialPipelineKey::DepthOnly }) {
+        for (MaterialPass pass : { MaterialPass::MainColor, MaterialPass::Transparent }) {
+          for (bool depthEqual : { false, true }) {
+            MaterialPipelineKey key;
+            key.pass = pass;
+            key.shading = shading;
+            key.depthEqual = depthEqual;
+            key.doubleSided = doubleSided;
+            key.flipWinding = flipWinding;
+            key.dynamicState = dynamic;
+            compile(key);
+
+            // Overdraw without alpha testing keeps its early depth test, the generic variant would count more
+            if (shading == MaterialPipelineKey::Overdraw) {
+              key.features = 0;
+              compile(key);
+            }
+          }
+        }
+      }
+    }
+  }
+}
 
-  VkPushConstantRange matrixRange{};
-  matrixRange.offset = 0;
-  matrixRange.size = sizeof(GPUDrawPushConstants);
-  matrixRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+VkPipeline GLTFMetallic_Roughness::pipeline(MaterialPipelineKey key)
+{
+  key.dynamicState = dynamicState;
 
-  DescriptorLayoutBuilder layoutBuilder;
-  layoutBuilder.add_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-  layoutBuilder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-  layoutBuilder.add_binding(2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  VkPipeline pipeline = pipelines.find(key.packed());
+  if (pipeline != VK_NULL_HANDLE) return pipeline;
 
-  materialLayout = layoutBuilder.build(engine->_device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+  // Every generic variant is compiled at startup, so this only misses when that failed
+  key.features = MaterialAllFeatures;
+  return pipelines.find(key.packed());
+}
 
-  VkDescriptorSetLayout layouts[] = { engine->_gpuSceneDataDescriptorLayout, materialLayout };
+void GLTFMetallic_Roughness::precompile(const MaterialInstance& material, bool flipWinding)
+{
+  for (bool dynamic : { false, true }) {
+    if (dynamic && !dynamicStateSupported) continue;
+
+    MaterialPipelineKey key;
+    key.pass = material.passType;
+    key.doubleSided = material.doubleSided;
+    key.flipWinding = flipWinding;
+    key.features = material.features;
+    key.dynamicState = dynamic;
+    pipelines.precompile(key.packed());
+
+    // Opaque surfaces are also drawn into and shaded against the pre-pass, unless alpha testing keeps them out of it
+    if (material.passType == MaterialPass::MainColor && !(material.features & MaterialAlphaTest)) {
+      key.depthEqual = true;
+      pipelines.precompile(key.packed());
+    }
+  }
+}
 
-  VkPipelineLayoutCreateInfo mesh_layout_info = vkinit::pipeline_layout_create_info();
-  mesh_layout_info.setLayoutCount = 2;
-  mesh_layout_info.pSetLayouts = layouts;
-  mesh_layout_info.pPushConstantRanges = &matrixRange;
-  mesh_layout_info.pushConstantRangeCount = 1;
+VkPipeline GLTFMetallic_Roughness::create_pipeline(VulkanEngine* engine, MaterialPipelineKey key) const
+{
+  const char* vertexPath = (key.shading == MaterialPipelineKey::DepthOnly) ? "build/shaders/mesh_depth.vert.spv" : "build/shaders/mesh.vert.spv";
+  const char* fragmentPath = "build/shaders/mesh.frag.spv";
+  if (key.shading == MaterialPipelineKey::Overdraw) {
+    fragmentPath = (key.features & MaterialAlphaTest) ? "build/shaders/mesh_overdraw_alpha.frag.spv" : "build/shaders/mesh_overdraw.frag.spv";
+  }
 
-  VkPipelineLayout newLayout;
-  VK_CHECK(vkCreatePipelineLayout(engine->_device, &mesh_layout_info, nullptr, &newLayout));
+  VkShaderModule vertexShader;
+  if (!vkutil::load_shader_module(vertexPath, engine->_device, &vertexShader)) {
+    fmt::println("Failed to load {}", vertexPath);
+    return VK_NULL_HANDLE;
+  }
 
-  opaquePipeline.layout = newLayout;
-  transparentPipeline.layout = newLayout;
+  VkShaderModule fragmentShader = VK_NULL_HANDLE;
+  if (key.shading != MaterialPipelineKey::DepthOnly && !vkutil::load_shader_module(fragmentPath, engine->_device, &fragmentShader)) {
+    fmt::println("Failed to load {}", fragmentPath);
+    vkDestroyShaderModule(engine->_device, vertexShader, nullptr);
+    return VK_NULL_HANDLE;
+  }
 
   PipelineBuilder pipelineBuilder;
-  pipelineBuilder.set_shaders(meshVertexShader, meshFragShader);
+  pipelineBuilder.set_color_attachment_format(engine->_drawImage.imageFormat);
+  if (key.shading == MaterialPipelineKey::DepthOnly) {
+    pipelineBuilder.set_vertex_shader(vertexShader);
+    pipelineBuilder.disable_color_attachment();
+  } else {
+    pipelineBuilder.set_shaders(vertexShader, fragmentShader);
+  }
+
+  // Specialization constants of mesh.frag, one per feature bit
+  VkBool32 featureValues[] = { (key.features & MaterialAlphaTest) != 0, (key.features & MaterialColorTexture) != 0 };
+  VkSpecializationMapEntry featureEntries[] = { { 0, 0, sizeof(VkBool32) }, { 1, sizeof(VkBool32), sizeof(VkBool32) } };
+  VkSpecializationInfo specialization = { 2, featureEntries, sizeof(featureValues), featureValues };
+  if (key.shading == MaterialPipelineKey::Shade) pipelineBuilder.set_specialization(VK_SHADER_STAGE_FRAGMENT_BIT, &specialization);
+
+  MaterialPipelineKey::FixedFunction state = key.fixed_function();
+
   pipelineBuilder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
   pipelineBuilder.set_polygon_mode(VK_POLYGON_MODE_FILL);
-  pipelineBuilder.set_cull_mode(VK_CULL_MODE_NONE, VK_FRONT_FACE_CLOCKWISE);
+  pipelineBuilder.set_cull_mode(state.cullMode, state.frontFace);
   pipelineBuilder.set_multisampling_none();
-  pipelineBuilder.disable_blending();
-  // pipelineBuilder.disable_depthtest();
-  pipelineBuilder.enable_depthtest(true, VK_COMPARE_OP_GREATER_OR_EQUAL);
-
-  pipelineBuilder.set_color_attachment_format(engine->_drawImage.imageFormat);
-  pipelineBuilder.set_depth_format(engine->_depthImage.imageFormat);
 
-  pipelineBuilder._pipelineLayout = newLayout;
+  if (state.blendAdditive) {
+    pipelineBuilder.enable_blending_additive();
+  } else {
+    pipelineBuilder.disable_blending();
+  }
+  pipelineBuilder.enable_depthtest(state.depthWrite, state.depthCompare);
+
+  // The values above only matter to the baked path, the draw loop sets them from the same fixed_function
+  if (key.dynamicState) {
+    pipelineBuilder.add_dynamic_states({ VK_DYNAMIC_STATE_CULL_MODE, VK_DYNAMIC_STATE_FRONT_FACE, VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE,
+                                         VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE, VK_DYNAMIC_STATE_DEPTH_COMPARE_OP,
+                                         VK_DYNAMIC_STATE_POLYGON_MODE_EXT });
+    if (key.shading != MaterialPipelineKey::DepthOnly) {
+      pipelineBuilder.add_dynamic_states({ VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT, VK_DYNAMIC_STATE_COLOR_BLEND_EQUATION_EXT });
+    }
+  }
 
-  opaquePipeline.pipeline = pipelineBuilder.build_pipeline(engine->_device);
+  pipelineBuilder.set_depth_format(engine->_depthImage.imageFormat);
+  pipelineBuilder._pipelineLayout = pipelineLayout;
 
-  pipelineBuilder.enable_blending_additive();
-  pipelineBuilder.enable_depthtest(false, VK_COMPARE_OP_GREATER_OR_EQUAL);
+  VkPipeline pipeline = pipelineBuilder.build_pipeline(engine->_device, engine->_pipelineCache);
 
-  transparentPipeline.pipeline = pipelineBuilder.build_pipeline(engine->_device);
+  vkDestroyShaderModule(engine->_device, vertexShader, nullptr);
+  vkDestroyShaderModule(engine->_device, fragmentShader, nullptr);
 
-  vkDestroyShaderModule(engine->_device, meshFragShader, nullptr);
-  vkDestroyShaderModule(engine->_device, meshVertexShader, nullptr);
+  return pipeline;
 }
 
 MaterialInstance GLTFMetallic_Roughness::write_material(VkDevice device, MaterialPass pass, const MaterialResources& resources,
-                                DescriptorAllocatorGrowable& descriptorAllocator)
+                                DescriptorSetCache& descriptorCache) const
 {
   MaterialInstance matData;
   matData.passType = pass;
-  // if (pass == MaterialPass::Transparent) {
-  //   matData.pipeline = &transparentPipeline;
-  // } else {
-  //   matData.pipeline = &opaquePipeline;
-  // }
-  matData.pipeline = (pass == MaterialPass::Transparent) ? &transparentPipeline : &opaquePipeline;
-
-  matData.materialSet = descriptorAllocator.allocate(device, materialLayout);
+  matData.doubleSided = false;
 
-  writer.clear();
+  DescriptorWriter writer;
   writer.write_buffer(0, resources.dataBuffer, sizeof(MaterialConstants), resources.dataBufferOffset, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
   writer.write_image(1, resources.colorImage.imageView, resources.colorSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
                      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
   writer.write_image(2, resources.metalRoughImage.imageView, resources.metalRoughSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
                      VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
 
-  writer.update_set(device, matData.materialSet);
+  matData.materialSet = descriptorCache.get(device, materialLayout, writer);
 
   return matData;
 }
 
 void VulkanEngine::init_pipelines()
 {
+  _pipelineCache = vkutil::load_pipeline_cache(_device, _chosenGPU, PipelineCachePath);
+
+  // Pushed before the pipelines, so it's saved with everything compiled through the run
+  _mainDeletionQueue.push_function([this]() {
+    vkutil::save_pipeline_cache(_device, _pipelineCache, PipelineCachePath);
+    vkDestroyPipelineCache(_device, _pipelineCache, nullptr);
+  });
+
   // Compute
   init_background_pipelines();
 
   // Graphics
   init_triangle_pipeline();
   init_mesh_pipeline();
+  init_cluster_cull_pipeline();
+  init_depth_pyramid();
+  init_overdraw();
+  init_upscale();
 
   metalRoughMaterial.build_pipelines(this);
+
+  _pipelineCompiler.start();
 }
 
 void VulkanEngine::init_imgui()
@@ -832,6 +1419,17 @@ void VulkanEngine::init_default_data()
     destroy_image(_errorCheckerboardImage);
   });
 
+  std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> materialSizes = { { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
+                                                                            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 } };
+  descriptorSetCache.init(_device, 64, materialSizes, _poolProfiles["materials"]);
+
+  // Scenes release their references when they're destroyed, this only catches what's left over
+  _mainDeletionQueue.push_function([this]() {
+    imageCache.destroy(this);
+    samplerCache.destroy(_device);
+    descriptorSetCache.destroy(_device);
+  });
+
   GLTFMetallic_Roughness::MaterialResources materialResources;
   materialResources.colorImage = _whiteImage;
   materialResources.colorSampler = _defaultSamplerLinear;
@@ -844,15 +1442,20 @@ void VulkanEngine::init_default_data()
   GLTFMetallic_Roughness::MaterialConstants* sceneUniformData = (GLTFMetallic_Roughness::MaterialConstants*)materialConstants.allocation->GetMappedData();
   sceneUniformData->colorFactors = glm::vec4{1,1,1,1};
   sceneUniformData->metal_rough_factors = glm::vec4{1, 0.5, 0, 0};
+  // The generic variant alpha tests every material, a cutoff of 0 keeps everything
+  sceneUniformData->alpha_cutoff = glm::vec4{0};
 
   _mainDeletionQueue.push_function([this, materialConstants]() {
+    descriptorSetCache.release(defaultData.materialSet);
     destroy_buffer(materialConstants);
   });
 
   materialResources.dataBuffer = materialConstants.buffer;
   materialResources.dataBufferOffset = 0;
 
-  defaultData = metalRoughMaterial.write_material(_device, MaterialPass::MainColor, materialResources, globalDescriptorAllocator);
+  defaultData = metalRoughMaterial.write_material(_device, MaterialPass::MainColor, materialResources, descriptorSetCache);
+  defaultData.features = MaterialColorTexture;
+  metalRoughMaterial.precompile(defaultData);
 
   for (auto& m : testMeshes) {
     std::shared_ptr<MeshNode> newNode = std::make_shared<MeshNode>();
@@ -869,36 +1472,116 @@ void VulkanEngine::init_default_data()
   }
 }
 
-void VulkanEngine::immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function)
+void VulkanEngine::init_shader_reload()
 {
-  // Send the commands similarly to how we execute GPU commands, but without synchronizing with the swapchain
-  VK_CHECK(vkResetFences(_device, 1, &_immFence));
-  VK_CHECK(vkResetCommandBuffer(_immCommandBuffer, 0));
-
-  VkCommandBuffer cmd = _immCommandBuffer;
+  if (!shaderReloader.init("shaders", "build/shaders")) return;
 
-  VkCommandBufferBeginInfo cmdBeginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+  // Only the pipelines are rebuilt, they keep their layouts. Changing the resources a shader declares needs a restart
 
-  VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+  // Compute passes with a single pipeline
+  auto watchCompute = [this](const char* shader, VkPipeline* pipeline, VkPipelineLayout layout, VkPipelineCreateFlags flags) {
+    shaderReloader.watch({ shader }, [this, shader, pipeline, layout, flags]() -> std::function<void()> {
+      VkPipeline newPipeline = vkutil::create_compute_pipeline(_device, _pipelineCache, shader, layout, flags);
+      if (newPipeline == VK_NULL_HANDLE) return {};
 
-  function(cmd);
+      return [this, pipeline, newPipeline]() {
+        retire_pipeline(*pipeline);
+        *pipeline = newPipeline;
+      };
+    });
+  };
 
-  VK_CHECK(vkEndCommandBuffer(cmd));
+  watchCompute("build/shaders/background_resolve.comp.spv", &_backgroundResolvePipeline, _backgroundResolvePipelineLayout, 0);
+  watchCompute("build/shaders/meshlet_cull.comp.spv", &_clusterCullPipeline, _clusterCullPipelineLayout, _computePipelineFlags);
+  watchCompute("build/shaders/depth_reduce.comp.spv", &_depthReducePipeline, _depthReducePipelineLayout, _computePipelineFlags);
+  watchCompute("build/shaders/easu.comp.spv", &_easuPipeline, _upscalePipelineLayout, _computePipelineFlags);
+  watchCompute("build/shaders/composite.comp.spv", &_compositePipeline, _compositePipelineLayout, _computePipelineFlags);
+  watchCompute(overdrawEffect.shader, &overdrawEffect.pipeline, overdrawEffect.layout, 0);
+
+  for (size_t i = 0; i < backgroundEffects.size(); i++) {
+    const char* shader = backgroundEffects[i].shader;
+    VkPipelineLayout layout = backgroundEffects[i].layout;
+
+    shaderReloader.watch({ shader }, [this, i, shader, layout]() -> std::function<void()> {
+      VkPipeline pipeline = vkutil::create_compute_pipeline(_device, _pipelineCache, shader, layout);
+      VkPipeline cachePipeline = vkutil::create_compute_pipeline(_device, _pipelineCache, shader, layout, 0, &BackgroundCacheSpecialization);
+      if (pipeline == VK_NULL_HANDLE || cachePipeline == VK_NULL_HANDLE) {
+        vkDestroyPipeline(_device, pipeline, nullptr);
+        vkDestroyPipeline(_device, cachePipeline, nullptr);
+        return {};
+      }
 
-  VkCommandBufferSubmitInfo cmdInfo = vkinit::command_buffer_submit_info(cmd);
-  VkSubmitInfo2 submit = vkinit::submit_info(&cmdInfo, nullptr, nullptr);
+      return [this, i, pipeline, cachePipeline]() {
+        ComputeEffect& effect = backgroundEffects[i];
+        retire_pipeline(effect.pipeline);
+        retire_pipeline(effect.cachePipeline);
+        effect.pipeline = pipeline;
+        effect.cachePipeline = cachePipeline;
 
-  // Submit command buffer to the queue and execute it
-  // _renderFence will now block until the graphics commands finish execution
-  VK_CHECK(vkQueueSubmit2(_graphicsQueue, 1, &submit, _immFence));
+        // The cache still holds what the old shader drew
+        _backgroundCacheKey = {};
+      };
+    });
+  }
 
-  VK_CHECK(vkWaitForFences(_device, 1, &_immFence, true, 9999999999));
-}
+  // Every permutation compiled so far is built again, the ones still queued pick up the new shaders on their own
+  auto rebuildMaterials = [this]() -> std::function<void()> {
+    std::unordered_map<uint64_t, VkPipeline> rebuilt = metalRoughMaterial.pipelines.build_all();
+    if (rebuilt.empty()) return {};
+
+    return [this, rebuilt = std::move(rebuilt)]() mutable {
+      metalRoughMaterial.pipelines.replace(std::move(rebuilt), [this](VkPipeline pipeline) { retire_pipeline(pipeline); });
+    };
+  };
+  shaderReloader.watch({ "build/shaders/mesh.vert.spv", "build/shaders/mesh.frag.spv", "build/shaders/mesh_depth.vert.spv",
+                         "build/shaders/mesh_overdraw.frag.spv", "build/shaders/mesh_overdraw_alpha.frag.spv" },
+                       rebuildMaterials);
+
+  shaderReloader.start();
+}
+
+void VulkanEngine::retire_pipeline(VkPipeline pipeline)
+{
+  // Frames still in flight may use it, so it goes once this frame's slot comes around again
+  get_current_frame()._deletionQueue.push_function([this, pipeline]() {
+    vkDestroyPipeline(_device, pipeline, nullptr);
+  });
+}
+
+void VulkanEngine::immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function)
+{
+  // Send the commands similarly to how we execute GPU commands, but without synchronizing with the swapchain
+  VK_CHECK(vkResetFences(_device, 1, &_immFence));
+  VK_CHECK(vkResetCommandBuffer(_immCommandBuffer, 0));
+
+  VkCommandBuffer cmd = _immCommandBuffer;
+
+  VkCommandBufferBeginInfo cmdBeginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+
+  VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
+
+  function(cmd);
+
+  VK_CHECK(vkEndCommandBuffer(cmd));
+
+  VkCommandBufferSubmitInfo cmdInfo = vkinit::command_buffer_submit_info(cmd);
+  VkSubmitInfo2 submit = vkinit::submit_info(&cmdInfo, nullptr, nullptr);
+
+  // Submit command buffer to the queue and execute it
+  // _renderFence will now block until the graphics commands finish execution
+  VK_CHECK(vkQueueSubmit2(_graphicsQueue, 1, &submit, _immFence));
+
+  VK_CHECK(vkWaitForFences(_device, 1, &_immFence, true, 9999999999));
+}
 
 void VulkanEngine::destroy_swapchain()
 {
   vkDestroySwapchainKHR(_device, _swapchain, nullptr);
 
+  for (VkImage image : _swapchainImages) {
+    _imageStates.forget(image);
+  }
+
   // destroy swapchain's resources
   for (long unsigned int i = 0; i < _swapchainImageViews.size(); i++) {
     vkDestroyImageView(_device, _swapchainImageViews[i], nullptr);
@@ -907,11 +1590,8 @@ void VulkanEngine::destroy_swapchain()
 
 void GLTFMetallic_Roughness::clear_resources(VkDevice device)
 {
-  vkDestroyDescriptorSetLayout(device, materialLayout, nullptr);
-  vkDestroyPipelineLayout(device, transparentPipeline.layout, nullptr);
-
-  vkDestroyPipeline(device, transparentPipeline.pipeline, nullptr);
-  vkDestroyPipeline(device, opaquePipeline.pipeline, nullptr);
+  // The layouts belong to the engine's layout cache
+  pipelines.destroy();
 }
 
 void VulkanEngine::cleanup()
@@ -921,10 +1601,23 @@ void VulkanEngine::cleanup()
   // Ensure the GPU is done working
   vkDeviceWaitIdle(_device);
 
+  // Before the frames' deletion queues are flushed, reloads that were still pending retire into them
+  shaderReloader.destroy();
+
   loadedScenes.clear();
 
+  // Peak usage of this run on top of what was already learned, for the next one to size its pools with
+  _poolProfiles["global"].merge(globalDescriptorAllocator.profile());
+  _poolProfiles["materials"].merge(descriptorSetCache.profile());
+  for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
+    _poolProfiles["frame"].merge(_frames[i]._frameDescriptors.profile());
+  }
+  vkutil::save_pool_profiles(DescriptorProfilePath, _poolProfiles);
+
   for (unsigned int i = 0; i < FRAME_OVERLAP; i++) {
     vkDestroyCommandPool(_device, _frames[i]._commandPool, nullptr);
+    if (_computeQueue != VK_NULL_HANDLE) vkDestroyCommandPool(_device, _frames[i]._computeCommandPool, nullptr);
+    vkDestroyQueryPool(_device, _frames[i]._timestampPool, nullptr);
 
     vkDestroyFence(_device, _frames[i]._renderFence, nullptr);
     vkDestroySemaphore(_device, _frames[i]._renderSemaphore, nullptr);
@@ -936,6 +1629,7 @@ void VulkanEngine::cleanup()
   for (auto& mesh : testMeshes) {
     destroy_buffer(mesh->meshBuffers.indexBuffer);
     destroy_buffer(mesh->meshBuffers.vertexBuffer);
+    destroy_buffer(mesh->meshBuffers.meshletBuffer);
   }
 
   metalRoughMaterial.clear_resources(_device);
@@ -958,12 +1652,18 @@ void VulkanEngine::cleanup()
   loadedEngine = nullptr;
 }
 
-GPUMeshBuffers VulkanEngine::uploadMesh(std::span<uint32_t> indices, std::span<Vertex> vertices)
+GPUMeshBuffers VulkanEngine::uploadMesh(std::span<uint32_t> indices, std::span<Vertex> vertices, std::span<GPUMeshlet> meshlets)
 {
-  const size_t indexBufferSize = indices.size() * sizeof(uint32_t);
+  // Halve the index memory when every vertex fits in 16 bits. Primitive restart is off, so 0xFFFF is a valid index
+  const bool smallIndices = vertices.size() <= 65536;
+  const size_t indexSize = smallIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+
+  const size_t indexBufferSize = indices.size() * indexSize;
   const size_t vertexBufferSize = vertices.size() * sizeof(Vertex);
+  const size_t meshletBufferSize = meshlets.size() * sizeof(GPUMeshlet);
 
   GPUMeshBuffers newSurface;
+  newSurface.indexType = smallIndices ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
 
   // Create vertex buffer
   newSurface.vertexBuffer = create_buffer(vertexBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
@@ -976,13 +1676,34 @@ GPUMeshBuffers VulkanEngine::uploadMesh(std::span<uint32_t> indices, std::span<V
   newSurface.indexBuffer = create_buffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                                          VMA_MEMORY_USAGE_GPU_ONLY);
 
+  // Only meshes that were split into clusters get a meshlet buffer
+  newSurface.meshletBuffer = {};
+  newSurface.meshletBufferAddress = 0;
+  if (meshletBufferSize > 0) {
+    // Uploaded on the graphics queue, read by the culling pass on the compute queue
+    newSurface.meshletBuffer = create_buffer(meshletBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                                             VMA_MEMORY_USAGE_GPU_ONLY, true);
+
+    VkBufferDeviceAddressInfo meshletAddressInfo{ .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, .buffer = newSurface.meshletBuffer.buffer };
+    newSurface.meshletBufferAddress = vkGetBufferDeviceAddress(_device, &meshletAddressInfo);
+  }
+
   // Can't write to GPU directly, so create a staging buffer to be copied over
-  AllocatedBuffer staging = create_buffer(vertexBufferSize + indexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+  AllocatedBuffer staging = create_buffer(vertexBufferSize + indexBufferSize + meshletBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                          VMA_MEMORY_USAGE_CPU_ONLY);
 
   void* data = staging.allocation->GetMappedData();
 
   memcpy(data, vertices.data(), vertexBufferSize);
-  memcpy((char*)data + vertexBufferSize, indices.data(), indexBufferSize);
+  if (smallIndices) {
+    uint16_t* smallData = (uint16_t*)((char*)data + vertexBufferSize);
+    for (size_t i = 0; i < indices.size(); i++) {
+      smallData[i] = (uint16_t)indices[i];
+    }
+  } else {
+    memcpy((char*)data + vertexBufferSize, indices.data(), indexBufferSize);
+  }
+  if (meshletBufferSize > 0) memcpy((char*)data + vertexBufferSize + indexBufferSize, meshlets.data(), meshletBufferSize);
 
   immediate_submit([&](VkCommandBuffer cmd) {
     VkBufferCopy vertexCopy{0};
@@ -998,6 +1719,15 @@ GPUMeshBuffers VulkanEngine::uploadMesh(std::span<uint32_t> indices, std::span<V
     indexCopy.size = indexBufferSize;
 
     vkCmdCopyBuffer(cmd, staging.buffer, newSurface.indexBuffer.buffer, 1, &indexCopy);
+
+    if (meshletBufferSize > 0) {
+      VkBufferCopy meshletCopy{0};
+      meshletCopy.dstOffset = 0;
+      meshletCopy.srcOffset = vertexBufferSize + indexBufferSize;
+      meshletCopy.size = meshletBufferSize;
+
+      vkCmdCopyBuffer(cmd, staging.buffer, newSurface.meshletBuffer.buffer, 1, &meshletCopy);
+    }
   });
 
   destroy_buffer(staging);
@@ -1005,6 +1735,228 @@ GPUMeshBuffers VulkanEngine::uploadMesh(std::span<uint32_t> indices, std::span<V
   return newSurface;
 }
 
+void VulkanEngine::build_render_graph(uint32_t swapchainImageIndex)
+{
+  FrameData& frame = get_current_frame();
+  RenderGraph& graph = _renderGraph;
+
+  graph.reset();
+
+  prepare_geometry();
+  if (useClusterCulling) prepare_clusters();
+
+  bool cullObjects = useClusterCulling && frame._clusterObjectCount > 0;
+  bool twoPhase = cullObjects && useOcclusionCulling;
+  // The early culling pass only depends on the previous frame, so it can go ahead on the compute queue
+  bool asyncCompute = useAsyncCompute && _computeQueue != VK_NULL_HANDLE;
+
+  constexpr VkPipelineStageFlags2 computeStage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  constexpr VkPipelineStageFlags2 depthStages = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+  constexpr VkAccessFlags2 colorAccess = VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+  constexpr VkAccessFlags2 depthAccess = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  constexpr VkAccessFlags2 storageAccess = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+
+  auto timestamp = [this](VkCommandBuffer cmd, GPUTimestamp query) {
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestampPool, query);
+  };
+
+  VkExtent3D swapchainExtent = { _swapchainExtent.width, _swapchainExtent.height, 1 };
+
+  // Last frame's draw and depth are overwritten, the swapchain image comes fresh from the acquire
+  RGImage drawImage = graph.import_image("draw", _drawImage.image, _drawImage.imageView, _drawImage.imageExtent, true);
+  RGImage depthImage = graph.import_image("depth", _depthImage.image, _depthImage.imageView, _depthImage.imageExtent, true);
+  RGImage depthPyramid = graph.import_image("depth_pyramid", _depthPyramid.image, VK_NULL_HANDLE, _depthPyramid.imageExtent);
+  RGImage swapchainImage = graph.import_image("swapchain", _swapchainImages[swapchainImageIndex], _swapchainImageViews[swapchainImageIndex],
+                                              swapchainExtent, true);
+
+  // Static effects are drawn into the cache only when their inputs change, every frame copies it into the uncovered pixels
+  ComputeEffect& backgroundEffect = backgroundEffects[currentBackgroundEffect];
+  bool cachedBackground = useBackgroundCache && !backgroundEffect.timeDependent;
+  RGImage backgroundCache;
+
+  if (cachedBackground) {
+    backgroundCache = graph.import_image("background_cache", _backgroundCache.image, _backgroundCache.imageView, _backgroundCache.imageExtent);
+
+    BackgroundCacheKey key;
+    key.effect = currentBackgroundEffect;
+    key.data = backgroundEffect.data;
+    key.extent = _drawExtent;
+    key.view = backgroundEffect.viewDependent ? sceneData.view : glm::mat4(1.f);
+
+    if (!(key == _backgroundCacheKey)) {
+      _backgroundCacheKey = key;
+      graph.add_pass("background_cache", [this](VkCommandBuffer cmd) { draw_background_cache(cmd); })
+        .write(backgroundCache, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+        .async_compute(asyncCompute);
+    }
+  }
+
+  RGBuffer clusterStats, clusterCommands, lateClusterCommands;
+
+  if (useClusterCulling) {
+    clusterStats = graph.import_buffer("cluster_stats", frame._clusterStatsBuffer.buffer);
+
+    // Counters are reset on the GPU, the host only reads them after the fence
+    graph.add_pass("cluster_reset", [this](VkCommandBuffer cmd) {
+      vkCmdFillBuffer(cmd, get_current_frame()._clusterStatsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+    })
+      .write(clusterStats, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT)
+      .async_compute(asyncCompute);
+  }
+
+  if (cullObjects) {
+    clusterCommands = graph.import_buffer("cluster_commands", frame._clusterCommandBuffer.buffer);
+    lateClusterCommands = graph.import_buffer("late_cluster_commands", frame._lateClusterCommandBuffer.buffer);
+
+    RenderGraph::Pass& cull = graph.add_pass("cull_early", [this](VkCommandBuffer cmd) { cull_clusters(cmd, false); })
+      .write(clusterCommands, computeStage, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+      .write(clusterStats, computeStage, storageAccess)
+      .async_compute(asyncCompute);
+    if (useOcclusionCulling) cull.read(depthPyramid, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+  }
+
+  RGImage overdrawImage;
+  RGBuffer overdrawStats;
+
+  if (showOverdraw) {
+    overdrawImage = graph.create_image("overdraw", RGImageDesc{ _drawImage.imageExtent, VK_FORMAT_R32_UINT,
+                                                                VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT });
+    overdrawStats = graph.import_buffer("overdraw_stats", frame._overdrawStatsBuffer.buffer);
+
+    graph.add_pass("overdraw_clear", [this, overdrawImage](VkCommandBuffer cmd) {
+      begin_overdraw(cmd, _renderGraph.image(overdrawImage), _renderGraph.view(overdrawImage));
+    })
+      .write(overdrawImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT)
+      .write(overdrawStats, VK_PIPELINE_STAGE_2_CLEAR_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+  }
+
+  // Every geometry pass renders depth, the shading ones also color and the overdraw counts
+  auto geometry_pass = [&](const char* name, RenderGraph::ExecuteFn execute, bool shading, bool early, bool late) {
+    RenderGraph::Pass& pass = graph.add_pass(name, std::move(execute));
+    pass.write(depthImage, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, depthStages, depthAccess);
+    if (shading) {
+      pass.write(drawImage, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, colorAccess);
+      if (showOverdraw) pass.write(overdrawImage, VK_IMAGE_LAYOUT_GENERAL, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, storageAccess);
+    }
+    if (cullObjects && early) pass.read(clusterCommands, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+    if (cullObjects && late) pass.read(lateClusterCommands, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+  };
+
+  // Two phase occlusion culling: the early pass drew what was visible against last frame's depth. Build the pyramid
+  // from that depth and cull again for the clusters that turn out to be visible against it
+  auto occlusion_late_pass = [&]() {
+    graph.add_pass("depth_pyramid", [this](VkCommandBuffer cmd) { build_depth_pyramid(cmd); })
+      .read(depthImage, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+      .write(depthPyramid, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+    graph.add_pass("cull_late", [this](VkCommandBuffer cmd) { cull_clusters(cmd, true); })
+      .read(depthPyramid, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+      .read(clusterCommands, computeStage, VK_ACCESS_2_SHADER_STORAGE_READ_BIT)
+      .write(lateClusterCommands, computeStage, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+      .write(clusterStats, computeStage, storageAccess);
+  };
+
+  if (useDepthPrepass) {
+    geometry_pass("depth_prepass", [this, timestamp](VkCommandBuffer cmd) {
+      timestamp(cmd, TimestampGeometryBegin);
+      draw_geometry(cmd, GeometryDepthEarly);
+    }, false, true, false);
+
+    // The occlusion late pass only needs depth, so it happens before any shading
+    if (twoPhase) {
+      occlusion_late_pass();
+      geometry_pass("depth_prepass_late", [this](VkCommandBuffer cmd) { draw_geometry(cmd, GeometryDepthLate); }, false, false, true);
+    }
+
+    geometry_pass("shade", [this, timestamp](VkCommandBuffer cmd) {
+      timestamp(cmd, TimestampPrepassEnd);
+      draw_geometry(cmd, GeometryShadeEarly);
+    }, true, true, twoPhase);
+  } else {
+    geometry_pass("shade", [this, timestamp](VkCommandBuffer cmd) {
+      timestamp(cmd, TimestampGeometryBegin);
+      timestamp(cmd, TimestampPrepassEnd);
+      draw_geometry(cmd, GeometryShadeEarly);
+    }, true, true, false);
+
+    if (twoPhase) {
+      occlusion_late_pass();
+      geometry_pass("shade_late", [this](VkCommandBuffer cmd) { draw_geometry(cmd, GeometryShadeLate); }, true, false, true);
+    }
+  }
+
+  // Opaque depth is complete, the background only shades the pixels it left at the clear value
+  if (cachedBackground) {
+    graph.add_pass("background", [this](VkCommandBuffer cmd) { resolve_background(cmd); })
+      .read(depthImage, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+      .read(backgroundCache, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+      .write(drawImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, storageAccess);
+  } else {
+    graph.add_pass("background", [this](VkCommandBuffer cmd) { draw_background(cmd); })
+      .read(depthImage, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+      .write(drawImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, storageAccess);
+  }
+
+  geometry_pass("transparent", [this, timestamp](VkCommandBuffer cmd) {
+    draw_geometry(cmd, GeometryTransparent);
+    timestamp(cmd, TimestampGeometryEnd);
+  }, true, true, twoPhase);
+
+  if (showOverdraw) {
+    graph.add_pass("overdraw_heatmap", [this](VkCommandBuffer cmd) { draw_overdraw(cmd); })
+      .write(drawImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, storageAccess)
+      .read(overdrawImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_STORAGE_READ_BIT)
+      .write(overdrawStats, computeStage, storageAccess);
+  }
+
+  // Culled unless the composite reads it
+  RGImage upscaleImage = graph.create_image("upscale", RGImageDesc{ swapchainExtent, _drawImage.imageFormat,
+                                                                    VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT });
+
+  graph.add_pass("easu", [this, upscaleImage](VkCommandBuffer cmd) { upscale(cmd, _renderGraph.view(upscaleImage)); })
+    .read(drawImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+    .write(upscaleImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+  RGImage compositeTarget = swapchainImage;
+  if (!_swapchainStorage) {
+    compositeTarget = graph.create_image("composite", RGImageDesc{ swapchainExtent, VK_FORMAT_R8G8B8A8_UNORM,
+                                                                   VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT });
+  }
+
+  // Upscale, tonemap and write the frame into the swapchain image
+  bool upscaled = useUpscaleFilter;
+  RenderGraph::Pass& compositePass = graph.add_pass("composite", [this, upscaleImage, compositeTarget, upscaled](VkCommandBuffer cmd) {
+    composite(cmd, upscaled ? _renderGraph.view(upscaleImage) : VK_NULL_HANDLE, _renderGraph.view(compositeTarget));
+  })
+    .read(drawImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT)
+    .write(compositeTarget, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+  if (upscaled) compositePass.read(upscaleImage, VK_IMAGE_LAYOUT_GENERAL, computeStage, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+
+  if (!_swapchainStorage) {
+    graph.add_pass("composite_copy", [this, compositeTarget, swapchainImage](VkCommandBuffer cmd) {
+      vkutil::copy_image_to_image(cmd, _renderGraph.image(compositeTarget), _renderGraph.image(swapchainImage), _swapchainExtent, _swapchainExtent);
+    })
+      .read(compositeTarget, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_READ_BIT)
+      .write(swapchainImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_2_BLIT_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+  }
+
+  // draw imgui into the swapchain image, blending over the frame
+  graph.add_pass("imgui", [this, swapchainImage](VkCommandBuffer cmd) { draw_imgui(cmd, _renderGraph.view(swapchainImage)); })
+    .write(swapchainImage, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, colorAccess);
+
+  // Nothing to record, the layout change to a presentable format is all. The render semaphore signal orders the present after it
+  graph.add_pass("present")
+    .read(swapchainImage, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_NONE)
+    .side_effect();
+
+  // Counters the host reads after the frame's fence
+  RenderGraph::Pass& readback = graph.add_pass("readback").side_effect();
+  if (useClusterCulling) readback.read(clusterStats, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+  if (showOverdraw) readback.read(overdrawStats, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+
+  graph.compile();
+}
+
 void VulkanEngine::draw_background(VkCommandBuffer cmd)
 {
   VkClearColorValue clearValue;
@@ -1015,11 +1967,20 @@ void VulkanEngine::draw_background(VkCommandBuffer cmd)
 
   ComputeEffect& effect = backgroundEffects[currentBackgroundEffect];
 
+  // Pixels the opaque geometry covered are skipped
+  VkDescriptorSet depthSet = get_current_frame()._frameDescriptors.allocate(_device, _backgroundDepthDescriptorLayout);
+
+  DescriptorWriter writer;
+  writer.write_image(0, _depthImage.imageView, _defaultSamplerNearest, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL,
+                     VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.update_set(_device, depthSet);
+
   // Bind the background compute pipeline
   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, effect.pipeline);
 
   // Bind the descriptor set containing the draw image for the compute pipeline
-  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipelineLayout, 0, 1, &_drawImageDescriptors, 0, nullptr);
+  VkDescriptorSet sets[] = { _drawImageDescriptors, depthSet };
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipelineLayout, 0, 2, sets, 0, nullptr);
 
   ComputePushConstants pc;
   pc.data1 = glm::vec4(1, 0, 0, 1);
@@ -1031,19 +1992,115 @@ void VulkanEngine::draw_background(VkCommandBuffer cmd)
   vkCmdDispatch(cmd, std::ceil(_drawExtent.width / 16.0), std::ceil(_drawExtent.height / 16.0), 1);
 }
 
-void VulkanEngine::draw_geometry(VkCommandBuffer cmd)
+void VulkanEngine::draw_background_cache(VkCommandBuffer cmd)
+{
+  ComputeEffect& effect = backgroundEffects[currentBackgroundEffect];
+
+  // Nothing is depth tested, the set only has to hold a valid image
+  VkDescriptorSet depthSet = get_current_frame()._frameDescriptors.allocate(_device, _backgroundDepthDescriptorLayout);
+
+  DescriptorWriter writer;
+  writer.write_image(0, _blackImage.imageView, _defaultSamplerNearest, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                     VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.update_set(_device, depthSet);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, effect.cachePipeline);
+
+  VkDescriptorSet sets[] = { _backgroundCacheDescriptors, depthSet };
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _gradientPipelineLayout, 0, 2, sets, 0, nullptr);
+  vkCmdPushConstants(cmd, _gradientPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &effect.data);
+
+  vkCmdDispatch(cmd, (_drawExtent.width + 15) / 16, (_drawExtent.height + 15) / 16, 1);
+}
+
+void VulkanEngine::resolve_background(VkCommandBuffer cmd)
+{
+  VkDescriptorSet resolveSet = get_current_frame()._frameDescriptors.allocate(_device, _backgroundResolveDescriptorLayout);
+
+  DescriptorWriter writer;
+  writer.write_image(0, _depthImage.imageView, _defaultSamplerNearest, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL,
+                     VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.write_image(1, _backgroundCache.imageView, _defaultSamplerNearest, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.update_set(_device, resolveSet);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _backgroundResolvePipeline);
+
+  VkDescriptorSet sets[] = { _drawImageDescriptors, resolveSet };
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _backgroundResolvePipelineLayout, 0, 2, sets, 0, nullptr);
+
+  vkCmdDispatch(cmd, (_drawExtent.width + 15) / 16, (_drawExtent.height + 15) / 16, 1);
+}
+
+bool BackgroundCacheKey::operator==(const BackgroundCacheKey& other) const
+{
+  return effect == other.effect && data.data1 == other.data.data1 && data.data2 == other.data.data2 && data.data3 == other.data.data3 &&
+         data.data4 == other.data.data4 && extent.width == other.extent.width && extent.height == other.extent.height && view == other.view;
+}
+
+void VulkanEngine::prepare_geometry()
 {
   // reset counters
   stats.drawcall_count = 0;
   stats.triangle_count = 0;
+  stats.mesh_draw_time = 0;
+
+  FrameData& frame = get_current_frame();
+
+  // The frame's fence was waited on, nothing reads the previous contents anymore
+  GPUSceneData* sceneUniformData = (GPUSceneData*)frame._sceneDataBuffer.info.pMappedData;
+  *sceneUniformData = sceneData;
+
+  // Every pass draws from the same entries, the culling pass hands them on through its commands
+  std::vector<GPUObjectData> objects;
+  objects.reserve(mainDrawContext.OpaqueSurfaces.size() + mainDrawContext.TransparentSurfaces.size());
+
+  auto add_objects = [&](std::vector<RenderObject>& surfaces) {
+    for (RenderObject& r : surfaces) {
+      GPUObjectData object{};
+      object.worldMatrix = r.transform;
+      object.normalMatrix = glm::mat4(glm::transpose(glm::inverse(glm::mat3(r.transform))));
+      object.vertexBuffer = r.vertexBufferAddress;
+
+      r.objectIndex = (uint32_t)objects.size();
+      objects.push_back(object);
+    }
+  };
+
+  add_objects(mainDrawContext.OpaqueSurfaces);
+  add_objects(mainDrawContext.TransparentSurfaces);
+
+  if (objects.size() > frame._objectCapacity) {
+    // Only this frame slot's set points at the old buffer, and its last use is done
+    destroy_buffer(frame._objectBuffer);
+    while (frame._objectCapacity < objects.size()) frame._objectCapacity *= 2;
+    frame._objectBuffer = create_buffer(frame._objectCapacity * sizeof(GPUObjectData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                        VMA_MEMORY_USAGE_CPU_TO_GPU);
+
+    DescriptorWriter writer;
+    writer.write_buffer(1, frame._objectBuffer.buffer, VK_WHOLE_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.update_set(_device, frame._sceneDescriptor);
+  }
+
+  memcpy(frame._objectBuffer.info.pMappedData, objects.data(), objects.size() * sizeof(GPUObjectData));
+}
+
+void VulkanEngine::draw_geometry(VkCommandBuffer cmd, GeometryPass pass)
+{
   auto start = std::chrono::system_clock::now();
-  
-  VkRenderingAttachmentInfo colorAttachment = vkinit::attachment_info(_drawImage.imageView, nullptr, VK_IMAGE_LAYOUT_GENERAL);
+
+  FrameData& frame = get_current_frame();
+
+  bool depthOnly = pass == GeometryDepthEarly || pass == GeometryDepthLate;
+  // Only the first pass that touches depth clears it
+  bool loadDepth = pass == GeometryDepthLate || pass == GeometryShadeLate || pass == GeometryTransparent ||
+                   (pass == GeometryShadeEarly && useDepthPrepass);
+
+  VkRenderingAttachmentInfo colorAttachment = vkinit::attachment_info(_drawImage.imageView, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
   VkRenderingAttachmentInfo depthAttachment = vkinit::depth_attachment_info(_depthImage.imageView, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
-  VkRenderingInfo renderInfo = vkinit::rendering_info(_drawExtent, &colorAttachment, &depthAttachment);
-  vkCmdBeginRendering(cmd, &renderInfo);
+  if (loadDepth) depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+  VkRenderingInfo renderInfo = vkinit::rendering_info(_drawExtent, depthOnly ? nullptr : &colorAttachment, &depthAttachment);
 
-  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _trianglePipeline);
+  vkCmdBeginRendering(cmd, &renderInfo);
 
   // Set dynamic viewport and scissor
   VkViewport viewport = {};
@@ -1064,56 +2121,413 @@ void VulkanEngine::draw_geometry(VkCommandBuffer cmd)
 
   vkCmdSetScissor(cmd, 0, 1, &scissor);
 
-  // Draw triangle
-  // vkCmdDraw(cmd, 3, 1, 0, 0);
+  // Objects with clusters draw from the indirect commands of a culling pass, the rest directly
+  VkPipelineLayout layout = metalRoughMaterial.pipelineLayout;
+  auto draw = [&](const RenderObject& draw, VkPipeline pipeline, VkBuffer indirectCommands) {
+    // Neither the permutation nor its generic variant is ready, drawing never waits on a compile
+    if (pipeline == VK_NULL_HANDLE) return;
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &frame._sceneDescriptor, 0, nullptr);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 1, 1, &draw.material->materialSet, 0, nullptr);
+    if (showOverdraw) {
+      vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 2, 1, &frame._overdrawDescriptors, 0, nullptr);
+    }
+    
+    vkCmdBindIndexBuffer(cmd, draw.indexBuffer, 0, draw.indexType);
+
+    if (useClusterCulling && draw.meshletCount > 0) {
+      // One command per cluster, the culling pass zeroed the instance count of the ones that aren't visible
+      vkCmdDrawIndexedIndirect(cmd, indirectCommands, draw.firstCommand * sizeof(VkDrawIndexedIndirectCommand), draw.meshletCount,
+                               sizeof(VkDrawIndexedIndirectCommand));
+      stats.drawcall_count++;
+      return;
+    }
 
-  // Allocate a uniform buffer for the scene data
-  AllocatedBuffer gpuSceneDataBuffer = create_buffer(sizeof(GPUSceneData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-  
-  // Add it to the deletion queue
-  get_current_frame()._deletionQueue.push_function([this, gpuSceneDataBuffer]() {
-    destroy_buffer(gpuSceneDataBuffer);
-  });
+    // The first instance is the object's entry, the vertex shaders read it through gl_InstanceIndex
+    vkCmdDrawIndexed(cmd, draw.indexCount, 1, draw.firstIndex, 0, draw.objectIndex);
+    stats.drawcall_count++;
+    stats.triangle_count += draw.indexCount / 3;
+  };
 
-  GPUSceneData* sceneUniformData = (GPUSceneData*)gpuSceneDataBuffer.allocation->GetMappedData();
-  *sceneUniformData = sceneData;
+  // Alpha tested surfaces can't be drawn by the depth-only pipeline, they write their own depth when shading
+  auto in_prepass = [](const RenderObject& r) {
+    return r.material->passType == MaterialPass::MainColor && !(r.material->features & MaterialAlphaTest);
+  };
 
-  VkDescriptorSet globalDescriptor = get_current_frame()._frameDescriptors.allocate(_device, _gpuSceneDataDescriptorLayout);
+  // With dynamic state the pipelines only differ in their shaders, the rest of the key is set here when it changes.
+  // It carries over pipeline binds, all of them leave the same state dynamic
+  std::optional<MaterialPipelineKey::FixedFunction> boundState;
+  if (metalRoughMaterial.dynamicState) {
+    vkCmdSetDepthTestEnable(cmd, VK_TRUE);
+    _cmdSetPolygonMode(cmd, VK_POLYGON_MODE_FILL);
+  }
 
-  DescriptorWriter writer;
-  writer.write_buffer(0, gpuSceneDataBuffer.buffer, sizeof(GPUSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-  writer.update_set(_device, globalDescriptor);
+  auto set_fixed_function = [&](const MaterialPipelineKey& key) {
+    MaterialPipelineKey::FixedFunction state = key.fixed_function();
+    if (boundState == state) return;
 
-  auto draw = [&](const RenderObject& draw) {
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.material->pipeline->pipeline);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.material->pipeline->layout, 0, 1, &globalDescriptor, 0, nullptr);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, draw.material->pipeline->layout, 1, 1, &draw.material->materialSet, 0, nullptr);
-    
-    vkCmdBindIndexBuffer(cmd, draw.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+    if (!boundState || boundState->cullMode != state.cullMode) vkCmdSetCullMode(cmd, state.cullMode);
+    if (!boundState || boundState->frontFace != state.frontFace) vkCmdSetFrontFace(cmd, state.frontFace);
+    if (!boundState || boundState->depthWrite != state.depthWrite) vkCmdSetDepthWriteEnable(cmd, state.depthWrite);
+    if (!boundState || boundState->depthCompare != state.depthCompare) vkCmdSetDepthCompareOp(cmd, state.depthCompare);
 
-    GPUDrawPushConstants pushConstants;
-    pushConstants.vertexBuffer = draw.vertexBufferAddress;
-    pushConstants.worldMatrix = draw.transform;
-    vkCmdPushConstants(cmd, draw.material->pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushConstants), &pushConstants);
+    // Same equation as PipelineBuilder::enable_blending_additive, depth-only passes have no attachment to blend into
+    if (!depthOnly && (!boundState || boundState->blendAdditive != state.blendAdditive)) {
+      VkBool32 blendEnable = state.blendAdditive;
+      _cmdSetColorBlendEnable(cmd, 0, 1, &blendEnable);
 
-    vkCmdDrawIndexed(cmd, draw.indexCount, 1, draw.firstIndex, 0, 0);
-    stats.drawcall_count++;
-    stats.triangle_count += draw.indexCount / 3;
+      VkColorBlendEquationEXT equation = { VK_BLEND_FACTOR_SRC_ALPHA, VK_BLEND_FACTOR_ONE, VK_BLEND_OP_ADD,
+                                           VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ZERO, VK_BLEND_OP_ADD };
+      _cmdSetColorBlendEquation(cmd, 0, 1, &equation);
+    }
+
+    boundState = state;
   };
 
-  for (auto& r : mainDrawContext.OpaqueSurfaces) {
-    draw(r);
-  }
+  auto material_pipeline = [&](const RenderObject& r, MaterialPipelineKey::Shading shading) {
+    MaterialPipelineKey key;
+    key.pass = r.material->passType;
+    key.shading = shading;
+    key.depthEqual = useDepthPrepass && in_prepass(r);
+    key.doubleSided = r.material->doubleSided;
+    key.flipWinding = !r.material->doubleSided && glm::determinant(glm::mat3(r.transform)) < 0.f;
+    key.features = r.material->features;
+    if (metalRoughMaterial.dynamicState) set_fixed_function(key);
+    return metalRoughMaterial.pipeline(key);
+  };
 
-  for (auto& r : mainDrawContext.TransparentSurfaces) {
-    draw(r);
+  // Opaque materials shade against the pre-pass depth instead of writing their own. The overdraw view swaps in
+  // counting pipelines with the same depth state
+  MaterialPipelineKey::Shading shading = showOverdraw ? MaterialPipelineKey::Overdraw : MaterialPipelineKey::Shade;
+  auto shading_pipeline = [&](const RenderObject& r) { return material_pipeline(r, shading); };
+
+  bool twoPhase = useClusterCulling && useOcclusionCulling && frame._clusterObjectCount > 0;
+  VkBuffer earlyCommands = frame._clusterCommandBuffer.buffer;
+  VkBuffer lateCommands = frame._lateClusterCommandBuffer.buffer;
+
+  switch (pass) {
+  case GeometryDepthEarly:
+  case GeometryDepthLate:
+    for (auto& r : mainDrawContext.OpaqueSurfaces) {
+      if (!in_prepass(r)) continue;
+
+      if (pass == GeometryDepthEarly) {
+        draw(r, material_pipeline(r, MaterialPipelineKey::DepthOnly), earlyCommands);
+      } else if (r.meshletCount > 0) {
+        draw(r, material_pipeline(r, MaterialPipelineKey::DepthOnly), lateCommands);
+      }
+    }
+    break;
+  case GeometryShadeEarly: {
+    // With the pre-pass depth is complete by now, so this shades what both culling passes found visible
+    bool drawLate = useDepthPrepass && twoPhase;
+
+    for (auto& r : mainDrawContext.OpaqueSurfaces) {
+      draw(r, shading_pipeline(r), earlyCommands);
+      if (drawLate && r.meshletCount > 0) draw(r, shading_pipeline(r), lateCommands);
+    }
+    break;
+  }
+  case GeometryShadeLate:
+    for (auto& r : mainDrawContext.OpaqueSurfaces) {
+      if (r.meshletCount > 0) draw(r, shading_pipeline(r), lateCommands);
+    }
+    break;
+  case GeometryTransparent:
+    for (auto& r : mainDrawContext.TransparentSurfaces) {
+      draw(r, shading_pipeline(r), earlyCommands);
+      if (twoPhase && r.meshletCount > 0) draw(r, shading_pipeline(r), lateCommands);
+    }
+    break;
   }
 
   vkCmdEndRendering(cmd);
 
   auto end = std::chrono::system_clock::now();
   auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-  stats.mesh_draw_time = elapsed.count() / 1000.f;
+  stats.mesh_draw_time += elapsed.count() / 1000.f;
+}
+
+void VulkanEngine::begin_overdraw(VkCommandBuffer cmd, VkImage overdrawImage, VkImageView overdrawView)
+{
+  FrameData& frame = get_current_frame();
+
+  VkClearColorValue zero = {};
+  VkImageSubresourceRange clearRange = vkinit::image_subresource_range(VK_IMAGE_ASPECT_COLOR_BIT);
+  vkCmdClearColorImage(cmd, overdrawImage, VK_IMAGE_LAYOUT_GENERAL, &zero, 1, &clearRange);
+
+  // The minimum starts at the largest count so any covered pixel replaces it
+  vkCmdFillBuffer(cmd, frame._overdrawStatsBuffer.buffer, 0, sizeof(uint32_t), UINT32_MAX);
+  vkCmdFillBuffer(cmd, frame._overdrawStatsBuffer.buffer, sizeof(uint32_t), VK_WHOLE_SIZE, 0);
+
+  // Bound by every shading pass after this one
+  frame._overdrawDescriptors = frame._frameDescriptors.allocate(_device, _overdrawDescriptorLayout);
+
+  DescriptorWriter writer;
+  writer.write_image(0, overdrawView, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  writer.write_buffer(1, frame._overdrawStatsBuffer.buffer, sizeof(GPUOverdrawStats), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  writer.update_set(_device, frame._overdrawDescriptors);
+}
+
+void VulkanEngine::draw_overdraw(VkCommandBuffer cmd)
+{
+  // Overwrites the shaded image with the heatmap of the counts
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, overdrawEffect.pipeline);
+
+  VkDescriptorSet sets[] = { _drawImageDescriptors, get_current_frame()._overdrawDescriptors };
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, overdrawEffect.layout, 0, 2, sets, 0, nullptr);
+
+  vkCmdPushConstants(cmd, overdrawEffect.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &overdrawEffect.data);
+
+  vkCmdDispatch(cmd, std::ceil(_drawExtent.width / 16.0), std::ceil(_drawExtent.height / 16.0), 1);
+}
+
+GPUUpscalePushConstants VulkanEngine::upscale_push_constants() const
+{
+  GPUUpscalePushConstants pushConstants;
+  pushConstants.inputSize = glm::vec2(_drawExtent.width, _drawExtent.height);
+  pushConstants.outputSize = glm::vec2(_swapchainExtent.width, _swapchainExtent.height);
+  pushConstants.inputImageSize = glm::vec2(_drawImage.imageExtent.width, _drawImage.imageExtent.height);
+  pushConstants.sharpness = upscaleSharpness;
+  pushConstants.exposure = exposure;
+  pushConstants.tonemapper = tonemapper;
+  pushConstants.flags = useUpscaleFilter ? CompositeUpscaled : 0;
+  return pushConstants;
+}
+
+void VulkanEngine::bind_compute_descriptors(VkCommandBuffer cmd, VkPipelineLayout pipelineLayout, VkDescriptorSetLayout setLayout,
+                                            DescriptorWriter& writer)
+{
+  FrameData& frame = get_current_frame();
+
+  if (_useDescriptorBuffer) {
+    VkDeviceSize offset = frame._descriptorBuffer.allocate(_device, setLayout);
+    frame._descriptorBuffer.write(_device, setLayout, offset, writer);
+    frame._descriptorBuffer.bind_set(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, offset);
+    return;
+  }
+
+  VkDescriptorSet set = frame._frameDescriptors.allocate(_device, setLayout);
+  writer.update_set(_device, set);
+
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &set, 0, nullptr);
+}
+
+void VulkanEngine::upscale(VkCommandBuffer cmd, VkImageView upscaleView)
+{
+  DescriptorWriter writer;
+  writer.write_image(0, _drawImage.imageView, _upscaleSampler, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.write_image(1, upscaleView, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+
+  GPUUpscalePushConstants pushConstants = upscale_push_constants();
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _easuPipeline);
+  bind_compute_descriptors(cmd, _upscalePipelineLayout, _upscaleDescriptorLayout, writer);
+  vkCmdPushConstants(cmd, _upscalePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUUpscalePushConstants), &pushConstants);
+  vkCmdDispatch(cmd, (_swapchainExtent.width + 15) / 16, (_swapchainExtent.height + 15) / 16, 1);
+}
+
+void VulkanEngine::composite(VkCommandBuffer cmd, VkImageView upscaleView, VkImageView targetView)
+{
+  // Without the filter the upscaled binding isn't read, the draw image stands in for it
+  DescriptorWriter writer;
+  writer.write_image(0, upscaleView ? upscaleView : _drawImage.imageView, _upscaleSampler, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.write_image(1, _drawImage.imageView, _upscaleSampler, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+  writer.write_image(2, targetView, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+
+  GPUUpscalePushConstants pushConstants = upscale_push_constants();
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _compositePipeline);
+  bind_compute_descriptors(cmd, _compositePipelineLayout, _compositeDescriptorLayout, writer);
+  vkCmdPushConstants(cmd, _compositePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUUpscalePushConstants), &pushConstants);
+  vkCmdDispatch(cmd, (_swapchainExtent.width + 15) / 16, (_swapchainExtent.height + 15) / 16, 1);
+}
+
+void VulkanEngine::update_render_scale()
+{
+  // The GPU time read back is FRAME_OVERLAP frames old, so give a change time to show up before reacting again
+  constexpr int settleFrames = FRAME_OVERLAP + 2;
+  // The scale is held while the frame time is inside this band, as a fraction of the target
+  constexpr float lowerBand = 0.85f;
+  constexpr float upperBand = 0.95f;
+  // Largest change of the scale in one step
+  constexpr float maxStep = 0.05f;
+
+  if (!useDynamicResolution || stats.gpu_frame_time <= 0.f) return;
+  if (++_framesSinceScaleChange < settleFrames) return;
+
+  float load = stats.gpu_frame_time / targetFrameTime;
+  if (load > lowerBand && load < upperBand) return;
+
+  // GPU time goes with the pixel count, the square of the scale. Aim for the middle of the band
+  float desired = renderScale * std::sqrt((lowerBand + upperBand) * 0.5f / load);
+  float scale = std::clamp(desired, renderScale - maxStep, renderScale + maxStep);
+  scale = std::clamp(scale, minRenderScale, maxRenderScale);
+
+  if (scale != renderScale) {
+    renderScale = scale;
+    _framesSinceScaleChange = 0;
+  }
+}
+
+void VulkanEngine::prepare_clusters()
+{
+  // Gathers the objects for both culling passes and fills their buffers
+  FrameData& frame = get_current_frame();
+
+  std::vector<GPUCullObject> objects;
+  uint32_t commandCount = 0;
+
+  auto add_objects = [&](std::vector<RenderObject>& surfaces) {
+    for (RenderObject& r : surfaces) {
+      if (r.meshletCount == 0) continue;
+
+      // Normal cones only survive the transform with uniform scale and no mirroring
+      glm::vec3 axisScale{ glm::length(glm::vec3(r.transform[0])), glm::length(glm::vec3(r.transform[1])), glm::length(glm::vec3(r.transform[2])) };
+      float minScale = std::min({ axisScale.x, axisScale.y, axisScale.z });
+      float maxScale = std::max({ axisScale.x, axisScale.y, axisScale.z });
+      bool uniformScale = maxScale <= minScale * 1.001f && glm::determinant(glm::mat3(r.transform)) > 0.f;
+
+      GPUCullObject object{};
+      object.worldMatrix = r.transform;
+      object.boundingSphere = glm::vec4(r.bounds.origin, r.bounds.sphereRadius);
+      object.meshletBuffer = r.meshletBufferAddress;
+      object.firstMeshlet = r.firstMeshlet;
+      object.meshletCount = r.meshletCount;
+      object.firstCommand = commandCount;
+      object.flags = (uniformScale && !r.material->doubleSided) ? CullObjectConeCulling : 0;
+      object.objectIndex = r.objectIndex;
+      objects.push_back(object);
+
+      r.firstCommand = commandCount;
+      commandCount += r.meshletCount;
+    }
+  };
+
+  add_objects(mainDrawContext.OpaqueSurfaces);
+  add_objects(mainDrawContext.TransparentSurfaces);
+
+  stats.cluster_count = commandCount;
+  frame._clusterObjectCount = (uint32_t)objects.size();
+  frame._clusterCommandCount = commandCount;
+
+  if (objects.empty()) return;
+
+  // Only this frame slot's culling passes and draws use the old buffers, and they are done
+  bool growObjects = objects.size() > frame._clusterObjectCapacity;
+  bool growCommands = commandCount > frame._clusterCommandCapacity;
+  if (growObjects) {
+    destroy_buffer(frame._clusterObjectBuffer);
+    while (frame._clusterObjectCapacity < objects.size()) frame._clusterObjectCapacity *= 2;
+  }
+  if (growCommands) {
+    destroy_buffer(frame._clusterCommandBuffer);
+    destroy_buffer(frame._lateClusterCommandBuffer);
+    while (frame._clusterCommandCapacity < commandCount) frame._clusterCommandCapacity *= 2;
+  }
+  if (growObjects || growCommands) create_cluster_buffers(frame, growObjects, growCommands);
+
+  memcpy(frame._clusterObjectBuffer.info.pMappedData, objects.data(), objects.size() * sizeof(GPUCullObject));
+}
+
+void VulkanEngine::create_cluster_buffers(FrameData& frame, bool objects, bool commands)
+{
+  // The early pass may run on the compute queue, the late one and the draws on the graphics queue
+  // Device addresses are only needed when the cull set lives in a descriptor buffer
+  VkBufferUsageFlags addressUsage = _useDescriptorBuffer ? VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT : 0;
+
+  if (objects) {
+    frame._clusterObjectBuffer = create_buffer(frame._clusterObjectCapacity * sizeof(GPUCullObject), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | addressUsage,
+                                               VMA_MEMORY_USAGE_CPU_TO_GPU, true);
+  }
+
+  if (commands) {
+    VkBufferUsageFlags commandUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | addressUsage;
+    frame._clusterCommandBuffer = create_buffer(frame._clusterCommandCapacity * sizeof(VkDrawIndexedIndirectCommand), commandUsage,
+                                                VMA_MEMORY_USAGE_GPU_ONLY, true);
+    frame._lateClusterCommandBuffer = create_buffer(frame._clusterCommandCapacity * sizeof(VkDrawIndexedIndirectCommand), commandUsage,
+                                                    VMA_MEMORY_USAGE_GPU_ONLY, true);
+  }
+}
+
+void VulkanEngine::cull_clusters(VkCommandBuffer cmd, bool latePass)
+{
+  FrameData& frame = get_current_frame();
+
+  if (frame._clusterObjectCount == 0) return;
+
+  // The early pass reuses the last frame's pyramid, the late one the pyramid of this frame's early depth
+  bool occlusion = useOcclusionCulling && (latePass || depthPyramidReady);
+
+  AllocatedBuffer& commandBuffer = latePass ? frame._lateClusterCommandBuffer : frame._clusterCommandBuffer;
+  size_t commandBufferSize = frame._clusterCommandCount * sizeof(VkDrawIndexedIndirectCommand);
+
+  DescriptorWriter writer;
+  writer.write_buffer(0, frame._clusterObjectBuffer.buffer, frame._clusterObjectCount * sizeof(GPUCullObject), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  writer.write_buffer(1, commandBuffer.buffer, commandBufferSize, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  writer.write_buffer(2, frame._clusterStatsBuffer.buffer, sizeof(GPUClusterStats), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  // Only read by the late pass, the early pass just needs something valid bound
+  writer.write_buffer(3, frame._clusterCommandBuffer.buffer, commandBufferSize, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  writer.write_image(4, _depthPyramid.imageView, _depthPyramidSampler, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+
+  // Symmetric frustum, so one plane normal per axis covers both sides
+  float P00 = sceneData.proj[0][0];
+  float P11 = std::abs(sceneData.proj[1][1]);
+  float lengthX = std::sqrt(P00 * P00 + 1.f);
+  float lengthY = std::sqrt(P11 * P11 + 1.f);
+
+  GPUCullPushConstants pushConstants;
+  pushConstants.view = sceneData.view;
+  pushConstants.frustum = glm::vec4(P00 / lengthX, 1.f / lengthX, P11 / lengthY, 1.f / lengthY);
+  pushConstants.cameraPosition = glm::vec4(mainCamera.position, CameraNear);
+  pushConstants.projection = glm::vec4(P00, P11, sceneData.proj[2][2], sceneData.proj[3][2]);
+  pushConstants.pyramidSize = glm::vec2(_depthPyramidExtent.width, _depthPyramidExtent.height);
+  pushConstants.objectCount = frame._clusterObjectCount;
+  pushConstants.flags = (occlusion ? CullOcclusion : 0) | (latePass ? CullLatePass : 0);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _clusterCullPipeline);
+  bind_compute_descriptors(cmd, _clusterCullPipelineLayout, _clusterCullDescriptorLayout, writer);
+  vkCmdPushConstants(cmd, _clusterCullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUCullPushConstants), &pushConstants);
+
+  // One workgroup per object, its threads stride over the object's clusters
+  vkCmdDispatch(cmd, frame._clusterObjectCount, 1, 1);
+}
+
+void VulkanEngine::build_depth_pyramid(VkCommandBuffer cmd)
+{
+  // The graph orders the pass against the rest of the frame, the levels inside it wait on each other
+  vkutil::BarrierBatch barriers(_imageStates);
+
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _depthReducePipeline);
+
+  for (uint32_t i = 0; i < _depthPyramidLevels; i++) {
+    VkExtent2D levelExtent = { std::max(_depthPyramidExtent.width >> i, 1u), std::max(_depthPyramidExtent.height >> i, 1u) };
+    VkExtent2D inputExtent = (i == 0) ? _drawExtent : VkExtent2D{ std::max(_depthPyramidExtent.width >> (i - 1), 1u), std::max(_depthPyramidExtent.height >> (i - 1), 1u) };
+
+    DescriptorWriter writer;
+    if (i == 0) {
+      writer.write_image(0, _depthImage.imageView, _depthPyramidSampler, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    } else {
+      writer.write_image(0, _depthPyramidMips[i - 1], _depthPyramidSampler, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    }
+    writer.write_image(1, _depthPyramidMips[i], VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+
+    glm::vec4 sizes = glm::vec4(inputExtent.width, inputExtent.height, levelExtent.width, levelExtent.height);
+
+    bind_compute_descriptors(cmd, _depthReducePipelineLayout, _depthReduceDescriptorLayout, writer);
+    vkCmdPushConstants(cmd, _depthReducePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(glm::vec4), &sizes);
+    vkCmdDispatch(cmd, (levelExtent.width + 15) / 16, (levelExtent.height + 15) / 16, 1);
+
+    // The next level reads this one, the last one is read by the culling
+    if (i + 1 < _depthPyramidLevels) {
+      barriers.memory(VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+      barriers.flush(cmd);
+    }
+  }
+
+  depthPyramidReady = true;
 }
 
 void VulkanEngine::draw_imgui(VkCommandBuffer cmd, VkImageView targetImageView)
@@ -1128,21 +2542,80 @@ void VulkanEngine::draw_imgui(VkCommandBuffer cmd, VkImageView targetImageView)
   vkCmdEndRendering(cmd);
 }
 
+// How far under the error threshold a coarser level has to be before switching to it
+constexpr float LodHysteresis = 0.25f;
+
+uint32_t select_lod(const GeoSurface& surface, const glm::mat4& transform, float scale, const DrawContext& ctx, uint32_t current)
+{
+  const uint32_t levelCount = (uint32_t)surface.lods.size() + 1;
+  if (ctx.forcedLod >= 0) return std::min((uint32_t)ctx.forcedLod, levelCount - 1);
+
+  // Distance to the closest point of the bounding sphere
+  glm::vec3 center = glm::vec3(transform * glm::vec4(surface.bounds.origin, 1.f));
+  float radius = surface.bounds.sphereRadius * scale;
+  float distance = std::max(glm::distance(center, ctx.cameraPosition) - radius, 0.001f);
+
+  float pixelsPerUnit = ctx.lodProjectionScale / distance;
+
+  // Coarsest level whose projected error is still within the threshold
+  auto coarsest_within = [&](float threshold) {
+    uint32_t level = 0;
+    for (uint32_t i = 0; i < surface.lods.size(); i++) {
+      if (surface.lods[i].error * scale * pixelsPerUnit > threshold) break;
+      level = i + 1;
+    }
+    return level;
+  };
+
+  // Refining happens straight away, but coarsening needs some margin so objects near the boundary don't pop back and forth
+  uint32_t target = coarsest_within(ctx.lodPixelError);
+  if (target > current) target = std::max(current, coarsest_within(ctx.lodPixelError * (1.f - LodHysteresis)));
+
+  return target;
+}
+
 void MeshNode::Draw(const glm::mat4& topMatrix, DrawContext& ctx)
 {
   glm::mat4 nodeMatrix = topMatrix * worldTransform;
 
-  for (auto& s : mesh->surfaces) {
+  // Largest axis scale, to move the bounds and LOD errors into world space
+  float scale = std::max({ glm::length(glm::vec3(nodeMatrix[0])), glm::length(glm::vec3(nodeMatrix[1])), glm::length(glm::vec3(nodeMatrix[2])) });
+
+  if (currentLods.size() != mesh->surfaces.size()) currentLods.assign(mesh->surfaces.size(), 0);
+
+  for (size_t i = 0; i < mesh->surfaces.size(); i++) {
+    const GeoSurface& s = mesh->surfaces[i];
+
+    uint32_t lod = select_lod(s, nodeMatrix, scale, ctx, currentLods[i]);
+    currentLods[i] = lod;
+
     RenderObject def;
-    def.indexCount = s.count;
-    def.firstIndex = s.startIndex;
+    if (lod == 0) {
+      def.indexCount = s.count;
+      def.firstIndex = s.startIndex;
+    } else {
+      def.indexCount = s.lods[lod - 1].count;
+      def.firstIndex = s.lods[lod - 1].startIndex;
+    }
     def.indexBuffer = mesh->meshBuffers.indexBuffer.buffer;
+    def.indexType = mesh->meshBuffers.indexType;
     def.material = &s.material->data;
+    def.bounds = s.bounds;
 
     def.transform = nodeMatrix;
     def.vertexBufferAddress = mesh->meshBuffers.vertexBufferAddress;
 
-    ctx.OpaqueSurfaces.push_back(def);
+    def.firstMeshlet = (lod == 0) ? s.firstMeshlet : s.lods[lod - 1].firstMeshlet;
+    def.meshletCount = (lod == 0) ? s.meshletCount : s.lods[lod - 1].meshletCount;
+    def.meshletBufferAddress = mesh->meshBuffers.meshletBufferAddress;
+    def.firstCommand = 0;
+
+    // Blended surfaces are drawn after the background, on top of everything opaque
+    if (s.material->data.passType == MaterialPass::Transparent) {
+      ctx.TransparentSurfaces.push_back(def);
+    } else {
+      ctx.OpaqueSurfaces.push_back(def);
+    }
   }
   
   Node::Draw(topMatrix, ctx);
@@ -1155,6 +2628,21 @@ void VulkanEngine::update_scene()
   mainDrawContext.OpaqueSurfaces.clear();
   mainDrawContext.TransparentSurfaces.clear();
 
+  mainCamera.update();
+
+  glm::mat4 view = mainCamera.getViewMatrix();
+  glm::mat4 proj = glm::perspective(glm::radians(70.f), (float)_windowExtent.width / (float)_windowExtent.height, CameraFar, CameraNear);
+
+  // LOD selection has to know the camera before walking the scene. Errors are measured at the height draw() renders
+  // at, which can differ from the window
+  float drawHeight = std::min(_swapchainExtent.height, _drawImage.imageExtent.height) * renderScale;
+  mainDrawContext.cameraPosition = mainCamera.position;
+  mainDrawContext.lodProjectionScale = proj[1][1] * drawHeight * 0.5f;
+  mainDrawContext.lodPixelError = lodPixelError;
+  mainDrawContext.forcedLod = forcedLod;
+
+  proj[1][1] *= -1;
+
   // loadedNodes["Suzanne"]->Draw(glm::mat4{1.f}, mainDrawContext);
 
   // for (auto& m : loadedNodes) {
@@ -1168,12 +2656,6 @@ void VulkanEngine::update_scene()
 
   loadedScenes["structure"]->Draw(glm::mat4{ 1.f }, mainDrawContext);
 
-  mainCamera.update();
-
-  glm::mat4 view = mainCamera.getViewMatrix();
-  glm::mat4 proj = glm::perspective(glm::radians(70.f), (float)_windowExtent.width / (float)_windowExtent.height, 10000.f, .1f);
-  proj[1][1] *= -1;
-  
   sceneData.view = view;
   sceneData.proj = proj;
   sceneData.viewproj = proj * view;
@@ -1198,6 +2680,43 @@ void VulkanEngine::draw()
   get_current_frame()._deletionQueue.flush();
   get_current_frame()._frameDescriptors.clear_pools(_device);
 
+  // Pipelines rebuilt since the last frame, nothing has been recorded with the current ones yet
+  shaderReloader.apply();
+  if (_useDescriptorBuffer) get_current_frame()._descriptorBuffer.clear();
+
+  // Culling counters from the last time this frame slot was drawn
+  AllocatedBuffer& clusterStatsBuffer = get_current_frame()._clusterStatsBuffer;
+  vmaInvalidateAllocation(_allocator, clusterStatsBuffer.allocation, 0, VK_WHOLE_SIZE);
+  GPUClusterStats* clusterStats = (GPUClusterStats*)clusterStatsBuffer.info.pMappedData;
+  stats.visible_cluster_count = clusterStats->visibleClusters;
+  stats.visible_cluster_triangles = clusterStats->visibleTriangles;
+  stats.occluded_cluster_count = clusterStats->occludedClusters;
+  stats.occluded_object_count = clusterStats->occludedObjects;
+
+  // GPU times of the last time this frame slot was drawn, in milliseconds
+  uint64_t timestamps[TimestampCount];
+  if (vkGetQueryPoolResults(_device, get_current_frame()._timestampPool, 0, TimestampCount, sizeof(timestamps), timestamps,
+                            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+    auto milliseconds = [&](GPUTimestamp begin, GPUTimestamp end) {
+      return (timestamps[end] - timestamps[begin]) * _timestampPeriod / 1000000.f;
+    };
+    stats.gpu_frame_time = milliseconds(TimestampFrameBegin, TimestampFrameEnd);
+    stats.gpu_geometry_time = milliseconds(TimestampGeometryBegin, TimestampGeometryEnd);
+    stats.gpu_prepass_time = milliseconds(TimestampGeometryBegin, TimestampPrepassEnd);
+  }
+
+  update_render_scale();
+
+  if (showOverdraw) {
+    AllocatedBuffer& overdrawStatsBuffer = get_current_frame()._overdrawStatsBuffer;
+    vmaInvalidateAllocation(_allocator, overdrawStatsBuffer.allocation, 0, VK_WHOLE_SIZE);
+    GPUOverdrawStats* overdrawStats = (GPUOverdrawStats*)overdrawStatsBuffer.info.pMappedData;
+    bool covered = overdrawStats->coveredPixels > 0;
+    stats.overdraw_min = covered ? overdrawStats->minCount : 0;
+    stats.overdraw_max = overdrawStats->maxCount;
+    stats.overdraw_avg = covered ? (float)overdrawStats->totalCount / overdrawStats->coveredPixels : 0.f;
+  }
+
   // Request an image from the swapchain
   uint32_t swapchainImageIndex;
 
@@ -1222,47 +2741,78 @@ void VulkanEngine::draw()
 
   VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
 
-  // Transition our draw image into general layout so we can write into it from the pipeline
-  vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
-
-  draw_background(cmd);
+  vkCmdResetQueryPool(cmd, get_current_frame()._timestampPool, 0, TimestampCount);
+  vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestampPool, TimestampFrameBegin);
 
-  // Transition the draw image into the best format for geometry drawing
-  vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
-  vkutil::transition_image(cmd, _depthImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+  // The stages the acquire semaphore is waited on below
+  VkPipelineStageFlags2 acquireStage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  _imageStates.acquired(_swapchainImages[swapchainImageIndex], acquireStage);
 
-  draw_geometry(cmd);
+  build_render_graph(swapchainImageIndex);
 
-  // Convert the image drawn and the swapchain image into transferrable layouts
-  vkutil::transition_image(cmd, _drawImage.image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-  vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  if (dumpRenderGraph) {
+    fmt::print("{}", _renderGraph.dump());
+    dumpRenderGraph = false;
+  }
 
-  // Copy from the drawn image to the swapchain image
-  vkutil::copy_image_to_image(cmd, _drawImage.image, _swapchainImages[swapchainImageIndex], _drawExtent, _swapchainExtent);
+  // Async compute passes get their own command buffer, submitted ahead of the graphics one
+  VkCommandBuffer computeCmd = VK_NULL_HANDLE;
+  if (_renderGraph.has_async_work()) {
+    computeCmd = get_current_frame()._computeCommandBuffer;
+    VK_CHECK(vkResetCommandBuffer(computeCmd, 0));
+    VK_CHECK(vkBeginCommandBuffer(computeCmd, &cmdBeginInfo));
+  }
 
-  // Set swapchain to Attachment Optimal so we can add to it
-  vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  // Bound once per command buffer, passes only set their offsets into it
+  if (_useDescriptorBuffer) {
+    get_current_frame()._descriptorBuffer.bind_buffer(cmd);
+    if (computeCmd != VK_NULL_HANDLE) get_current_frame()._descriptorBuffer.bind_buffer(computeCmd);
+  }
 
-  // draw imgui into the swapchain image
-  draw_imgui(cmd, _swapchainImageViews[swapchainImageIndex]);
+  _renderGraph.execute(cmd, computeCmd);
 
-  // Set swapchain image layout to a presentable format
-  vkutil::transition_image(cmd, _swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+  vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestampPool, TimestampFrameEnd);
 
   // Finalize the command buffer, preventing additional commands being added but allowing execution
   VK_CHECK(vkEndCommandBuffer(cmd));
 
+  if (computeCmd != VK_NULL_HANDLE) {
+    VK_CHECK(vkEndCommandBuffer(computeCmd));
+
+    VkCommandBufferSubmitInfo computeCmdInfo = vkinit::command_buffer_submit_info(computeCmd);
+
+    // The previous frame's graphics work still reads what the compute passes overwrite, like the draw image
+    VkSemaphoreSubmitInfo computeWaitInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _graphicsTimeline);
+    computeWaitInfo.value = _frameNumber;
+    VkSemaphoreSubmitInfo computeSignalInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _computeTimeline);
+    computeSignalInfo.value = _frameNumber + 1;
+
+    VkSubmitInfo2 computeSubmit = vkinit::submit_info(&computeCmdInfo, &computeSignalInfo, &computeWaitInfo);
+
+    VK_CHECK(vkQueueSubmit2(_computeQueue, 1, &computeSubmit, VK_NULL_HANDLE));
+  }
+
   // Prepare the submission to the queue
   VkCommandBufferSubmitInfo cmdInfo = vkinit::command_buffer_submit_info(cmd);
 
   // We have to wait on the _presentSemaphore, since that will be signaled when the swapchain is ready
   // We also signal the _renderSemaphore to signal that rendering has finished
-  VkSemaphoreSubmitInfo waitInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR,
-                                                                 get_current_frame()._swapchainSemaphore);
-  VkSemaphoreSubmitInfo signalInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT,
-                                                                   get_current_frame()._renderSemaphore);
-
-  VkSubmitInfo2 submit = vkinit::submit_info(&cmdInfo, &signalInfo, &waitInfo);
+  // The composite pass writes the swapchain image from compute
+  VkSemaphoreSubmitInfo waitInfos[2];
+  waitInfos[0] = vkinit::semaphore_submit_info(acquireStage, get_current_frame()._swapchainSemaphore);
+  // Only the stages consuming the async results wait for them, the rest of the frame overlaps with the compute queue
+  waitInfos[1] = vkinit::semaphore_submit_info(_renderGraph.async_wait_stage(), _computeTimeline);
+  waitInfos[1].value = _frameNumber + 1;
+
+  // The frame number lets the next frame's compute submission wait for this one
+  VkSemaphoreSubmitInfo signalInfos[2];
+  signalInfos[0] = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, get_current_frame()._renderSemaphore);
+  signalInfos[1] = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, _graphicsTimeline);
+  signalInfos[1].value = _frameNumber + 1;
+
+  VkSubmitInfo2 submit = vkinit::submit_info(&cmdInfo, signalInfos, waitInfos);
+  submit.waitSemaphoreInfoCount = computeCmd != VK_NULL_HANDLE ? 2 : 1;
+  submit.signalSemaphoreInfoCount = 2;
 
   // Submit the command buffer to the queue and execute it
   // _renderFence will now block again until the graphics commands finish execution
@@ -1333,7 +2883,6 @@ void VulkanEngine::run()
 
     // Some imgui UI for selecting shader
     // if (ImGui::Begin("background")) {
-    //   ImGui::SliderFloat("Render Scale", &renderScale, 0.3f, 1.f);
     //   ComputeEffect& selected = backgroundEffects[currentBackgroundEffect];
 
     //   ImGui::Text("Selected effect: %s", selected.name);
@@ -1353,6 +2902,62 @@ void VulkanEngine::run()
     ImGui::Text("update time %f ms", stats.scene_update_time);
     ImGui::Text("triangles %i", stats.triangle_count);
     ImGui::Text("draws %i", stats.drawcall_count);
+    ImGui::Text("clusters %i / %i", stats.visible_cluster_count, stats.cluster_count);
+    ImGui::Text("cluster triangles %i", stats.visible_cluster_triangles);
+    ImGui::Text("occluded objects %i clusters %i", stats.occluded_object_count, stats.occluded_cluster_count);
+    ImGui::Text("gpu frame %f ms", stats.gpu_frame_time);
+    ImGui::Text("gpu geometry %f ms (pre-pass %f ms)", stats.gpu_geometry_time, stats.gpu_prepass_time);
+    ImGui::Checkbox("Depth pre-pass", &useDepthPrepass);
+    ImGui::Checkbox("Overdraw", &showOverdraw);
+    if (_computeQueue != VK_NULL_HANDLE) ImGui::Checkbox("Async compute", &useAsyncCompute);
+    ImGui::Checkbox("Cache background", &useBackgroundCache);
+    if (showOverdraw) {
+      ImGui::Text("overdraw min %i avg %f max %i", stats.overdraw_min, stats.overdraw_avg, stats.overdraw_max);
+      ImGui::SliderFloat("Overdraw scale", &overdrawEffect.data.data1.x, 2.f, 32.f);
+    }
+    if (ImGui::Button("Dump render graph")) dumpRenderGraph = true;
+
+    if (_supportsDynamicState) ImGui::Checkbox("Dynamic pipeline state", &metalRoughMaterial.dynamicState);
+    ImGui::Text("material pipelines %zu (compiling %zu)", metalRoughMaterial.pipelines.size(), metalRoughMaterial.pipelines.pending());
+
+    DescriptorAllocatorGrowable::Stats descriptorStats = get_current_frame()._frameDescriptors.stats();
+    ImGui::Text("descriptor pools %u, failed allocations %u (fragmented %u)", descriptorStats.poolsCreated,
+                descriptorStats.outOfPoolMemory + descriptorStats.fragmentedPool, descriptorStats.fragmentedPool);
+    ImGui::Text("descriptor sets %u / %u, fragmentation %.0f%%", descriptorStats.used.sets, descriptorStats.reserved.sets,
+                descriptorStats.fragmentation * 100.f);
+    for (uint32_t i = 0; i < DescriptorTypeCount; i++) {
+      if (descriptorStats.reserved.descriptors[i] == 0) continue;
+      ImGui::Text("  %s %u / %u", string_VkDescriptorType((VkDescriptorType)i), descriptorStats.used.descriptors[i],
+                  descriptorStats.reserved.descriptors[i]);
+    }
+    ImGui::End();
+
+    if (ImGui::Begin("LOD")) {
+      ImGui::SliderInt("Force LOD", &forcedLod, -1, MaxSurfaceLods);
+      ImGui::SliderFloat("Pixel error", &lodPixelError, 0.25f, 8.f);
+      ImGui::Checkbox("Cluster culling", &useClusterCulling);
+      ImGui::Checkbox("Occlusion culling", &useOcclusionCulling);
+    }
+    ImGui::End();
+
+    if (ImGui::Begin("Resolution")) {
+      ImGui::Text("render %ux%u", _drawExtent.width, _drawExtent.height);
+      ImGui::Checkbox("Dynamic resolution", &useDynamicResolution);
+      if (useDynamicResolution) {
+        if (ImGui::RadioButton("16.6 ms", targetFrameTime == 16.6f)) targetFrameTime = 16.6f;
+        ImGui::SameLine();
+        if (ImGui::RadioButton("8.3 ms", targetFrameTime == 8.3f)) targetFrameTime = 8.3f;
+        ImGui::SliderFloat("Min scale", &minRenderScale, 0.25f, maxRenderScale);
+        ImGui::SliderFloat("Max scale", &maxRenderScale, minRenderScale, 1.f);
+        ImGui::Text("render scale %f", renderScale);
+      } else {
+        ImGui::SliderFloat("Render Scale", &renderScale, 0.3f, 1.f);
+      }
+      ImGui::Checkbox("Upscale filter", &useUpscaleFilter);
+      ImGui::SliderFloat("Sharpness", &upscaleSharpness, 0.f, 2.f);
+      ImGui::Combo("Tonemapper", &tonemapper, "None\0Reinhard\0ACES\0");
+      ImGui::SliderFloat("Exposure", &exposure, 0.1f, 4.f);
+    }
     ImGui::End();
 
     ImGui::Render();
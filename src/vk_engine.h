@@ -4,6 +4,10 @@
 #include <vk_descriptors.h>
 #include <vk_pipelines.h>
 #include <vk_loader.h>
+#include <vk_cache.h>
+#include <vk_barriers.h>
+#include <vk_rendergraph.h>
+#include <vk_shader_reload.h>
 #include <camera.h>
 
 struct DeletionQueue {
@@ -24,12 +28,67 @@ struct DeletionQueue {
 struct FrameData {
   VkCommandPool _commandPool;
   VkCommandBuffer _mainCommandBuffer;
+  // Async compute passes, only recorded when the compute queue is used
+  VkCommandPool _computeCommandPool;
+  VkCommandBuffer _computeCommandBuffer;
 
   VkSemaphore _swapchainSemaphore, _renderSemaphore;
   VkFence _renderFence;
 
   DeletionQueue _deletionQueue;
-  DescriptorAllocatorGrowable _frameDescriptors;
+  // Each recording thread allocates the frame's sets from its own pools
+  DescriptorAllocatorPerThread _frameDescriptors;
+  // Per-frame compute sets when descriptor buffers are supported, see bind_compute_descriptors
+  AllocatedBuffer _descriptorBufferMemory;
+  DescriptorBufferAllocator _descriptorBuffer;
+
+  // Scene uniforms of the frame, bound by every geometry pass. Written once, the buffer is refilled every frame
+  AllocatedBuffer _sceneDataBuffer;
+  VkDescriptorSet _sceneDescriptor;
+  // GPUObjectData of every draw, also in the scene set. Only replaced when the frame draws more objects than it holds
+  AllocatedBuffer _objectBuffer;
+  uint32_t _objectCapacity;
+
+  // Cluster culling inputs and the indirect draw commands of both culling passes. Refilled every frame, only
+  // replaced when the frame needs more than they hold
+  AllocatedBuffer _clusterObjectBuffer;
+  uint32_t _clusterObjectCount;
+  uint32_t _clusterObjectCapacity;
+  uint32_t _clusterCommandCount;
+  uint32_t _clusterCommandCapacity;
+  AllocatedBuffer _clusterCommandBuffer;
+  AllocatedBuffer _lateClusterCommandBuffer;
+  // Visible cluster and triangle counts, read back once the frame's fence is signalled
+  AllocatedBuffer _clusterStatsBuffer;
+
+  // GPU timestamps of the frame, indexed by GPUTimestamp
+  VkQueryPool _timestampPool;
+
+  // Overdraw counts and the buffer their min/avg/max is reduced into, only written while the overdraw view is on
+  AllocatedBuffer _overdrawStatsBuffer;
+  VkDescriptorSet _overdrawDescriptors;
+};
+
+enum GPUTimestamp : uint32_t {
+  TimestampFrameBegin,
+  TimestampGeometryBegin,
+  // Same as TimestampGeometryBegin when the depth pre-pass is off
+  TimestampPrepassEnd,
+  TimestampGeometryEnd,
+  TimestampFrameEnd,
+  TimestampCount
+};
+
+// Render passes draw_geometry can record. Early passes draw the clusters that survived culling against last frame's
+// depth pyramid, late passes the ones that only turned out visible against this frame's
+enum GeometryPass {
+  GeometryDepthEarly,
+  GeometryDepthLate,
+  // With the pre-pass this shades everything, without it the late pass draws the rest
+  GeometryShadeEarly,
+  GeometryShadeLate,
+  // Blended surfaces, once the background filled in what the opaque passes left uncovered
+  GeometryTransparent,
 };
 
 struct ComputePushConstants {
@@ -41,11 +100,29 @@ struct ComputePushConstants {
 
 struct ComputeEffect {
   const char* name;
+  // Compiled shader the pipelines are built from
+  const char* shader;
 
   VkPipeline pipeline;
   VkPipelineLayout layout;
 
   ComputePushConstants data;
+
+  // Without either flag the output only depends on the push constants and the extent, so the background cache
+  // renders it once with cachePipeline, which skips the depth test
+  bool timeDependent = false;
+  bool viewDependent = false;
+  VkPipeline cachePipeline;
+};
+
+// Everything a cached background depends on, it's redrawn when any of it changes
+struct BackgroundCacheKey {
+  int effect = -1;
+  ComputePushConstants data;
+  VkExtent2D extent;
+  glm::mat4 view;
+
+  bool operator==(const BackgroundCacheKey& other) const;
 };
 
 struct GPUSceneData {
@@ -61,29 +138,169 @@ struct RenderObject {
   uint32_t indexCount;
   uint32_t firstIndex;
   VkBuffer indexBuffer;
+  VkIndexType indexType;
 
   MaterialInstance* material;
+  Bounds bounds;
 
   glm::mat4 transform;
   VkDeviceAddress vertexBufferAddress;
+
+  // Clusters of the selected LOD, drawn indirectly after GPU culling when meshletCount isn't 0
+  uint32_t firstMeshlet;
+  uint32_t meshletCount;
+  VkDeviceAddress meshletBufferAddress;
+  // Slot of the first cluster's command in the frame's indirect buffer, assigned by the culling pass
+  uint32_t firstCommand;
+  // Entry in the frame's object buffer, assigned by prepare_geometry
+  uint32_t objectIndex;
+};
+
+// Per-object data of the mesh draws, matches the struct in mesh_object.glsl
+struct GPUObjectData {
+  glm::mat4 worldMatrix;
+  // Inverse transpose of the world matrix, keeps normals perpendicular under non-uniform scale
+  glm::mat4 normalMatrix;
+  VkDeviceAddress vertexBuffer;
+  uint32_t pad[2];
+};
+
+// One object of the cluster culling pass, matches the struct in meshlet_cull.comp
+struct GPUCullObject {
+  glm::mat4 worldMatrix;
+  // Object space bounding sphere, radius in w
+  glm::vec4 boundingSphere;
+  VkDeviceAddress meshletBuffer;
+  uint32_t firstMeshlet;
+  uint32_t meshletCount;
+  uint32_t firstCommand;
+  uint32_t flags;
+  uint32_t objectIndex;
+  uint32_t pad;
+};
+
+// GPUCullObject flags
+constexpr uint32_t CullObjectConeCulling = 1 << 0;
+
+struct GPUCullPushConstants {
+  glm::mat4 view;
+  // Normalized side plane normals in view space: x/z of the left-right planes, then y/z of the top-bottom ones
+  glm::vec4 frustum;
+  // World space camera position, near plane distance in w
+  glm::vec4 cameraPosition;
+  // P00, P11, P22 and P32 of the projection matrix
+  glm::vec4 projection;
+  glm::vec2 pyramidSize;
+  uint32_t objectCount;
+  uint32_t flags;
+};
+
+// GPUCullPushConstants flags
+constexpr uint32_t CullOcclusion = 1 << 0;
+constexpr uint32_t CullLatePass = 1 << 1;
+
+struct GPUClusterStats {
+  uint32_t visibleClusters;
+  uint32_t visibleTriangles;
+  // Inside the frustum but hidden behind the depth pyramid after the late pass
+  uint32_t occludedClusters;
+  uint32_t occludedObjects;
+};
+
+// Shared by easu.comp and composite.comp
+struct GPUUpscalePushConstants {
+  // Part of the draw image that holds the frame, and its full size
+  glm::vec2 inputSize;
+  glm::vec2 outputSize;
+  glm::vec2 inputImageSize;
+  // RCAS sharpness in stops, 0 is the strongest
+  float sharpness;
+  float exposure;
+  uint32_t tonemapper;
+  uint32_t flags;
+};
+
+// GPUUpscalePushConstants flags
+constexpr uint32_t CompositeUpscaled = 1 << 0;
+
+// Matches the buffer in overdraw.comp. Only pixels with at least one fragment count
+struct GPUOverdrawStats {
+  uint32_t minCount;
+  uint32_t maxCount;
+  uint32_t totalCount;
+  uint32_t coveredPixels;
 };
 
 struct DrawContext {
   std::vector<RenderObject> OpaqueSurfaces;
   std::vector<RenderObject> TransparentSurfaces;
+
+  // LOD selection inputs, filled in by update_scene before the scene is walked
+  glm::vec3 cameraPosition;
+  // Pixels covered by one world unit at a distance of one unit
+  float lodProjectionScale;
+  float lodPixelError;
+  int forcedLod;
 };
 
-struct GLTFMetallic_Roughness {
-  MaterialPipeline opaquePipeline;
-  MaterialPipeline transparentPipeline;
+// Permutation of the mesh material pipelines. The fixed function state is baked into the pipeline, the features
+// select the shader variant
+struct MaterialPipelineKey {
+  enum Shading : uint8_t {
+    Shade,
+    // Overdraw view, counts fragments instead of shading them
+    Overdraw,
+    // Depth pre-pass, positions only into depth
+    DepthOnly
+  };
+
+  // MainColor is opaque, Transparent blends additively and doesn't write depth
+  MaterialPass pass = MaterialPass::MainColor;
+  Shading shading = Shade;
+  // Opaque shading after the pre-pass, only the fragment that wrote the depth passes and there are no depth writes
+  bool depthEqual = false;
+  bool doubleSided = true;
+  // Transforms that mirror the mesh turn its front faces clockwise
+  bool flipWinding = false;
+  uint32_t features = MaterialAllFeatures;
+  // Culling, blending, depth and polygon mode are set while drawing, so only the shaders tell pipelines apart
+  bool dynamicState = false;
+
+  // Fixed function state the key stands for, baked into its pipeline or set by the draw loop
+  struct FixedFunction {
+    VkCullModeFlags cullMode;
+    VkFrontFace frontFace;
+    bool blendAdditive;
+    bool depthWrite;
+    VkCompareOp depthCompare;
+
+    bool operator==(const FixedFunction&) const = default;
+  };
+  FixedFunction fixed_function() const;
+
+  // State the shading doesn't use is dropped, so those permutations share a pipeline
+  uint64_t packed() const;
+  static MaterialPipelineKey unpack(uint64_t key);
+};
 
+struct GLTFMetallic_Roughness {
+  // Every permutation shares the layout
+  VkPipelineLayout pipelineLayout;
   VkDescriptorSetLayout materialLayout;
+  // Permutations compiled so far, by MaterialPipelineKey::packed
+  PipelineVariantCache pipelines;
+  // Keys get MaterialPipelineKey::dynamicState, only turned on when the device supports it
+  bool dynamicState = false;
+  // Both modes are compiled then, so switching between them never waits on the other one's pipelines
+  bool dynamicStateSupported = false;
 
   struct MaterialConstants {
     glm::vec4 colorFactors;
     glm::vec4 metal_rough_factors;
+    // Alpha mask cutoff in x, only read by the alpha tested variants
+    glm::vec4 alpha_cutoff;
     // For alignment, bind a uniform buffer that is 256 bytes, so add some padding to meet that size
-    glm::vec4 extra[14];
+    glm::vec4 extra[13];
   };
 
   struct MaterialResources {
@@ -95,17 +312,26 @@ struct GLTFMetallic_Roughness {
     uint32_t dataBufferOffset;
   };
 
-  DescriptorWriter writer;
-
   void build_pipelines(VulkanEngine* engine);
+  // Pipeline of a draw. Until its permutation is compiled, the generic shader variant with the same fixed function
+  // state stands in. Never compiles, VK_NULL_HANDLE when neither is ready and the draw has to be skipped
+  VkPipeline pipeline(MaterialPipelineKey key);
+  // Queues the permutations a material is drawn with for background compilation, flipWinding for mirrored nodes
+  void precompile(const MaterialInstance& material, bool flipWinding = false);
+  // From any thread, VK_NULL_HANDLE when the shaders don't load or the pipeline fails to build
+  VkPipeline create_pipeline(VulkanEngine* engine, MaterialPipelineKey key) const;
   void clear_resources(VkDevice device);
 
+  // Materials with the same resources share a set. The instance holds a reference on it, given back to the cache
+  // when the material goes away
   MaterialInstance write_material(VkDevice device, MaterialPass pass, const MaterialResources& resources,
-                                  DescriptorAllocatorGrowable& descriptorAllocator);
+                                  DescriptorSetCache& descriptorCache) const;
 };
 
 struct MeshNode : public Node {
   std::shared_ptr<MeshAsset> mesh;
+  // LOD currently drawn for each surface, kept between frames for hysteresis
+  std::vector<uint32_t> currentLods;
 
   virtual void Draw(const glm::mat4& topMatrix, DrawContext& ctx) override;
 };
@@ -118,6 +344,21 @@ struct EngineStats {
   int drawcall_count;
   float scene_update_time;
   float mesh_draw_time;
+  // Clusters submitted to the culling pass and the ones that survived it, one frame behind
+  int cluster_count;
+  int visible_cluster_count;
+  int visible_cluster_triangles;
+  int occluded_cluster_count;
+  int occluded_object_count;
+  // GPU times in milliseconds from timestamp queries, one frame behind. Geometry time includes the pre-pass and
+  // the background, which runs between the opaque and transparent passes
+  float gpu_frame_time;
+  float gpu_geometry_time;
+  float gpu_prepass_time;
+  // Fragments shaded per covered pixel while the overdraw view is on
+  int overdraw_min;
+  float overdraw_avg;
+  int overdraw_max;
 };
 
 class VulkanEngine {
@@ -135,6 +376,8 @@ public:
   VkInstance _instance;
   VkDebugUtilsMessengerEXT _debug_messenger;
   VkPhysicalDevice _chosenGPU;
+  // Nanoseconds per timestamp tick
+  float _timestampPeriod;
   VkDevice _device;
   VkSurfaceKHR _surface;
 
@@ -158,11 +401,64 @@ public:
   VkQueue _graphicsQueue;
   uint32_t _graphicsQueueFamily;
 
+  // Compute queue of another family, null when the device has none. The early culling pass runs on it,
+  // the two queues wait for each other through timeline semaphores counting submitted frames
+  VkQueue _computeQueue{VK_NULL_HANDLE};
+  uint32_t _computeQueueFamily;
+  VkSemaphore _graphicsTimeline;
+  VkSemaphore _computeTimeline;
+  bool useAsyncCompute{true};
+
+  // VK_EXT_descriptor_buffer, decided at init. The compute passes with a single per-frame set write it straight into
+  // the frame's descriptor buffer, their layouts and pipelines carry the flags it requires
+  bool _useDescriptorBuffer{false};
+  VkPhysicalDeviceDescriptorBufferPropertiesEXT _descriptorBufferProperties;
+  VkDescriptorSetLayoutCreateFlags _computeSetLayoutFlags{0};
+  VkPipelineCreateFlags _computePipelineFlags{0};
+
+  // VK_EXT_extended_dynamic_state3, decided at init. Blending and polygon mode join the dynamic state Vulkan 1.3
+  // already has, so material pipelines can leave all of it to the draw loop
+  bool _supportsDynamicState{false};
+  PFN_vkCmdSetColorBlendEnableEXT _cmdSetColorBlendEnable;
+  PFN_vkCmdSetColorBlendEquationEXT _cmdSetColorBlendEquation;
+  PFN_vkCmdSetPolygonModeEXT _cmdSetPolygonMode;
+
   AllocatedImage _drawImage;
   AllocatedImage _depthImage;
   VkExtent2D _drawExtent;
   float renderScale = 1.f;
 
+  // Layout and last use of the images transitioned every frame, the source of every per-frame barrier
+  vkutil::ImageStateTracker _imageStates;
+
+  // The frame's passes, rebuilt every frame by build_render_graph. The dump is printed once when requested
+  RenderGraph _renderGraph;
+  bool dumpRenderGraph{false};
+
+  // Dynamic resolution: renderScale follows the GPU frame time towards the target, within the limits
+  bool useDynamicResolution{false};
+  float targetFrameTime{16.6f};
+  float minRenderScale{0.5f};
+  float maxRenderScale{1.f};
+  int _framesSinceScaleChange{0};
+
+  // Composite into the swapchain: FSR1 style EASU upscale into a swapchain sized image, then RCAS sharpening,
+  // tonemapping and the format conversion in one compute pass. Without the filter it's a bilinear upscale
+  bool useUpscaleFilter{true};
+  float upscaleSharpness{0.2f};
+  // 0 none, 1 Reinhard, 2 ACES
+  int tonemapper{0};
+  float exposure{1.f};
+  VkSampler _upscaleSampler;
+  VkDescriptorSetLayout _upscaleDescriptorLayout;
+  VkPipelineLayout _upscalePipelineLayout;
+  VkPipeline _easuPipeline;
+  VkDescriptorSetLayout _compositeDescriptorLayout;
+  VkPipelineLayout _compositePipelineLayout;
+  VkPipeline _compositePipeline;
+  // Without storage support on the swapchain the composite goes through a transient image and a copy
+  bool _swapchainStorage;
+
   AllocatedImage _whiteImage;
   AllocatedImage _blackImage;
   AllocatedImage _grayImage;
@@ -174,7 +470,23 @@ public:
   VkSampler _defaultSamplerLinear;
   VkSampler _defaultSamplerNearest;
 
+  // Shared between every LoadedGLTF so identical textures and samplers are only created once
+  ImageCache imageCache;
+  SamplerCache samplerCache;
+  DescriptorSetCache descriptorSetCache;
+  LayoutCache layoutCache;
+
+  // Rebuilds pipelines when their shader sources change, swapped in at the start of draw
+  ShaderReloader shaderReloader;
+
+  // Every pipeline is created through it, saved at cleanup so the next run starts warm
+  VkPipelineCache _pipelineCache;
+  // Compiles the pipelines of init_pipelines while the rest of init runs, waited on before the first frame
+  PipelineCompiler _pipelineCompiler;
+
   DescriptorAllocatorGrowable globalDescriptorAllocator;
+  // Learned descriptor pool sizes by allocator, loaded at init and saved with this run's peaks at cleanup
+  std::unordered_map<std::string, PoolProfile> _poolProfiles;
 
   VkDescriptorSet _drawImageDescriptors;
   VkDescriptorSetLayout _drawImageDescriptorLayout;
@@ -186,6 +498,17 @@ public:
 
   VkPipeline _gradientPipeline;
   VkPipelineLayout _gradientPipelineLayout;
+  // Depth the background effects test against, they run after the opaque geometry and only fill what it didn't cover
+  VkDescriptorSetLayout _backgroundDepthDescriptorLayout;
+
+  // Output of the last static background effect, copied into the uncovered pixels until its inputs change
+  bool useBackgroundCache{true};
+  AllocatedImage _backgroundCache;
+  VkDescriptorSet _backgroundCacheDescriptors;
+  BackgroundCacheKey _backgroundCacheKey;
+  VkDescriptorSetLayout _backgroundResolveDescriptorLayout;
+  VkPipelineLayout _backgroundResolvePipelineLayout;
+  VkPipeline _backgroundResolvePipeline;
 
   VkPipelineLayout _trianglePipelineLayout;
   VkPipeline _trianglePipeline;
@@ -193,6 +516,32 @@ public:
   VkPipelineLayout _meshPipelineLayout;
   VkPipeline _meshPipeline;
 
+  // Frustum and back facing cone culling of mesh clusters
+  bool useClusterCulling{true};
+  VkDescriptorSetLayout _clusterCullDescriptorLayout;
+  VkPipelineLayout _clusterCullPipelineLayout;
+  VkPipeline _clusterCullPipeline;
+
+  // Two phase occlusion culling against a depth pyramid. Each texel holds the farthest depth of the area it covers
+  bool useOcclusionCulling{true};
+  bool depthPyramidReady{false};
+  AllocatedImage _depthPyramid;
+  VkExtent2D _depthPyramidExtent;
+  uint32_t _depthPyramidLevels;
+  VkImageView _depthPyramidMips[16];
+  VkSampler _depthPyramidSampler;
+  VkDescriptorSetLayout _depthReduceDescriptorLayout;
+  VkPipelineLayout _depthReducePipelineLayout;
+  VkPipeline _depthReducePipeline;
+
+  // Lays down opaque depth first so the shading pass only runs fragments that end up visible
+  bool useDepthPrepass{false};
+
+  // Debug view that counts the fragments shaded per pixel and draws them as a heatmap
+  bool showOverdraw{false};
+  VkDescriptorSetLayout _overdrawDescriptorLayout;
+  ComputeEffect overdrawEffect;
+
   std::vector<std::shared_ptr<MeshAsset>> testMeshes;
 
   std::vector<ComputeEffect> backgroundEffects;
@@ -203,6 +552,10 @@ public:
 
   Camera mainCamera;
 
+  // Screen space error in pixels a LOD is allowed to have, and a level to force from the debug UI (-1 for automatic)
+  float lodPixelError{1.f};
+  int forcedLod{-1};
+
   std::unordered_map<std::string, std::shared_ptr<LoadedGLTF>> loadedScenes;
 
   static VulkanEngine& Get();
@@ -213,8 +566,26 @@ public:
 
   void draw();
   void draw_background(VkCommandBuffer cmd);
+  void draw_background_cache(VkCommandBuffer cmd);
+  void resolve_background(VkCommandBuffer cmd);
   void draw_imgui(VkCommandBuffer cmd, VkImageView targetImageView);
-  void draw_geometry(VkCommandBuffer cmd);
+  void build_render_graph(uint32_t swapchainImageIndex);
+  void prepare_geometry();
+  void draw_geometry(VkCommandBuffer cmd, GeometryPass pass);
+  void prepare_clusters();
+  // Creates the cluster culling buffers of the frame at their current capacity
+  void create_cluster_buffers(FrameData& frame, bool objects, bool commands);
+  void cull_clusters(VkCommandBuffer cmd, bool latePass);
+  void build_depth_pyramid(VkCommandBuffer cmd);
+  // Writes and binds set 0 of a per-frame compute pass, from the descriptor buffer or the frame's pools
+  void bind_compute_descriptors(VkCommandBuffer cmd, VkPipelineLayout pipelineLayout, VkDescriptorSetLayout setLayout, DescriptorWriter& writer);
+  void begin_overdraw(VkCommandBuffer cmd, VkImage overdrawImage, VkImageView overdrawView);
+  void draw_overdraw(VkCommandBuffer cmd);
+  GPUUpscalePushConstants upscale_push_constants() const;
+  void upscale(VkCommandBuffer cmd, VkImageView upscaleView);
+  void composite(VkCommandBuffer cmd, VkImageView upscaleView, VkImageView targetView);
+
+  void update_render_scale();
 
   void update_scene();
 
@@ -222,15 +593,19 @@ public:
 
   void immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function);
 
-  GPUMeshBuffers uploadMesh(std::span<uint32_t> indices, std::span<Vertex> vertices);
+  GPUMeshBuffers uploadMesh(std::span<uint32_t> indices, std::span<Vertex> vertices, std::span<GPUMeshlet> meshlets = {});
 
-  AllocatedImage create_image(VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped = false);
+  // Shared resources are concurrent between the graphics and compute queue families, for what async compute touches
+  AllocatedImage create_image(VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped = false, bool shared = false);
   AllocatedImage create_image(void* data, VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped = false);
   void destroy_image(const AllocatedImage& img);
 
-  AllocatedBuffer create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
+  AllocatedBuffer create_buffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, bool shared = false);
   void destroy_buffer(const AllocatedBuffer& buffer);
 
+  // Destroys a pipeline once the frames in flight that may use it are done
+  void retire_pipeline(VkPipeline pipeline);
+
 private:
   void init_vulkan();
   void init_swapchain(); 
@@ -240,9 +615,14 @@ private:
   void init_pipelines();
   void init_background_pipelines();
   void init_mesh_pipeline();
+  void init_cluster_cull_pipeline();
+  void init_depth_pyramid();
+  void init_overdraw();
+  void init_upscale();
   void init_triangle_pipeline();
   void init_imgui();
   void init_default_data();
+  void init_shader_reload();
 
   void create_swapchain(uint32_t width, uint32_t height);
   void resize_swapchain();
@@ -19,7 +19,11 @@ void vkutil::transition_image(VkCommandBuffer cmd, VkImage image, VkImageLayout
   imageBarrier.oldLayout = currentLayout;
   imageBarrier.newLayout = newLayout;
 
-  VkImageAspectFlags aspectMask = (newLayout == VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+  // The depth image also moves between the attachment and read only layouts, so check both sides
+  auto is_depth_layout = [](VkImageLayout layout) {
+    return layout == VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL || layout == VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL;
+  };
+  VkImageAspectFlags aspectMask = (is_depth_layout(newLayout) || is_depth_layout(currentLayout)) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
   imageBarrier.subresourceRange = vkinit::image_subresource_range(aspectMask);
   imageBarrier.image = image;
 
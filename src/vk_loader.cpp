@@ -1,10 +1,12 @@
 #include "stb_image.h"
 #include <iostream>
+#include <fstream>
 #include <vk_loader.h>
 
 #include "vk_engine.h"
 #include "vk_initializers.h"
 #include "vk_types.h"
+#include "vk_meshopt.h"
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/quaternion.hpp>
@@ -13,11 +15,181 @@
 #include <fastgltf/parser.hpp>
 #include <fastgltf/tools.hpp>
 
-std::optional<AllocatedImage> load_image(VulkanEngine* engine, fastgltf::Asset& asset, fastgltf::Image& image)
+// Run the load time mesh optimisations before uploading
+constexpr bool bOptimizeMeshes = true;
+// Build simplified LOD chains as part of the optimisation, these need the welded vertices
+constexpr bool bGenerateLods = true;
+// Largest simplification error for a LOD, relative to the surface bounding sphere
+constexpr float MaxLodError = 0.1f;
+// Split every surface and LOD into clusters for the GPU culling path
+constexpr bool bBuildMeshlets = true;
+
+Bounds compute_bounds(std::span<const uint32_t> indices, std::span<const Vertex> vertices)
 {
-  AllocatedImage newImage {};
+  glm::vec3 minpos = vertices[indices[0]].position;
+  glm::vec3 maxpos = vertices[indices[0]].position;
+  for (uint32_t idx : indices) {
+    minpos = glm::min(minpos, vertices[idx].position);
+    maxpos = glm::max(maxpos, vertices[idx].position);
+  }
+
+  Bounds bounds;
+  bounds.origin = (maxpos + minpos) / 2.f;
+  bounds.extents = (maxpos - minpos) / 2.f;
+
+  // Measure the actual vertices instead of using the box diagonal, it's a noticeably tighter sphere
+  float radius2 = 0.f;
+  for (uint32_t idx : indices) {
+    glm::vec3 d = vertices[idx].position - bounds.origin;
+    radius2 = std::max(radius2, glm::dot(d, d));
+  }
+  bounds.sphereRadius = std::sqrt(radius2);
+
+  return bounds;
+}
+
+// Appends each coarser level of the surface to the index list. Every level is simplified from the previous one,
+// so the errors add up
+void generate_lods(std::vector<uint32_t>& indices, std::span<const Vertex> vertices, GeoSurface& surface)
+{
+  std::vector<uint32_t> previous(indices.begin() + surface.startIndex, indices.begin() + surface.startIndex + surface.count);
+  float error = 0.f;
+
+  for (int level = 0; level < MaxSurfaceLods; level++) {
+    float levelError;
+    std::vector<uint32_t> lod = vkmesh::simplify(previous, vertices, previous.size() / 2, surface.bounds.sphereRadius * MaxLodError, &levelError);
+
+    // Stop once the simplifier can't make meaningful progress anymore
+    if (lod.empty() || lod.size() > previous.size() * 0.85f) break;
+
+    vkmesh::optimize_vertex_cache(lod, vertices.size());
+
+    error += levelError;
+    surface.lods.push_back(SurfaceLod{ (uint32_t)indices.size(), (uint32_t)lod.size(), error });
+    indices.insert(indices.end(), lod.begin(), lod.end());
+
+    previous = std::move(lod);
+  }
+}
+
+// What the mesh looked like before optimize_mesh, so the result can be reported once the index buffer is final
+struct MeshOptimizeStats {
+  vkmesh::CacheStats before;
+  size_t vertexCount;
+  // The analysis only covers the full detail ranges, the LODs get appended after them
+  size_t baseIndexCount;
+};
+
+MeshOptimizeStats optimize_mesh(std::vector<uint32_t>& indices, std::vector<Vertex>& vertices, std::span<GeoSurface> surfaces)
+{
+  MeshOptimizeStats stats{};
+  stats.before = vkmesh::analyze_vertex_cache(indices, vertices.size());
+  stats.vertexCount = vertices.size();
+
+  vkmesh::weld_vertices(indices, vertices);
+
+  // Triangles are only reordered inside their own surface, so the surface index ranges stay valid
+  for (GeoSurface& surface : surfaces) {
+    std::span<uint32_t> range(indices.data() + surface.startIndex, surface.count);
+    vkmesh::optimize_vertex_cache(range, vertices.size());
+    vkmesh::optimize_overdraw(range, vertices);
+  }
+
+  stats.baseIndexCount = indices.size();
+
+  if (bGenerateLods) {
+    for (GeoSurface& surface : surfaces) {
+      generate_lods(indices, vertices, surface);
+    }
+  }
+
+  vkmesh::optimize_vertex_fetch(indices, vertices);
+
+  return stats;
+}
+
+// Measures the index buffer that actually gets uploaded, so it has to run after the meshlets reordered it
+void print_mesh_stats(std::string_view name, const MeshOptimizeStats& stats, std::span<const uint32_t> indices, size_t vertexCount, std::span<const GeoSurface> surfaces)
+{
+  vkmesh::CacheStats after = vkmesh::analyze_vertex_cache(indices.first(stats.baseIndexCount), vertexCount);
+
+  size_t lodCount = 0;
+  for (const GeoSurface& surface : surfaces) {
+    lodCount += surface.lods.size();
+  }
+
+  fmt::print("Optimized mesh {}: ACMR {:.3f} -> {:.3f}, ATVR {:.3f} -> {:.3f}, vertices {} -> {}, {} LODs\n", name,
+             stats.before.acmr, after.acmr, stats.before.atvr, after.atvr, stats.vertexCount, vertexCount, lodCount);
+}
+
+// Builds the clusters of every surface and LOD range. This reorders triangles inside each range, so it runs after
+// the other optimisations. The direct draws use the same order, so every cluster is cache optimised again on its own
+// and the clusters are put back in overdraw order
+std::vector<GPUMeshlet> build_surface_meshlets(std::vector<uint32_t>& indices, std::span<const Vertex> vertices, std::span<GeoSurface> surfaces)
+{
+  std::vector<GPUMeshlet> meshlets;
+
+  auto build_range = [&](uint32_t startIndex, uint32_t count, uint32_t& firstMeshlet, uint32_t& meshletCount) {
+    std::span<uint32_t> range = std::span(indices).subspan(startIndex, count);
+    std::vector<vkmesh::Meshlet> clusters = vkmesh::build_meshlets(range, vertices);
+
+    for (const vkmesh::Meshlet& c : clusters) {
+      vkmesh::optimize_vertex_cache(range.subspan(c.firstIndex, c.indexCount), vertices.size());
+    }
+    vkmesh::sort_meshlets(range, vertices, clusters);
+
+    firstMeshlet = (uint32_t)meshlets.size();
+    meshletCount = (uint32_t)clusters.size();
+
+    for (const vkmesh::Meshlet& c : clusters) {
+      GPUMeshlet m{};
+      m.sphere = glm::vec4(c.center, c.radius);
+      m.cone = glm::vec4(c.coneAxis, c.coneCutoff);
+      m.firstIndex = startIndex + c.firstIndex;
+      m.indexCount = c.indexCount;
+      meshlets.push_back(m);
+    }
+  };
+
+  for (GeoSurface& surface : surfaces) {
+    build_range(surface.startIndex, surface.count, surface.firstMeshlet, surface.meshletCount);
+    for (SurfaceLod& lod : surface.lods) {
+      build_range(lod.startIndex, lod.count, lod.firstMeshlet, lod.meshletCount);
+    }
+  }
+
+  return meshlets;
+}
+
+std::optional<AllocatedImage> load_image_from_memory(VulkanEngine* engine, const uint8_t* bytes, size_t size)
+{
+  // Hash the encoded bytes so a texture that was already uploaded doesn't get decoded again
+  uint64_t hash = vkutil::hash_bytes(bytes, size, vkutil::hash_bytes(&size, sizeof(size)));
+
+  std::optional<AllocatedImage> cached = engine->imageCache.acquire(hash);
+  if (cached.has_value()) return cached;
 
   int width, height, nrChannels;
+  unsigned char* data = stbi_load_from_memory(bytes, static_cast<int>(size), &width, &height, &nrChannels, 4);
+  if (!data) return {};
+
+  VkExtent3D imagesize;
+  imagesize.width = width;
+  imagesize.height = height;
+  imagesize.depth = 1;
+
+  AllocatedImage newImage = engine->create_image(data, imagesize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, false);
+
+  stbi_image_free(data);
+
+  engine->imageCache.insert(hash, newImage);
+
+  return newImage;
+}
+
+std::optional<AllocatedImage> load_image(VulkanEngine* engine, fastgltf::Asset& asset, fastgltf::Image& image)
+{
+  std::optional<AllocatedImage> newImage;
 
   std::visit(
              fastgltf::visitor {
@@ -28,31 +200,19 @@ std::optional<AllocatedImage> load_image(VulkanEngine* engine, fastgltf::Asset&
 
                    const std::string path(filePath.uri.path().begin(),
                                           filePath.uri.path().end());
-                   unsigned char* data = stbi_load(path.c_str(), &width, &height, &nrChannels, 4);
-                   if (data) {
-                     VkExtent3D imagesize;
-                     imagesize.width = width;
-                     imagesize.height = height;
-                     imagesize.depth = 1;
 
-                     newImage = engine->create_image(data, imagesize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, false);
+                   // Read the whole file so it can be hashed before decoding
+                   std::ifstream file(path, std::ios::ate | std::ios::binary);
+                   if (!file.is_open()) return;
 
-                     stbi_image_free(data);
-                   }
+                   std::vector<uint8_t> bytes((size_t)file.tellg());
+                   file.seekg(0);
+                   file.read((char*)bytes.data(), bytes.size());
+
+                   newImage = load_image_from_memory(engine, bytes.data(), bytes.size());
                  },
                  [&](fastgltf::sources::Vector& vector) {
-                   unsigned char* data = stbi_load_from_memory(vector.bytes.data(), static_cast<int>(vector.bytes.size()),
-                                                               &width, &height, &nrChannels, 4);
-                   if (data) {
-                     VkExtent3D imagesize;
-                     imagesize.width = width;
-                     imagesize.height = height;
-                     imagesize.depth = 1;
-
-                     newImage = engine->create_image(data, imagesize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, false);
-
-                     stbi_image_free(data);
-                   }
+                   newImage = load_image_from_memory(engine, vector.bytes.data(), vector.bytes.size());
                  },
                  [&](fastgltf::sources::BufferView& view) {
                    auto& bufferView = asset.bufferViews[view.bufferViewIndex];
@@ -61,30 +221,14 @@ std::optional<AllocatedImage> load_image(VulkanEngine* engine, fastgltf::Asset&
                    std::visit(fastgltf::visitor {
                        [](auto& arg) {},
                          [&](fastgltf::sources::Vector& vector) {
-                           unsigned char* data = stbi_load_from_memory(vector.bytes.data() + bufferView.byteOffset,
-                                                                       static_cast<int>(bufferView.byteLength),
-                                                                       &width, &height, &nrChannels, 4);
-                           if (data) {
-                             VkExtent3D imagesize;
-                             imagesize.width = width;
-                             imagesize.height = height;
-                             imagesize.depth = 1;
-
-                             newImage = engine->create_image(data, imagesize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, false);
-
-                             stbi_image_free(data);
-                           }
+                           newImage = load_image_from_memory(engine, vector.bytes.data() + bufferView.byteOffset, bufferView.byteLength);
                          } },
                      buffer.data);
                  },
                  },
              image.data);
 
-  if (newImage.image == VK_NULL_HANDLE) {
-    return {};
-  } else {
-    return newImage;
-  }
+  return newImage;
 }
 
 std::optional<std::vector<std::shared_ptr<MeshAsset>>> loadGltfMeshes(VulkanEngine* engine, std::filesystem::path filePath)
@@ -179,6 +323,7 @@ std::optional<std::vector<std::shared_ptr<MeshAsset>>> loadGltfMeshes(VulkanEngi
           vertices[initial_vtx + index].color = v;
         });
       }
+      newSurface.bounds = compute_bounds(std::span(indices).subspan(newSurface.startIndex, newSurface.count), vertices);
       newmesh.surfaces.push_back(newSurface);
     }
 
@@ -190,7 +335,15 @@ std::optional<std::vector<std::shared_ptr<MeshAsset>>> loadGltfMeshes(VulkanEngi
       }
     }
 
-    newmesh.meshBuffers = engine->uploadMesh(indices, vertices);
+    MeshOptimizeStats stats{};
+    if (bOptimizeMeshes) stats = optimize_mesh(indices, vertices, newmesh.surfaces);
+
+    std::vector<GPUMeshlet> meshlets;
+    if (bBuildMeshlets) meshlets = build_surface_meshlets(indices, vertices, newmesh.surfaces);
+
+    if (bOptimizeMeshes) print_mesh_stats(newmesh.name, stats, indices, vertices.size(), newmesh.surfaces);
+
+    newmesh.meshBuffers = engine->uploadMesh(indices, vertices, meshlets);
 
     meshes.emplace_back(std::make_shared<MeshAsset>(std::move(newmesh)));
   }
@@ -270,11 +423,6 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
     return {};
   }
 
-  std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> sizes = { { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3 },
-                                                                    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3 },
-                                                                    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 } };
-  file.descriptorPool.init(engine->_device, gltf.materials.size(), sizes);
-
   // load samplers
   for (fastgltf::Sampler& sampler : gltf.samplers) {
     VkSamplerCreateInfo sampl = { .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO, .pNext = nullptr };
@@ -286,10 +434,8 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
 
     sampl.mipmapMode = extract_mipmap_mode(sampler.minFilter.value_or(fastgltf::Filter::Nearest));
 
-    VkSampler newSampler;
-    vkCreateSampler(engine->_device, &sampl, nullptr, &newSampler);
-
-    file.samplers.push_back(newSampler);
+    // Identical sampler state is shared with every other loaded scene
+    file.samplers.push_back(engine->samplerCache.get(engine->_device, sampl));
   }
 
   // Temporal arrays for all the objects to use while creating the GLTF data
@@ -304,7 +450,11 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
 
     if (img.has_value()) {
       images.push_back(*img);
-      file.images[image.name.c_str()] = *img;
+
+      // Every loaded image holds a cache reference, so unnamed or duplicate names can't overwrite each other
+      std::string name = image.name.c_str();
+      if (name.empty() || file.images.contains(name)) name += fmt::format("#{}", images.size() - 1);
+      file.images[name] = *img;
     } else {
       // Failed to load, give the slot a default texture to not completely break
       images.push_back(engine->_errorCheckerboardImage);
@@ -316,15 +466,21 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
   file.materialDataBuffer = engine->create_buffer(sizeof(GLTFMetallic_Roughness::MaterialConstants) * gltf.materials.size(),
                                                   VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
   int data_index = 0;
+  // Materials with the same factors point at the same constants, so their descriptor sets can be shared too
+  std::unordered_map<uint64_t, int> constantsIndex;
   GLTFMetallic_Roughness::MaterialConstants* sceneMaterialConstants = (GLTFMetallic_Roughness::MaterialConstants*)file.materialDataBuffer.info.pMappedData;
 
   // Load the materials
   for (fastgltf::Material& mat : gltf.materials) {
     std::shared_ptr<GLTFMaterial> newMat = std::make_shared<GLTFMaterial>();
     materials.push_back(newMat);
-    file.materials[mat.name.c_str()] = newMat;
 
-    GLTFMetallic_Roughness::MaterialConstants constants;
+    // Every material holds a descriptor set reference, so unnamed or duplicate names can't overwrite each other
+    std::string name = mat.name.c_str();
+    if (name.empty() || file.materials.contains(name)) name += fmt::format("#{}", materials.size() - 1);
+    file.materials[name] = newMat;
+
+    GLTFMetallic_Roughness::MaterialConstants constants{};
     constants.colorFactors.x = mat.pbrData.baseColorFactor[0];
     constants.colorFactors.y = mat.pbrData.baseColorFactor[1];
     constants.colorFactors.z = mat.pbrData.baseColorFactor[2];
@@ -333,8 +489,15 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
     constants.metal_rough_factors.x = mat.pbrData.metallicFactor;
     constants.metal_rough_factors.y = mat.pbrData.roughnessFactor;
 
-    // Write material parameters to buffer
-    sceneMaterialConstants[data_index] = constants;
+    // Left at 0 for the other modes, in case the generic variant draws them before theirs is compiled
+    if (mat.alphaMode == fastgltf::AlphaMode::Mask) constants.alpha_cutoff.x = mat.alphaCutoff;
+
+    // Write material parameters to buffer, unless an earlier material already did
+    auto [constantsIt, newConstants] = constantsIndex.try_emplace(vkutil::hash_bytes(&constants, sizeof(constants)), data_index);
+    if (newConstants) {
+      sceneMaterialConstants[data_index] = constants;
+      data_index++;
+    }
 
     MaterialPass passType = MaterialPass::MainColor;
     if (mat.alphaMode == fastgltf::AlphaMode::Blend) passType = MaterialPass::Transparent;
@@ -346,7 +509,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
     materialResources.metalRoughSampler = engine->_defaultSamplerLinear;
 
     materialResources.dataBuffer = file.materialDataBuffer.buffer;
-    materialResources.dataBufferOffset = data_index * sizeof(GLTFMetallic_Roughness::MaterialConstants);
+    materialResources.dataBufferOffset = constantsIt->second * sizeof(GLTFMetallic_Roughness::MaterialConstants);
 
     if (mat.pbrData.baseColorTexture.has_value()) {
       size_t img = gltf.textures[mat.pbrData.baseColorTexture.value().textureIndex].imageIndex.value();
@@ -356,9 +519,14 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
       materialResources.colorSampler = file.samplers[sampler];
     }
 
-    newMat->data = engine->metalRoughMaterial.write_material(engine->_device, passType, materialResources, file.descriptorPool);
+    newMat->data = engine->metalRoughMaterial.write_material(engine->_device, passType, materialResources, engine->descriptorSetCache);
+    newMat->data.doubleSided = mat.doubleSided;
 
-    data_index++;
+    // The cheapest shader variant that still draws the material right
+    newMat->data.features = 0;
+    if (mat.alphaMode == fastgltf::AlphaMode::Mask) newMat->data.features |= MaterialAlphaTest;
+    if (mat.pbrData.baseColorTexture.has_value()) newMat->data.features |= MaterialColorTexture;
+    engine->metalRoughMaterial.precompile(newMat->data);
   }
 
   std::vector<uint32_t> indices;
@@ -437,10 +605,19 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
         newSurface.material = materials[0];
       }
 
+      newSurface.bounds = compute_bounds(std::span(indices).subspan(newSurface.startIndex, newSurface.count), vertices);
       newmesh->surfaces.push_back(newSurface);
     }
 
-    newmesh->meshBuffers = engine->uploadMesh(indices, vertices);
+    MeshOptimizeStats stats{};
+    if (bOptimizeMeshes) stats = optimize_mesh(indices, vertices, newmesh->surfaces);
+
+    std::vector<GPUMeshlet> meshlets;
+    if (bBuildMeshlets) meshlets = build_surface_meshlets(indices, vertices, newmesh->surfaces);
+
+    if (bOptimizeMeshes) print_mesh_stats(newmesh->name, stats, indices, vertices.size(), newmesh->surfaces);
+
+    newmesh->meshBuffers = engine->uploadMesh(indices, vertices, meshlets);
   }
 
   // Load all nodes and their meshes
@@ -491,6 +668,16 @@ std::optional<std::shared_ptr<LoadedGLTF>> loadGltf(VulkanEngine* engine, std::s
     }
   }
 
+  // Mirrored nodes draw their materials with the clockwise variants, queued now that the world transforms are known
+  for (auto& node : nodes) {
+    MeshNode* meshNode = dynamic_cast<MeshNode*>(node.get());
+    if (!meshNode || glm::determinant(glm::mat3(node->worldTransform)) >= 0.f) continue;
+
+    for (GeoSurface& surface : meshNode->mesh->surfaces) {
+      engine->metalRoughMaterial.precompile(surface.material->data, true);
+    }
+  }
+
   return scene;
 }
 
@@ -506,22 +693,27 @@ void LoadedGLTF::clearAll()
 {
   VkDevice dv = creator->_device;
 
-  descriptorPool.destroy_pools(dv);
+  // Material sets may be shared with other scenes as well
+  for (auto& [k, v] : materials) {
+    creator->descriptorSetCache.release(v->data.materialSet);
+  }
   creator->destroy_buffer(materialDataBuffer);
 
   for (auto& [k, v] : meshes) {
     creator->destroy_buffer(v->meshBuffers.indexBuffer);
     creator->destroy_buffer(v->meshBuffers.vertexBuffer);
+    creator->destroy_buffer(v->meshBuffers.meshletBuffer);
   }
 
+  // Images and samplers may be shared with other scenes, so only drop this scene's references
   for (auto& [k, v] : images) {
     if (v.image == creator->_errorCheckerboardImage.image) {
       continue;
     }
-    creator->destroy_image(v);
+    creator->imageCache.release(creator, v.image);
   }
 
   for (auto& sampler: samplers) {
-    vkDestroySampler(dv, sampler, nullptr);
+    creator->samplerCache.release(dv, sampler);
   }
 }
@@ -9,9 +9,33 @@ struct GLTFMaterial {
   MaterialInstance data;
 };
 
+struct Bounds {
+  glm::vec3 origin;
+  float sphereRadius;
+  glm::vec3 extents;
+};
+
+// Most coarser levels generated for a surface
+constexpr int MaxSurfaceLods = 4;
+
+struct SurfaceLod {
+  uint32_t startIndex;
+  uint32_t count;
+  // Object space distance the simplified surface can be away from the full detail one
+  float error;
+  uint32_t firstMeshlet{0};
+  uint32_t meshletCount{0};
+};
+
 struct GeoSurface {
   uint32_t startIndex;
   uint32_t count;
+  Bounds bounds;
+  // Clusters covering the full detail range, meshletCount is 0 when none were built
+  uint32_t firstMeshlet{0};
+  uint32_t meshletCount{0};
+  // Progressively coarser index ranges into the same buffers, following the full detail range above
+  std::vector<SurfaceLod> lods;
   std::shared_ptr<GLTFMaterial> material;
 };
 
@@ -35,8 +59,6 @@ struct LoadedGLTF : public IRenderable {
 
   std::vector<VkSampler> samplers;
 
-  DescriptorAllocatorGrowable descriptorPool;
-
   AllocatedBuffer materialDataBuffer;
 
   VulkanEngine* creator;
@@ -0,0 +1,779 @@
+#include "vk_meshopt.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+
+#include <glm/geometric.hpp>
+
+namespace {
+  // Forsyth's scoring constants, from "Linear-Speed Vertex Cache Optimisation"
+  constexpr int ScoreCacheSize = 32;
+  constexpr float CacheDecayPower = 1.5f;
+  constexpr float LastTriScore = 0.75f;
+  constexpr float ValenceBoostScale = 2.0f;
+  constexpr float ValenceBoostPower = 0.5f;
+
+  float vertex_score(int cachePosition, uint32_t remainingTriangles)
+  {
+    // Vertices with nothing left to draw shouldn't attract anything
+    if (remainingTriangles == 0) return -1.f;
+
+    float score = 0.f;
+    if (cachePosition >= 0) {
+      if (cachePosition < 3) {
+        // The triangle that was just emitted, a fixed score so it doesn't get picked straight away again
+        score = LastTriScore;
+      } else {
+        const float scaler = 1.f / (ScoreCacheSize - 3);
+        score = std::pow(1.f - (cachePosition - 3) * scaler, CacheDecayPower);
+      }
+    }
+
+    // Boost vertices with few triangles left so they get finished off instead of leaving lone triangles behind
+    score += ValenceBoostScale * std::pow((float)remainingTriangles, -ValenceBoostPower);
+
+    return score;
+  }
+
+  struct VertexHash {
+    size_t operator()(const Vertex& v) const
+    {
+      const uint32_t* words = (const uint32_t*)&v;
+      size_t hash = 0;
+      for (size_t i = 0; i < sizeof(Vertex) / sizeof(uint32_t); i++) {
+        hash = hash * 31 + words[i];
+      }
+      return hash;
+    }
+  };
+
+  struct VertexEqual {
+    bool operator()(const Vertex& a, const Vertex& b) const { return memcmp(&a, &b, sizeof(Vertex)) == 0; }
+  };
+
+  // Symmetric 4x4 matrix accumulating squared distances to planes, weighted by triangle area
+  struct Quadric {
+    double a00, a01, a02, a03;
+    double a11, a12, a13;
+    double a22, a23;
+    double a33;
+    double weight;
+
+    static Quadric from_plane(const glm::vec3& n, float d, float w)
+    {
+      Quadric q;
+      q.a00 = w * n.x * n.x; q.a01 = w * n.x * n.y; q.a02 = w * n.x * n.z; q.a03 = w * n.x * d;
+      q.a11 = w * n.y * n.y; q.a12 = w * n.y * n.z; q.a13 = w * n.y * d;
+      q.a22 = w * n.z * n.z; q.a23 = w * n.z * d;
+      q.a33 = w * d * d;
+      q.weight = w;
+      return q;
+    }
+
+    Quadric& operator+=(const Quadric& o)
+    {
+      a00 += o.a00; a01 += o.a01; a02 += o.a02; a03 += o.a03;
+      a11 += o.a11; a12 += o.a12; a13 += o.a13;
+      a22 += o.a22; a23 += o.a23;
+      a33 += o.a33;
+      weight += o.weight;
+      return *this;
+    }
+
+    // Mean squared distance of p to the accumulated planes
+    double error(const glm::vec3& p) const
+    {
+      double x = p.x, y = p.y, z = p.z;
+      double e = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x
+               + a11 * y * y + 2 * a12 * y * z + 2 * a13 * y
+               + a22 * z * z + 2 * a23 * z
+               + a33;
+      return weight > 0 ? std::max(e, 0.0) / weight : 0.0;
+    }
+  };
+
+  struct Collapse {
+    double cost;
+    uint32_t from;
+    uint32_t to;
+
+    bool operator>(const Collapse& o) const { return cost > o.cost; }
+  };
+
+  // Simple FIFO model of the post-transform cache, returns the number of misses for the triangle
+  struct FifoCache {
+    std::vector<uint32_t> timestamps;
+    uint32_t time;
+    uint32_t size;
+
+    FifoCache(size_t vertexCount, uint32_t cacheSize)
+      : timestamps(vertexCount, 0), time(cacheSize + 1), size(cacheSize) {}
+
+    uint32_t access(const uint32_t* tri)
+    {
+      uint32_t misses = 0;
+      for (int i = 0; i < 3; i++) {
+        // A vertex is in the cache if fewer than size misses happened since it was loaded
+        if (time - timestamps[tri[i]] > size) {
+          timestamps[tri[i]] = time++;
+          misses++;
+        }
+      }
+      return misses;
+    }
+
+    void reset() { time += size + 1; }
+  };
+}
+
+size_t vkmesh::weld_vertices(std::span<uint32_t> indices, std::vector<Vertex>& vertices)
+{
+  std::unordered_map<Vertex, uint32_t, VertexHash, VertexEqual> unique;
+  unique.reserve(vertices.size());
+
+  std::vector<uint32_t> remap(vertices.size());
+  std::vector<Vertex> welded;
+  welded.reserve(vertices.size());
+
+  for (size_t i = 0; i < vertices.size(); i++) {
+    auto [it, inserted] = unique.try_emplace(vertices[i], (uint32_t)welded.size());
+    if (inserted) welded.push_back(vertices[i]);
+    remap[i] = it->second;
+  }
+
+  for (uint32_t& idx : indices) {
+    idx = remap[idx];
+  }
+
+  vertices = std::move(welded);
+  return vertices.size();
+}
+
+void vkmesh::optimize_vertex_cache(std::span<uint32_t> indices, size_t vertexCount)
+{
+  const size_t triangleCount = indices.size() / 3;
+  if (triangleCount == 0) return;
+
+  // Build the vertex -> triangle adjacency
+  std::vector<uint32_t> remaining(vertexCount, 0);
+  for (uint32_t idx : indices) {
+    remaining[idx]++;
+  }
+
+  std::vector<uint32_t> offsets(vertexCount + 1, 0);
+  for (size_t v = 0; v < vertexCount; v++) {
+    offsets[v + 1] = offsets[v] + remaining[v];
+  }
+
+  std::vector<uint32_t> adjacency(indices.size());
+  std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+  for (size_t t = 0; t < triangleCount; t++) {
+    for (int i = 0; i < 3; i++) {
+      uint32_t v = indices[t * 3 + i];
+      adjacency[fill[v]++] = (uint32_t)t;
+    }
+  }
+
+  std::vector<int> cachePosition(vertexCount, -1);
+  std::vector<float> vertexScores(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++) {
+    vertexScores[v] = vertex_score(-1, remaining[v]);
+  }
+
+  std::vector<float> triangleScores(triangleCount);
+  std::vector<bool> emitted(triangleCount, false);
+  for (size_t t = 0; t < triangleCount; t++) {
+    const uint32_t* tri = &indices[t * 3];
+    triangleScores[t] = vertexScores[tri[0]] + vertexScores[tri[1]] + vertexScores[tri[2]];
+  }
+
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+
+  // The cache holds the LRU order, with room for the three vertices of the triangle being added
+  std::vector<uint32_t> cache;
+  std::vector<uint32_t> newCache;
+  cache.reserve(ScoreCacheSize + 3);
+  newCache.reserve(ScoreCacheSize + 3);
+
+  size_t scanCursor = 0;
+  int64_t bestTriangle = -1;
+
+  while (result.size() < indices.size()) {
+    if (bestTriangle < 0) {
+      // Nothing in the cache is useful, so start on the next triangle that hasn't been drawn
+      while (scanCursor < triangleCount && emitted[scanCursor]) scanCursor++;
+      bestTriangle = (int64_t)scanCursor;
+    }
+
+    const uint32_t* tri = &indices[bestTriangle * 3];
+    result.insert(result.end(), tri, tri + 3);
+    emitted[bestTriangle] = true;
+
+    // Move the triangle's vertices to the front of the cache
+    newCache.assign(tri, tri + 3);
+    for (uint32_t v : cache) {
+      if (v != tri[0] && v != tri[1] && v != tri[2]) newCache.push_back(v);
+    }
+
+    // Remove the triangle from the adjacency of its vertices
+    for (int i = 0; i < 3; i++) {
+      uint32_t v = tri[i];
+      uint32_t* begin = &adjacency[offsets[v]];
+      uint32_t* end = begin + remaining[v];
+      uint32_t* it = std::find(begin, end, (uint32_t)bestTriangle);
+      *it = *(end - 1);
+      remaining[v]--;
+    }
+
+    // Update the scores of everything in the cache, including what just fell out of it
+    for (size_t i = 0; i < newCache.size(); i++) {
+      uint32_t v = newCache[i];
+      cachePosition[v] = (i < (size_t)ScoreCacheSize) ? (int)i : -1;
+      vertexScores[v] = vertex_score(cachePosition[v], remaining[v]);
+    }
+
+    bestTriangle = -1;
+    float bestScore = -1.f;
+    for (uint32_t v : newCache) {
+      for (uint32_t a = 0; a < remaining[v]; a++) {
+        uint32_t t = adjacency[offsets[v] + a];
+        const uint32_t* adjTri = &indices[t * 3];
+        float score = vertexScores[adjTri[0]] + vertexScores[adjTri[1]] + vertexScores[adjTri[2]];
+        triangleScores[t] = score;
+
+        if (score > bestScore) {
+          bestScore = score;
+          bestTriangle = t;
+        }
+      }
+    }
+
+    if (newCache.size() > (size_t)ScoreCacheSize) newCache.resize(ScoreCacheSize);
+    std::swap(cache, newCache);
+  }
+
+  std::copy(result.begin(), result.end(), indices.begin());
+}
+
+void vkmesh::optimize_overdraw(std::span<uint32_t> indices, std::span<const Vertex> vertices, float threshold)
+{
+  const size_t triangleCount = indices.size() / 3;
+  if (triangleCount < 2) return;
+
+  FifoCache cache(vertices.size(), VertexCacheSize);
+
+  // Hard boundaries: a triangle that misses all three vertices starts a new region of the mesh
+  std::vector<size_t> hardClusters;
+  for (size_t t = 0; t < triangleCount; t++) {
+    if (cache.access(&indices[t * 3]) == 3 || t == 0) hardClusters.push_back(t);
+  }
+  hardClusters.push_back(triangleCount);
+
+  // Soft boundaries: split hard clusters further wherever it costs little vertex cache efficiency
+  std::vector<size_t> clusters;
+  for (size_t c = 0; c + 1 < hardClusters.size(); c++) {
+    size_t start = hardClusters[c];
+    size_t end = hardClusters[c + 1];
+
+    cache.reset();
+    uint32_t clusterMisses = 0;
+    for (size_t t = start; t < end; t++) {
+      clusterMisses += cache.access(&indices[t * 3]);
+    }
+    float clusterAcmr = (float)clusterMisses / (end - start);
+
+    cache.reset();
+    clusters.push_back(start);
+    uint32_t misses = 0;
+    size_t splitStart = start;
+    for (size_t t = start; t < end; t++) {
+      misses += cache.access(&indices[t * 3]);
+
+      float acmr = (float)misses / (t + 1 - splitStart);
+      if (t + 1 < end && acmr <= clusterAcmr * threshold) {
+        clusters.push_back(t + 1);
+        splitStart = t + 1;
+        misses = 0;
+        cache.reset();
+      }
+    }
+  }
+  clusters.push_back(triangleCount);
+
+  // Area weighted centroid of the whole mesh
+  glm::vec3 meshCentroid{ 0.f };
+  float meshArea = 0.f;
+  std::vector<glm::vec3> triangleNormals(triangleCount);
+  std::vector<glm::vec3> triangleCentroids(triangleCount);
+  for (size_t t = 0; t < triangleCount; t++) {
+    const glm::vec3& p0 = vertices[indices[t * 3 + 0]].position;
+    const glm::vec3& p1 = vertices[indices[t * 3 + 1]].position;
+    const glm::vec3& p2 = vertices[indices[t * 3 + 2]].position;
+
+    // Unnormalized, so its length is twice the triangle area
+    triangleNormals[t] = glm::cross(p1 - p0, p2 - p0);
+    triangleCentroids[t] = (p0 + p1 + p2) / 3.f;
+
+    float area = glm::length(triangleNormals[t]);
+    meshCentroid += triangleCentroids[t] * area;
+    meshArea += area;
+  }
+  if (meshArea > 0.f) meshCentroid /= meshArea;
+
+  struct ClusterSort {
+    size_t start;
+    size_t end;
+    float key;
+  };
+
+  std::vector<ClusterSort> sorted;
+  sorted.reserve(clusters.size());
+  for (size_t c = 0; c + 1 < clusters.size(); c++) {
+    size_t start = clusters[c];
+    size_t end = clusters[c + 1];
+
+    glm::vec3 centroid{ 0.f };
+    glm::vec3 normal{ 0.f };
+    float area = 0.f;
+    for (size_t t = start; t < end; t++) {
+      float a = glm::length(triangleNormals[t]);
+      centroid += triangleCentroids[t] * a;
+      normal += triangleNormals[t];
+      area += a;
+    }
+    if (area > 0.f) centroid /= area;
+
+    float normalLength = glm::length(normal);
+    if (normalLength > 0.f) normal /= normalLength;
+
+    // Clusters on the outside facing away from the center are the most likely to occlude the rest
+    sorted.push_back(ClusterSort{ start, end, glm::dot(centroid - meshCentroid, normal) });
+  }
+
+  std::stable_sort(sorted.begin(), sorted.end(), [](const ClusterSort& a, const ClusterSort& b) { return a.key > b.key; });
+
+  std::vector<uint32_t> result;
+  result.reserve(indices.size());
+  for (const ClusterSort& c : sorted) {
+    result.insert(result.end(), indices.begin() + c.start * 3, indices.begin() + c.end * 3);
+  }
+
+  std::copy(result.begin(), result.end(), indices.begin());
+}
+
+void vkmesh::optimize_vertex_fetch(std::span<uint32_t> indices, std::vector<Vertex>& vertices)
+{
+  constexpr uint32_t Unused = ~0u;
+
+  std::vector<uint32_t> remap(vertices.size(), Unused);
+  std::vector<Vertex> reordered;
+  reordered.reserve(vertices.size());
+
+  for (uint32_t& idx : indices) {
+    if (remap[idx] == Unused) {
+      remap[idx] = (uint32_t)reordered.size();
+      reordered.push_back(vertices[idx]);
+    }
+    idx = remap[idx];
+  }
+
+  // Vertices no index refers to are dropped
+  vertices = std::move(reordered);
+}
+
+std::vector<uint32_t> vkmesh::simplify(std::span<const uint32_t> indices, std::span<const Vertex> vertices, size_t targetIndexCount,
+                                       float targetError, float* resultError)
+{
+  std::vector<uint32_t> tris(indices.begin(), indices.end());
+  const size_t triangleCount = tris.size() / 3;
+
+  if (resultError) *resultError = 0.f;
+  if (tris.size() <= targetIndexCount) return tris;
+
+  std::vector<Quadric> quadrics(vertices.size(), Quadric{});
+  std::vector<std::vector<uint32_t>> adjacency(vertices.size());
+  std::vector<bool> alive(triangleCount, true);
+
+  for (size_t t = 0; t < triangleCount; t++) {
+    const glm::vec3& p0 = vertices[tris[t * 3 + 0]].position;
+    const glm::vec3& p1 = vertices[tris[t * 3 + 1]].position;
+    const glm::vec3& p2 = vertices[tris[t * 3 + 2]].position;
+
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float area = glm::length(normal);
+    if (area > 0.f) normal /= area;
+
+    Quadric q = Quadric::from_plane(normal, -glm::dot(normal, p0), area);
+    for (int i = 0; i < 3; i++) {
+      quadrics[tris[t * 3 + i]] += q;
+      adjacency[tris[t * 3 + i]].push_back((uint32_t)t);
+    }
+  }
+
+  // Lock everything on an open or non-manifold edge
+  std::unordered_map<uint64_t, uint32_t> edgeUses;
+  auto edge_key = [](uint32_t a, uint32_t b) { return (uint64_t(std::min(a, b)) << 32) | std::max(a, b); };
+  for (size_t t = 0; t < triangleCount; t++) {
+    for (int i = 0; i < 3; i++) {
+      edgeUses[edge_key(tris[t * 3 + i], tris[t * 3 + (i + 1) % 3])]++;
+    }
+  }
+
+  std::vector<bool> locked(vertices.size(), false);
+  for (auto& [key, uses] : edgeUses) {
+    if (uses != 2) {
+      locked[key >> 32] = true;
+      locked[key & 0xFFFFFFFF] = true;
+    }
+  }
+
+  std::vector<bool> collapsed(vertices.size(), false);
+  std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+
+  auto collapse_cost = [&](uint32_t from, uint32_t to) {
+    Quadric q = quadrics[from];
+    q += quadrics[to];
+    return q.error(vertices[to].position);
+  };
+
+  auto push_edge = [&](uint32_t a, uint32_t b) {
+    if (!locked[a]) heap.push(Collapse{ collapse_cost(a, b), a, b });
+    if (!locked[b]) heap.push(Collapse{ collapse_cost(b, a), b, a });
+  };
+
+  for (auto& [key, uses] : edgeUses) {
+    push_edge(uint32_t(key >> 32), uint32_t(key & 0xFFFFFFFF));
+  }
+
+  const double maxCost = double(targetError) * targetError;
+  double worstCost = 0.0;
+  size_t liveTriangles = triangleCount;
+
+  while (!heap.empty() && liveTriangles * 3 > targetIndexCount) {
+    Collapse c = heap.top();
+    heap.pop();
+
+    if (collapsed[c.from] || collapsed[c.to]) continue;
+
+    // Costs go stale as quadrics merge, re-queue the entry if it got more expensive
+    double cost = collapse_cost(c.from, c.to);
+    if (cost > c.cost * 1.0001 + 1e-12) {
+      heap.push(Collapse{ cost, c.from, c.to });
+      continue;
+    }
+
+    if (cost > maxCost) break;
+
+    // The edge has to still exist, and no remaining triangle may flip or collapse to nothing
+    bool connected = false;
+    bool valid = true;
+    for (uint32_t t : adjacency[c.from]) {
+      if (!alive[t]) continue;
+
+      uint32_t* tri = &tris[t * 3];
+      if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) {
+        connected = true;
+        continue;
+      }
+
+      glm::vec3 p[3];
+      glm::vec3 moved[3];
+      for (int i = 0; i < 3; i++) {
+        p[i] = vertices[tri[i]].position;
+        moved[i] = (tri[i] == c.from) ? vertices[c.to].position : p[i];
+      }
+
+      glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+      glm::vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+      if (glm::dot(before, after) <= 1e-4f * glm::dot(before, before)) {
+        valid = false;
+        break;
+      }
+    }
+
+    if (!connected || !valid) continue;
+
+    for (uint32_t t : adjacency[c.from]) {
+      if (!alive[t]) continue;
+
+      uint32_t* tri = &tris[t * 3];
+      if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) {
+        alive[t] = false;
+        liveTriangles--;
+        continue;
+      }
+
+      for (int i = 0; i < 3; i++) {
+        if (tri[i] == c.from) tri[i] = c.to;
+      }
+      adjacency[c.to].push_back(t);
+    }
+
+    quadrics[c.to] += quadrics[c.from];
+    collapsed[c.from] = true;
+    adjacency[c.from].clear();
+    worstCost = std::max(worstCost, cost);
+
+    // Re-evaluate every edge around the vertex that absorbed the collapse
+    for (uint32_t t : adjacency[c.to]) {
+      if (!alive[t]) continue;
+
+      for (int i = 0; i < 3; i++) {
+        uint32_t v = tris[t * 3 + i];
+        if (v != c.to) push_edge(c.to, v);
+      }
+    }
+  }
+
+  std::vector<uint32_t> result;
+  result.reserve(liveTriangles * 3);
+  for (size_t t = 0; t < triangleCount; t++) {
+    if (alive[t]) result.insert(result.end(), &tris[t * 3], &tris[t * 3] + 3);
+  }
+
+  if (resultError) *resultError = (float)std::sqrt(worstCost);
+  return result;
+}
+
+std::vector<vkmesh::Meshlet> vkmesh::build_meshlets(std::span<uint32_t> indices, std::span<const Vertex> vertices)
+{
+  size_t triangleCount = indices.size() / 3;
+
+  std::vector<glm::vec3> centroids(triangleCount);
+  std::vector<glm::vec3> normals(triangleCount);
+  for (size_t t = 0; t < triangleCount; t++) {
+    const glm::vec3& p0 = vertices[indices[t * 3 + 0]].position;
+    const glm::vec3& p1 = vertices[indices[t * 3 + 1]].position;
+    const glm::vec3& p2 = vertices[indices[t * 3 + 2]].position;
+
+    centroids[t] = (p0 + p1 + p2) / 3.f;
+    glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    float area = glm::length(n);
+    normals[t] = area > 0.f ? n / area : glm::vec3(0.f);
+  }
+
+  // Triangles using each vertex, as offsets into one flat list
+  std::vector<uint32_t> adjacencyOffsets(vertices.size() + 1, 0);
+  for (uint32_t index : indices) adjacencyOffsets[index + 1]++;
+  for (size_t v = 0; v < vertices.size(); v++) adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+
+  std::vector<uint32_t> adjacency(adjacencyOffsets.back());
+  {
+    std::vector<uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+    for (size_t i = 0; i < triangleCount * 3; i++) {
+      adjacency[fill[indices[i]]++] = (uint32_t)(i / 3);
+    }
+  }
+
+  std::vector<bool> emitted(triangleCount, false);
+  // Stamp per vertex marking membership of the cluster being built
+  std::vector<uint32_t> stamps(vertices.size(), 0);
+  uint32_t stamp = 0;
+
+  std::vector<uint32_t> order;
+  order.reserve(triangleCount);
+  std::vector<uint32_t> candidates;
+  std::vector<Meshlet> meshlets;
+
+  size_t seed = 0;
+  while (order.size() < triangleCount) {
+    while (emitted[seed]) seed++;
+
+    stamp++;
+    uint32_t first = (uint32_t)order.size();
+    uint32_t vertexCount = 0;
+    glm::vec3 centroidSum{ 0.f };
+    glm::vec3 normalSum{ 0.f };
+
+    auto add = [&](uint32_t t) {
+      emitted[t] = true;
+      order.push_back(t);
+      centroidSum += centroids[t];
+      normalSum += normals[t];
+
+      for (int k = 0; k < 3; k++) {
+        uint32_t v = indices[t * 3 + k];
+        if (stamps[v] == stamp) continue;
+
+        stamps[v] = stamp;
+        vertexCount++;
+        for (uint32_t a = adjacencyOffsets[v]; a < adjacencyOffsets[v + 1]; a++) {
+          if (!emitted[adjacency[a]]) candidates.push_back(adjacency[a]);
+        }
+      }
+    };
+
+    candidates.clear();
+    add((uint32_t)seed);
+
+    while (order.size() - first < MeshletMaxTriangles) {
+      glm::vec3 center = centroidSum / float(order.size() - first);
+      float normalLength = glm::length(normalSum);
+      glm::vec3 axis = normalLength > 0.f ? normalSum / normalLength : glm::vec3(0.f);
+
+      // Fewest new vertices wins, ties go to the closest triangle with distance penalised for facing away from the cluster
+      int bestTriangle = -1;
+      uint32_t bestNew = 4;
+      float bestScore = FLT_MAX;
+      for (size_t c = 0; c < candidates.size();) {
+        uint32_t t = candidates[c];
+        if (emitted[t]) {
+          candidates[c] = candidates.back();
+          candidates.pop_back();
+          continue;
+        }
+        c++;
+
+        uint32_t newVertices = 0;
+        for (int k = 0; k < 3; k++) {
+          if (stamps[indices[t * 3 + k]] != stamp) newVertices++;
+        }
+        if (vertexCount + newVertices > MeshletMaxVertices) continue;
+
+        float score = glm::length(centroids[t] - center) * (2.f - glm::dot(normals[t], axis));
+        if (newVertices < bestNew || (newVertices == bestNew && score < bestScore)) {
+          bestTriangle = (int)t;
+          bestNew = newVertices;
+          bestScore = score;
+        }
+      }
+
+      if (bestTriangle < 0) break;
+      add((uint32_t)bestTriangle);
+    }
+
+    Meshlet m;
+    m.firstIndex = first * 3;
+    m.indexCount = ((uint32_t)order.size() - first) * 3;
+
+    glm::vec3 minpos{ FLT_MAX };
+    glm::vec3 maxpos{ -FLT_MAX };
+    for (size_t i = first; i < order.size(); i++) {
+      for (int k = 0; k < 3; k++) {
+        minpos = glm::min(minpos, vertices[indices[order[i] * 3 + k]].position);
+        maxpos = glm::max(maxpos, vertices[indices[order[i] * 3 + k]].position);
+      }
+    }
+
+    m.center = (minpos + maxpos) / 2.f;
+    float radius2 = 0.f;
+    for (size_t i = first; i < order.size(); i++) {
+      for (int k = 0; k < 3; k++) {
+        glm::vec3 d = vertices[indices[order[i] * 3 + k]].position - m.center;
+        radius2 = std::max(radius2, glm::dot(d, d));
+      }
+    }
+    m.radius = std::sqrt(radius2);
+
+    float normalLength = glm::length(normalSum);
+    m.coneAxis = normalLength > 0.f ? normalSum / normalLength : glm::vec3(0.f, 0.f, 1.f);
+
+    float minDot = 1.f;
+    for (size_t i = first; i < order.size(); i++) {
+      // Degenerate triangles never rasterize, so they don't constrain the cone
+      if (glm::dot(normals[order[i]], normals[order[i]]) == 0.f) continue;
+      minDot = std::min(minDot, glm::dot(normals[order[i]], m.coneAxis));
+    }
+
+    // A cone close to a hemisphere can never be rejected reliably, a cutoff of 1 makes the test always fail
+    m.coneCutoff = (normalLength == 0.f || minDot <= 0.1f) ? 1.f : std::sqrt(1.f - minDot * minDot);
+
+    meshlets.push_back(m);
+  }
+
+  std::vector<uint32_t> reordered(triangleCount * 3);
+  for (size_t i = 0; i < triangleCount; i++) {
+    for (int k = 0; k < 3; k++) reordered[i * 3 + k] = indices[order[i] * 3 + k];
+  }
+  std::copy(reordered.begin(), reordered.end(), indices.begin());
+
+  return meshlets;
+}
+
+void vkmesh::sort_meshlets(std::span<uint32_t> indices, std::span<const Vertex> vertices, std::vector<Meshlet>& meshlets)
+{
+  if (meshlets.size() < 2) return;
+
+  // Area weighted centroid and summed normal of every cluster, the whole range's centroid follows from them
+  std::vector<glm::vec3> centroids(meshlets.size(), glm::vec3(0.f));
+  std::vector<glm::vec3> normals(meshlets.size(), glm::vec3(0.f));
+  glm::vec3 meshCentroid{ 0.f };
+  float meshArea = 0.f;
+  for (size_t c = 0; c < meshlets.size(); c++) {
+    float area = 0.f;
+    for (uint32_t i = meshlets[c].firstIndex; i < meshlets[c].firstIndex + meshlets[c].indexCount; i += 3) {
+      const glm::vec3& p0 = vertices[indices[i + 0]].position;
+      const glm::vec3& p1 = vertices[indices[i + 1]].position;
+      const glm::vec3& p2 = vertices[indices[i + 2]].position;
+
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      float a = glm::length(n);
+      centroids[c] += (p0 + p1 + p2) / 3.f * a;
+      normals[c] += n;
+      area += a;
+    }
+
+    meshCentroid += centroids[c];
+    meshArea += area;
+    if (area > 0.f) centroids[c] /= area;
+
+    float normalLength = glm::length(normals[c]);
+    if (normalLength > 0.f) normals[c] /= normalLength;
+  }
+  if (meshArea > 0.f) meshCentroid /= meshArea;
+
+  std::vector<float> keys(meshlets.size());
+  std::vector<uint32_t> order(meshlets.size());
+  for (size_t c = 0; c < meshlets.size(); c++) {
+    keys[c] = glm::dot(centroids[c] - meshCentroid, normals[c]);
+    order[c] = (uint32_t)c;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] > keys[b]; });
+
+  std::vector<uint32_t> reordered;
+  reordered.reserve(indices.size());
+  std::vector<Meshlet> sorted;
+  sorted.reserve(meshlets.size());
+  for (uint32_t c : order) {
+    Meshlet m = meshlets[c];
+    reordered.insert(reordered.end(), indices.begin() + m.firstIndex, indices.begin() + m.firstIndex + m.indexCount);
+    m.firstIndex = (uint32_t)(reordered.size() - m.indexCount);
+    sorted.push_back(m);
+  }
+  std::copy(reordered.begin(), reordered.end(), indices.begin());
+
+  meshlets = std::move(sorted);
+}
+
+vkmesh::CacheStats vkmesh::analyze_vertex_cache(std::span<const uint32_t> indices, size_t vertexCount, uint32_t cacheSize)
+{
+  CacheStats stats{ 0.f, 0.f };
+
+  const size_t triangleCount = indices.size() / 3;
+  if (triangleCount == 0) return stats;
+
+  FifoCache cache(vertexCount, cacheSize);
+  std::vector<bool> referenced(vertexCount, false);
+
+  uint32_t misses = 0;
+  size_t uniqueVertices = 0;
+  for (size_t t = 0; t < triangleCount; t++) {
+    misses += cache.access(&indices[t * 3]);
+
+    for (int i = 0; i < 3; i++) {
+      if (!referenced[indices[t * 3 + i]]) {
+        referenced[indices[t * 3 + i]] = true;
+        uniqueVertices++;
+      }
+    }
+  }
+
+  stats.acmr = (float)misses / triangleCount;
+  stats.atvr = (float)misses / uniqueVertices;
+  return stats;
+}
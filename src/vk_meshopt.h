@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Load time index/vertex buffer optimisations. All of them work on plain index lists of triangles
+namespace vkmesh {
+  // Matches the post-transform cache model used for the analysis
+  constexpr uint32_t VertexCacheSize = 16;
+
+  struct CacheStats {
+    // Vertex shader invocations per triangle, 0.5 is the best possible on a regular grid and 3 the worst
+    float acmr;
+    // Vertex shader invocations per referenced vertex, 1 is the best possible
+    float atvr;
+  };
+
+  // Cluster limits, sized so a cluster fits the usual mesh shader output limits
+  constexpr uint32_t MeshletMaxVertices = 64;
+  constexpr uint32_t MeshletMaxTriangles = 124;
+
+  struct Meshlet {
+    // Range of the index list the cluster was built from
+    uint32_t firstIndex;
+    uint32_t indexCount;
+
+    glm::vec3 center;
+    float radius;
+
+    // Every triangle normal is within the cone around the axis. The cluster is back facing when
+    // dot(center - camera, coneAxis) >= coneCutoff * length(center - camera) + radius
+    glm::vec3 coneAxis;
+    float coneCutoff;
+  };
+
+  // Merges vertices that are bitwise identical and rewrites the indices to match, returns the new vertex count
+  size_t weld_vertices(std::span<uint32_t> indices, std::vector<Vertex>& vertices);
+
+  // Reorders triangles for the post-transform vertex cache using Forsyth's linear-speed algorithm
+  void optimize_vertex_cache(std::span<uint32_t> indices, size_t vertexCount);
+
+  // Splits a cache optimised triangle order into clusters and sorts them so outward facing clusters draw first.
+  // Threshold is how much ACMR the split is allowed to cost, 1.05 keeps it within 5% of the input
+  void optimize_overdraw(std::span<uint32_t> indices, std::span<const Vertex> vertices, float threshold = 1.05f);
+
+  // Reorders vertices in the order the indices first use them, so vertex fetches walk memory linearly
+  void optimize_vertex_fetch(std::span<uint32_t> indices, std::vector<Vertex>& vertices);
+
+  // Quadric error edge collapse simplification. Vertices are only collapsed onto other existing vertices, so the
+  // result indexes the same vertex buffer. Open and non-manifold edges are locked so seams and borders stay in place.
+  // Stops at targetIndexCount or once a collapse would move the surface further than targetError, and writes the
+  // largest error it did accept to resultError
+  std::vector<uint32_t> simplify(std::span<const uint32_t> indices, std::span<const Vertex> vertices, size_t targetIndexCount,
+                                 float targetError, float* resultError = nullptr);
+
+  // Groups spatially close triangles that share vertices into clusters, preferring triangles that face the same way
+  // so the normal cones stay narrow. Triangles are reordered in place so every cluster is a consecutive index range
+  std::vector<Meshlet> build_meshlets(std::span<uint32_t> indices, std::span<const Vertex> vertices);
+
+  // Sorts clusters from build_meshlets with the same outward facing first key as optimize_overdraw, which the
+  // clustering throws away. Moves every cluster's triangles along, so the index list stays in cluster order
+  void sort_meshlets(std::span<uint32_t> indices, std::span<const Vertex> vertices, std::vector<Meshlet>& meshlets);
+
+  CacheStats analyze_vertex_cache(std::span<const uint32_t> indices, size_t vertexCount, uint32_t cacheSize = VertexCacheSize);
+};
@@ -1,5 +1,7 @@
 #include <vk_pipelines.h>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
 #include <vk_initializers.h>
 
 bool vkutil::load_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule)
@@ -36,6 +38,156 @@ bool vkutil::load_shader_module(const char* filePath, VkDevice device, VkShaderM
   return true;
 }
 
+VkPipeline vkutil::create_compute_pipeline(VkDevice device, VkPipelineCache cache, const char* filePath, VkPipelineLayout layout,
+                                           VkPipelineCreateFlags flags, const VkSpecializationInfo* specialization)
+{
+  VkShaderModule shader;
+  if (!load_shader_module(filePath, device, &shader)) {
+    fmt::println("Error when building the compute shader {}", filePath);
+    return VK_NULL_HANDLE;
+  }
+
+  VkPipelineShaderStageCreateInfo stageInfo{};
+  stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  stageInfo.module = shader;
+  stageInfo.pName = "main";
+  stageInfo.pSpecializationInfo = specialization;
+
+  VkComputePipelineCreateInfo pipelineInfo{};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfo.layout = layout;
+  pipelineInfo.stage = stageInfo;
+  pipelineInfo.flags = flags;
+
+  VkPipeline newPipeline;
+  VkResult result = vkCreateComputePipelines(device, cache, 1, &pipelineInfo, nullptr, &newPipeline);
+
+  vkDestroyShaderModule(device, shader, nullptr);
+
+  if (result != VK_SUCCESS) {
+    fmt::println("Failed to create compute pipeline {}", filePath);
+    return VK_NULL_HANDLE;
+  }
+  return newPipeline;
+}
+
+VkPipelineCache vkutil::load_pipeline_cache(VkDevice device, VkPhysicalDevice gpu, const char* path)
+{
+  std::vector<char> data;
+  std::ifstream file(path, std::ios::ate | std::ios::binary);
+  if (file.is_open()) {
+    data.resize((size_t)file.tellg());
+    file.seekg(0);
+    file.read(data.data(), data.size());
+  }
+
+  // Drivers reject data from other devices too, but not all of them check it carefully
+  if (!data.empty()) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(gpu, &properties);
+
+    VkPipelineCacheHeaderVersionOne header{};
+    if (data.size() >= sizeof(header)) memcpy(&header, data.data(), sizeof(header));
+
+    bool matches = header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE && header.vendorID == properties.vendorID &&
+                   header.deviceID == properties.deviceID && memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    if (!matches) {
+      fmt::println("Ignoring the pipeline cache in {}, it's from another device or driver", path);
+      data.clear();
+    }
+  }
+
+  VkPipelineCacheCreateInfo cacheInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+  cacheInfo.initialDataSize = data.size();
+  cacheInfo.pInitialData = data.data();
+
+  VkPipelineCache cache;
+  VK_CHECK(vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache));
+  return cache;
+}
+
+void vkutil::save_pipeline_cache(VkDevice device, VkPipelineCache cache, const char* path)
+{
+  size_t size = 0;
+  if (vkGetPipelineCacheData(device, cache, &size, nullptr) != VK_SUCCESS || size == 0) return;
+
+  std::vector<char> data(size);
+  if (vkGetPipelineCacheData(device, cache, &size, data.data()) != VK_SUCCESS) return;
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    fmt::println("Failed to write the pipeline cache to {}", path);
+    return;
+  }
+  file.write(data.data(), size);
+}
+
+void PipelineCompiler::add(const char* name, VkPipeline* target, std::function<VkPipeline()>&& build)
+{
+  jobs.push_back({ name, target, std::move(build), 0.f, false });
+}
+
+void PipelineCompiler::start()
+{
+  startTime = std::chrono::system_clock::now();
+  nextJob = 0;
+  if (jobs.empty()) return;
+
+  // One core stays with the main thread, which keeps loading in the meantime
+  size_t threadCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 2, jobs.size() + 1) - 1;
+  for (size_t i = 0; i < threadCount; i++) {
+    threads.emplace_back(&PipelineCompiler::run, this);
+  }
+}
+
+void PipelineCompiler::run()
+{
+  for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) {
+    Job& job = jobs[i];
+
+    auto start = std::chrono::system_clock::now();
+    VkPipeline pipeline = job.build();
+    auto end = std::chrono::system_clock::now();
+
+    if (job.target) *job.target = pipeline;
+    job.failed = pipeline == VK_NULL_HANDLE;
+    job.time = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.f;
+  }
+}
+
+bool PipelineCompiler::wait()
+{
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  auto end = std::chrono::system_clock::now();
+  float elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - startTime).count() / 1000.f;
+
+  // The sum against the wall time is what compiling them one after the other would have cost
+  float total = 0.f;
+  bool succeeded = true;
+  const Job* slowest = nullptr;
+  for (const Job& job : jobs) {
+    total += job.time;
+    if (!slowest || job.time > slowest->time) slowest = &job;
+    if (job.failed) {
+      fmt::println("Failed to build the {} pipeline", job.name);
+      succeeded = false;
+    }
+  }
+
+  if (slowest) {
+    fmt::println("Compiled {} pipelines on {} threads in {:.1f} ms, {:.1f} ms of work, slowest {} at {:.1f} ms", jobs.size(), threads.size(),
+                 elapsed, total, slowest->name, slowest->time);
+  }
+
+  jobs.clear();
+  threads.clear();
+  return succeeded;
+}
+
 void PipelineBuilder::clear()
 {
   // Clear all of the structs we need back to 0
@@ -54,6 +206,7 @@ void PipelineBuilder::clear()
   _renderInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
 
   _shaderStages.clear();
+  _dynamicStates.clear();
 }
 
 void PipelineBuilder::set_shaders(VkShaderModule vertexShader, VkShaderModule fragmentShader)
@@ -64,6 +217,20 @@ void PipelineBuilder::set_shaders(VkShaderModule vertexShader, VkShaderModule fr
   _shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT, fragmentShader));
 }
 
+void PipelineBuilder::set_vertex_shader(VkShaderModule vertexShader)
+{
+  _shaderStages.clear();
+
+  _shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, vertexShader));
+}
+
+void PipelineBuilder::set_specialization(VkShaderStageFlagBits stage, const VkSpecializationInfo* specialization)
+{
+  for (VkPipelineShaderStageCreateInfo& shaderStage : _shaderStages) {
+    if (shaderStage.stage == stage) shaderStage.pSpecializationInfo = specialization;
+  }
+}
+
 void PipelineBuilder::set_input_topology(VkPrimitiveTopology topology)
 {
   _inputAssembly.topology = topology;
@@ -137,6 +304,12 @@ void PipelineBuilder::set_color_attachment_format(VkFormat format)
   _renderInfo.pColorAttachmentFormats = &_colorAttachmentformat;
 }
 
+void PipelineBuilder::disable_color_attachment()
+{
+  _renderInfo.colorAttachmentCount = 0;
+  _renderInfo.pColorAttachmentFormats = nullptr;
+}
+
 void PipelineBuilder::set_depth_format(VkFormat format)
 {
   _renderInfo.depthAttachmentFormat = format;
@@ -168,8 +341,16 @@ void PipelineBuilder::enable_depthtest(bool depthWriteEnable, VkCompareOp op)
   _depthStencil.maxDepthBounds = 1.f;
 }
 
-VkPipeline PipelineBuilder::build_pipeline(VkDevice device)
+void PipelineBuilder::add_dynamic_states(std::initializer_list<VkDynamicState> states)
 {
+  _dynamicStates.insert(_dynamicStates.end(), states.begin(), states.end());
+}
+
+VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkPipelineCache cache)
+{
+  // Builders are copied into compile jobs, the format pointer has to follow the copy
+  if (_renderInfo.colorAttachmentCount > 0) _renderInfo.pColorAttachmentFormats = &_colorAttachmentformat;
+
   // Make viewport state from our stored viewport and scissor
   VkPipelineViewportStateCreateInfo viewportState = {};
   viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -185,7 +366,8 @@ VkPipeline PipelineBuilder::build_pipeline(VkDevice device)
 
   colorBlending.logicOpEnable = VK_FALSE;
   colorBlending.logicOp = VK_LOGIC_OP_COPY;
-  colorBlending.attachmentCount = 1;
+  // Depth-only pipelines have no color attachment to blend into
+  colorBlending.attachmentCount = _renderInfo.colorAttachmentCount > 0 ? 1 : 0;
   colorBlending.pAttachments = &_colorBlendAttachment;
 
   VkPipelineVertexInputStateCreateInfo _vertexInputInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
@@ -205,21 +387,45 @@ VkPipeline PipelineBuilder::build_pipeline(VkDevice device)
   pipelineInfo.pDepthStencilState = &_depthStencil;
   pipelineInfo.layout = _pipelineLayout;
 
-  VkDynamicState state[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+  std::vector<VkDynamicState> state = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+  state.insert(state.end(), _dynamicStates.begin(), _dynamicStates.end());
 
   VkPipelineDynamicStateCreateInfo dynamicInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
-  dynamicInfo.pDynamicStates = &state[0];
-  dynamicInfo.dynamicStateCount = 2;
+  dynamicInfo.pDynamicStates = state.data();
+  dynamicInfo.dynamicStateCount = (uint32_t)state.size();
 
   pipelineInfo.pDynamicState = &dynamicInfo;
 
   // Errors on the graphics pipeline creation can be complex, so it's handled better than the usual VK_CHECK
   VkPipeline newPipeline;
 
-  if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
+  if (vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS) {
     fmt::println("Failed to create pipeline");
     return VK_NULL_HANDLE;
   } else {
     return newPipeline;
   }
 }
+
+VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkPipelineCache cache, const char* vertexPath, const char* fragmentPath)
+{
+  VkShaderModule vertexShader;
+  if (!vkutil::load_shader_module(vertexPath, device, &vertexShader)) {
+    fmt::println("Failed to load {}", vertexPath);
+    return VK_NULL_HANDLE;
+  }
+
+  VkShaderModule fragmentShader;
+  if (!vkutil::load_shader_module(fragmentPath, device, &fragmentShader)) {
+    fmt::println("Failed to load {}", fragmentPath);
+    vkDestroyShaderModule(device, vertexShader, nullptr);
+    return VK_NULL_HANDLE;
+  }
+
+  set_shaders(vertexShader, fragmentShader);
+  VkPipeline pipeline = build_pipeline(device, cache);
+
+  vkDestroyShaderModule(device, vertexShader, nullptr);
+  vkDestroyShaderModule(device, fragmentShader, nullptr);
+  return pipeline;
+}
@@ -1,9 +1,47 @@
 #pragma once
 
 #include <vk_types.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 namespace vkutil {
   bool load_shader_module(const char* filePath, VkDevice device, VkShaderModule* outShaderModule);
+  // Loads the shader and builds the pipeline from it, VK_NULL_HANDLE when either fails
+  VkPipeline create_compute_pipeline(VkDevice device, VkPipelineCache cache, const char* filePath, VkPipelineLayout layout,
+                                     VkPipelineCreateFlags flags = 0, const VkSpecializationInfo* specialization = nullptr);
+
+  // Starts from the data a previous run saved, when it was written by the same device and driver
+  VkPipelineCache load_pipeline_cache(VkDevice device, VkPhysicalDevice gpu, const char* path);
+  void save_pipeline_cache(VkDevice device, VkPipelineCache cache, const char* path);
+};
+
+// Pipelines set up during init and compiled together on worker threads, while the main thread carries on. Every job
+// loads its own shaders and writes only its own pipeline, pipeline creation itself is safe to run side by side
+class PipelineCompiler {
+public:
+  // target may be null when the build keeps the pipeline itself
+  void add(const char* name, VkPipeline* target, std::function<VkPipeline()>&& build);
+
+  void start();
+  // Blocks until every job finished, false when one of them failed
+  bool wait();
+
+private:
+  struct Job {
+    const char* name;
+    VkPipeline* target;
+    std::function<VkPipeline()> build;
+    float time;
+    bool failed;
+  };
+
+  void run();
+
+  std::vector<Job> jobs;
+  std::atomic<size_t> nextJob{0};
+  std::vector<std::thread> threads;
+  std::chrono::system_clock::time_point startTime;
 };
 
 class PipelineBuilder {
@@ -18,14 +56,22 @@ public:
   VkPipelineDepthStencilStateCreateInfo _depthStencil;
   VkPipelineRenderingCreateInfo _renderInfo;
   VkFormat _colorAttachmentformat;
+  // On top of viewport and scissor, the baked values of these are ignored
+  std::vector<VkDynamicState> _dynamicStates;
 
   PipelineBuilder(){ clear(); }
 
   void clear();
 
-  VkPipeline build_pipeline(VkDevice device);
+  VkPipeline build_pipeline(VkDevice device, VkPipelineCache cache = VK_NULL_HANDLE);
+  // Loads both shaders, builds with them and frees them again, VK_NULL_HANDLE when any of it fails
+  VkPipeline build_pipeline(VkDevice device, VkPipelineCache cache, const char* vertexPath, const char* fragmentPath);
 
   void set_shaders(VkShaderModule vertexShader, VkShaderModule fragmentShader);
+  // Vertex stage only, for depth-only passes
+  void set_vertex_shader(VkShaderModule vertexShader);
+  // Applies to the stage set by the last set_shaders call, the info has to outlive build_pipeline
+  void set_specialization(VkShaderStageFlagBits stage, const VkSpecializationInfo* specialization);
   void set_input_topology(VkPrimitiveTopology topology);
   void set_polygon_mode(VkPolygonMode mode);
   void set_cull_mode(VkCullModeFlags cullMode, VkFrontFace frontFace);
@@ -34,7 +80,9 @@ public:
   void enable_blending_additive();
   void enable_blending_alphablend();
   void set_color_attachment_format(VkFormat format);
+  void disable_color_attachment();
   void set_depth_format(VkFormat format);
   void disable_depthtest();
   void enable_depthtest(bool depthWriteEnable, VkCompareOp op);
+  void add_dynamic_states(std::initializer_list<VkDynamicState> states);
 };
@@ -0,0 +1,370 @@
+#include "vk_reflect.h"
+
+#include <fstream>
+#include <algorithm>
+
+namespace {
+  // The parts of the SPIR-V spec reflection needs
+  constexpr uint32_t SpirvMagic = 0x07230203;
+
+  enum Op : uint32_t {
+    OpEntryPoint = 15,
+    OpTypeInt = 21,
+    OpTypeFloat = 22,
+    OpTypeVector = 23,
+    OpTypeMatrix = 24,
+    OpTypeImage = 25,
+    OpTypeSampler = 26,
+    OpTypeSampledImage = 27,
+    OpTypeArray = 28,
+    OpTypeRuntimeArray = 29,
+    OpTypeStruct = 30,
+    OpTypePointer = 32,
+    OpConstant = 43,
+    OpVariable = 59,
+    OpDecorate = 71,
+    OpMemberDecorate = 72,
+  };
+
+  enum Decoration : uint32_t {
+    DecorationBlock = 2,
+    DecorationBufferBlock = 3,
+    DecorationArrayStride = 6,
+    DecorationMatrixStride = 7,
+    DecorationBinding = 33,
+    DecorationDescriptorSet = 34,
+    DecorationOffset = 35,
+  };
+
+  enum StorageClass : uint32_t {
+    StorageUniformConstant = 0,
+    StorageUniform = 2,
+    StoragePushConstant = 9,
+    StorageStorageBuffer = 12,
+  };
+
+  enum Dim : uint32_t {
+    DimBuffer = 5,
+    DimSubpassData = 6,
+  };
+
+  // Everything known about one result id
+  struct Id {
+    uint32_t opcode = 0;
+    // Result type of constants and variables
+    uint32_t type = 0;
+    // Operands after the result id
+    std::vector<uint32_t> operands;
+
+    uint32_t set = UINT32_MAX;
+    uint32_t binding = UINT32_MAX;
+    uint32_t arrayStride = 0;
+    bool bufferBlock = false;
+    std::vector<uint32_t> memberOffsets;
+    std::vector<uint32_t> memberMatrixStrides;
+  };
+
+  VkShaderStageFlags execution_model_stage(uint32_t model)
+  {
+    switch (model) {
+    case 0: return VK_SHADER_STAGE_VERTEX_BIT;
+    case 1: return VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+    case 2: return VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+    case 3: return VK_SHADER_STAGE_GEOMETRY_BIT;
+    case 4: return VK_SHADER_STAGE_FRAGMENT_BIT;
+    case 5: return VK_SHADER_STAGE_COMPUTE_BIT;
+    default: return 0;
+    }
+  }
+
+  uint32_t member_decoration(const std::vector<uint32_t>& values, uint32_t member)
+  {
+    return member < values.size() ? values[member] : 0;
+  }
+
+  // Size in bytes as laid out in a block, following the explicit offsets and strides
+  uint32_t type_size(const std::vector<Id>& ids, uint32_t typeId, uint32_t matrixStride = 0)
+  {
+    const Id& type = ids[typeId];
+
+    switch (type.opcode) {
+    case OpTypeInt:
+    case OpTypeFloat:
+      return type.operands[0] / 8;
+    case OpTypeVector:
+      return type_size(ids, type.operands[0]) * type.operands[1];
+    case OpTypeMatrix:
+      return type.operands[1] * (matrixStride ? matrixStride : type_size(ids, type.operands[0]));
+    case OpTypeArray: {
+      uint32_t length = ids[type.operands[1]].operands[0];
+      return length * (type.arrayStride ? type.arrayStride : type_size(ids, type.operands[0]));
+    }
+    case OpTypeStruct: {
+      uint32_t size = 0;
+      for (uint32_t m = 0; m < type.operands.size(); m++) {
+        uint32_t offset = member_decoration(type.memberOffsets, m);
+        size = std::max(size, offset + type_size(ids, type.operands[m], member_decoration(type.memberMatrixStrides, m)));
+      }
+      return size;
+    }
+    case OpTypePointer:
+      // Buffer references
+      return 8;
+    default:
+      // Runtime arrays add nothing to the fixed size
+      return 0;
+    }
+  }
+
+  bool descriptor_type(const std::vector<Id>& ids, uint32_t storage, uint32_t typeId, VkDescriptorType& descriptorType)
+  {
+    const Id& type = ids[typeId];
+
+    if (storage == StorageStorageBuffer) {
+      descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      return true;
+    }
+    if (storage == StorageUniform) {
+      // Old style storage blocks are uniforms decorated as BufferBlock
+      descriptorType = type.bufferBlock ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      return true;
+    }
+    if (storage != StorageUniformConstant) return false;
+
+    switch (type.opcode) {
+    case OpTypeSampler:
+      descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+      return true;
+    case OpTypeSampledImage:
+      descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      return true;
+    case OpTypeImage: {
+      uint32_t dim = type.operands[1];
+      // 1 is used with a sampler, 2 is read and written without one
+      bool storageImage = type.operands[5] == 2;
+      if (dim == DimSubpassData) descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+      else if (dim == DimBuffer) descriptorType = storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+      else descriptorType = storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+      return true;
+    }
+    default:
+      return false;
+    }
+  }
+
+  void add_binding(ShaderReflection& reflection, uint32_t set, const VkDescriptorSetLayoutBinding& binding)
+  {
+    auto setIt = std::lower_bound(reflection.sets.begin(), reflection.sets.end(), set,
+                                  [](const ShaderReflection::Set& s, uint32_t value) { return s.set < value; });
+    if (setIt == reflection.sets.end() || setIt->set != set) setIt = reflection.sets.insert(setIt, ShaderReflection::Set{ set, {} });
+
+    std::vector<VkDescriptorSetLayoutBinding>& bindings = setIt->bindings;
+    auto it = std::lower_bound(bindings.begin(), bindings.end(), binding.binding,
+                               [](const VkDescriptorSetLayoutBinding& b, uint32_t value) { return b.binding < value; });
+    if (it != bindings.end() && it->binding == binding.binding) {
+      it->stageFlags |= binding.stageFlags;
+      return;
+    }
+
+    bindings.insert(it, binding);
+  }
+}
+
+void ShaderReflection::merge(const ShaderReflection& other)
+{
+  for (const Set& set : other.sets) {
+    for (const VkDescriptorSetLayoutBinding& binding : set.bindings) {
+      add_binding(*this, set.set, binding);
+    }
+  }
+
+  if (other.pushConstants.size > 0) {
+    if (pushConstants.size == 0) {
+      pushConstants = other.pushConstants;
+    } else {
+      uint32_t end = std::max(pushConstants.offset + pushConstants.size, other.pushConstants.offset + other.pushConstants.size);
+      pushConstants.offset = std::min(pushConstants.offset, other.pushConstants.offset);
+      pushConstants.size = end - pushConstants.offset;
+      pushConstants.stageFlags |= other.pushConstants.stageFlags;
+    }
+  }
+
+  stages |= other.stages;
+}
+
+void ShaderReflection::widen_stages()
+{
+  for (Set& set : sets) {
+    for (VkDescriptorSetLayoutBinding& binding : set.bindings) {
+      binding.stageFlags = stages;
+    }
+  }
+}
+
+void ShaderReflection::set_stages(uint32_t set, VkShaderStageFlags setStages)
+{
+  for (Set& s : sets) {
+    if (s.set != set) continue;
+    for (VkDescriptorSetLayoutBinding& binding : s.bindings) {
+      binding.stageFlags = setStages;
+    }
+  }
+}
+
+const ShaderReflection::Set* ShaderReflection::find_set(uint32_t set) const
+{
+  for (const Set& s : sets) {
+    if (s.set == set) return &s;
+  }
+  return nullptr;
+}
+
+bool vkutil::reflect_shader(std::span<const uint32_t> code, ShaderReflection& reflection)
+{
+  if (code.size() < 5 || code[0] != SpirvMagic) return false;
+
+  // Word 3 of the header bounds every id in the module
+  std::vector<Id> ids(code[3]);
+  std::vector<uint32_t> variables;
+  VkShaderStageFlags stage = 0;
+
+  for (size_t i = 5; i < code.size();) {
+    uint32_t opcode = code[i] & 0xffff;
+    uint32_t wordCount = code[i] >> 16;
+    if (wordCount == 0 || i + wordCount > code.size()) return false;
+
+    const uint32_t* words = &code[i];
+    i += wordCount;
+
+    switch (opcode) {
+    case OpEntryPoint:
+      stage |= execution_model_stage(words[1]);
+      break;
+    case OpDecorate: {
+      if (wordCount < 3 || words[1] >= ids.size()) return false;
+      Id& id = ids[words[1]];
+      if (words[2] == DecorationDescriptorSet) id.set = words[3];
+      else if (words[2] == DecorationBinding) id.binding = words[3];
+      else if (words[2] == DecorationArrayStride) id.arrayStride = words[3];
+      else if (words[2] == DecorationBufferBlock) id.bufferBlock = true;
+      break;
+    }
+    case OpMemberDecorate: {
+      if (wordCount < 4 || words[1] >= ids.size()) return false;
+      Id& id = ids[words[1]];
+      uint32_t member = words[2];
+      std::vector<uint32_t>* values = nullptr;
+      if (words[3] == DecorationOffset) values = &id.memberOffsets;
+      else if (words[3] == DecorationMatrixStride) values = &id.memberMatrixStrides;
+      if (values) {
+        if (values->size() <= member) values->resize(member + 1);
+        (*values)[member] = words[4];
+      }
+      break;
+    }
+    case OpTypeInt:
+    case OpTypeFloat:
+    case OpTypeVector:
+    case OpTypeMatrix:
+    case OpTypeImage:
+    case OpTypeSampler:
+    case OpTypeSampledImage:
+    case OpTypeArray:
+    case OpTypeRuntimeArray:
+    case OpTypeStruct:
+    case OpTypePointer: {
+      if (words[1] >= ids.size()) return false;
+      Id& id = ids[words[1]];
+      id.opcode = opcode;
+      id.operands.assign(words + 2, words + wordCount);
+      break;
+    }
+    case OpConstant:
+    case OpVariable: {
+      if (words[2] >= ids.size()) return false;
+      Id& id = ids[words[2]];
+      id.opcode = opcode;
+      id.type = words[1];
+      id.operands.assign(words + 3, words + wordCount);
+      if (opcode == OpVariable) variables.push_back(words[2]);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  ShaderReflection shader;
+  shader.stages = stage;
+
+  for (uint32_t variableId : variables) {
+    const Id& variable = ids[variableId];
+    uint32_t storage = variable.operands[0];
+
+    // Variables are pointers to what the shader declared
+    uint32_t typeId = ids[variable.type].operands[1];
+
+    if (storage == StoragePushConstant) {
+      const Id& block = ids[typeId];
+      uint32_t offset = block.memberOffsets.empty() ? 0 : *std::min_element(block.memberOffsets.begin(), block.memberOffsets.end());
+
+      shader.pushConstants.offset = offset;
+      shader.pushConstants.size = type_size(ids, typeId) - offset;
+      shader.pushConstants.stageFlags = stage;
+      continue;
+    }
+
+    if (variable.set == UINT32_MAX || variable.binding == UINT32_MAX) continue;
+
+    // Arrays of descriptors, runtime sized ones only get a single descriptor here
+    uint32_t count = 1;
+    if (ids[typeId].opcode == OpTypeArray) {
+      count = ids[ids[typeId].operands[1]].operands[0];
+      typeId = ids[typeId].operands[0];
+    } else if (ids[typeId].opcode == OpTypeRuntimeArray) {
+      typeId = ids[typeId].operands[0];
+    }
+
+    VkDescriptorType type;
+    if (!descriptor_type(ids, storage, typeId, type)) continue;
+
+    VkDescriptorSetLayoutBinding binding{};
+    binding.binding = variable.binding;
+    binding.descriptorType = type;
+    binding.descriptorCount = count;
+    binding.stageFlags = stage;
+
+    add_binding(shader, variable.set, binding);
+  }
+
+  reflection.merge(shader);
+  return true;
+}
+
+bool vkutil::reflect_shader_file(const char* filePath, ShaderReflection& reflection)
+{
+  std::ifstream file(filePath, std::ios::ate | std::ios::binary);
+
+  if (!file.is_open()) return false;
+
+  size_t fileSize = (size_t)file.tellg();
+  std::vector<uint32_t> code(fileSize / sizeof(uint32_t));
+
+  file.seekg(0);
+  file.read((char*)code.data(), fileSize);
+
+  return reflect_shader(code, reflection);
+}
+
+bool vkutil::reflect_pipeline(std::initializer_list<const char*> filePaths, ShaderReflection& reflection)
+{
+  for (const char* path : filePaths) {
+    if (!reflect_shader_file(path, reflection)) {
+      fmt::print("Failed to reflect {}\n", path);
+      return false;
+    }
+  }
+
+  reflection.widen_stages();
+  return true;
+}
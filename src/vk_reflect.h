@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Interface of a pipeline read from its compiled SPIR-V: the descriptor bindings of every set and the push constant
+// range, with the stages that use them
+struct ShaderReflection {
+  struct Set {
+    uint32_t set;
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+  };
+
+  // Sorted by set number, bindings by binding number
+  std::vector<Set> sets;
+  // Size 0 when no stage declares push constants
+  VkPushConstantRange pushConstants{};
+  VkShaderStageFlags stages = 0;
+
+  // Adds another shader of the same pipeline, bindings both use get both stages
+  void merge(const ShaderReflection& other);
+  // Gives every binding all stages of the pipeline, so the set layouts match the ones other pipelines of the same
+  // stages derive for the same sets
+  void widen_stages();
+  // For sets also bound to pipelines of other stages
+  void set_stages(uint32_t set, VkShaderStageFlags setStages);
+
+  const Set* find_set(uint32_t set) const;
+};
+
+namespace vkutil {
+  bool reflect_shader(std::span<const uint32_t> code, ShaderReflection& reflection);
+  bool reflect_shader_file(const char* filePath, ShaderReflection& reflection);
+  // Every shader of a pipeline merged, with the stages widened
+  bool reflect_pipeline(std::initializer_list<const char*> filePaths, ShaderReflection& reflection);
+};
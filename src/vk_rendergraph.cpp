@@ -0,0 +1,460 @@
+#include "vk_rendergraph.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+
+#include <algorithm>
+
+bool RGImageDesc::operator==(const RGImageDesc& other) const
+{
+  return extent.width == other.extent.width && extent.height == other.extent.height && extent.depth == other.extent.depth &&
+         format == other.format && usage == other.usage && aspect == other.aspect;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::read(RGImage image, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access)
+{
+  images.push_back(ImageAccess{ image, false, layout, stage, access });
+  return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::write(RGImage image, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access)
+{
+  images.push_back(ImageAccess{ image, true, layout, stage, access });
+  return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::read(RGBuffer buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access)
+{
+  buffers.push_back(BufferAccess{ buffer, false, stage, access });
+  return *this;
+}
+
+RenderGraph::Pass& RenderGraph::Pass::write(RGBuffer buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access)
+{
+  buffers.push_back(BufferAccess{ buffer, true, stage, access });
+  return *this;
+}
+
+void RenderGraph::init(VulkanEngine* engine)
+{
+  this->engine = engine;
+  asyncPasses = 0;
+  asyncWaitStage = VK_PIPELINE_STAGE_2_NONE;
+}
+
+void RenderGraph::destroy()
+{
+  for (TransientImage& t : transients) {
+    engine->_imageStates.forget(t.image);
+    vkDestroyImageView(engine->_device, t.view, nullptr);
+    vkDestroyImage(engine->_device, t.image, nullptr);
+  }
+  for (MemorySlot& slot : slots) {
+    vmaFreeMemory(engine->_allocator, slot.allocation);
+  }
+
+  transients.clear();
+  slots.clear();
+}
+
+void RenderGraph::reset()
+{
+  images.clear();
+  buffers.clear();
+  passes.clear();
+  barriers.clear();
+  asyncPasses = 0;
+  asyncWaitStage = VK_PIPELINE_STAGE_2_NONE;
+}
+
+RGImage RenderGraph::import_image(const char* name, VkImage image, VkImageView view, VkExtent3D extent, bool discard)
+{
+  if (discard) engine->_imageStates.discard(image);
+
+  ImageResource resource{};
+  resource.name = name;
+  resource.transient = false;
+  resource.discard = discard;
+  resource.desc.extent = extent;
+  resource.image = image;
+  resource.view = view;
+  images.push_back(resource);
+
+  return RGImage{ (uint32_t)images.size() - 1 };
+}
+
+RGImage RenderGraph::create_image(const char* name, const RGImageDesc& desc)
+{
+  ImageResource resource{};
+  resource.name = name;
+  resource.transient = true;
+  resource.discard = true;
+  resource.desc = desc;
+  images.push_back(resource);
+
+  return RGImage{ (uint32_t)images.size() - 1 };
+}
+
+RGBuffer RenderGraph::import_buffer(const char* name, VkBuffer buffer)
+{
+  buffers.push_back(BufferResource{ name, buffer, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE });
+  return RGBuffer{ (uint32_t)buffers.size() - 1 };
+}
+
+RenderGraph::Pass& RenderGraph::add_pass(const char* name, ExecuteFn execute)
+{
+  Pass& pass = passes.emplace_back();
+  pass.name = name;
+  pass.execute = std::move(execute);
+  return pass;
+}
+
+void RenderGraph::cull_passes()
+{
+  // Walking backwards, a pass is needed when it has side effects, writes an imported resource or writes what a needed
+  // pass reads. Buffers are all imported, so their writers always stay
+  std::vector<bool> imageNeeded(images.size(), false);
+
+  for (auto it = passes.rbegin(); it != passes.rend(); it++) {
+    Pass& pass = *it;
+
+    bool needed = pass.sideEffect || std::any_of(pass.buffers.begin(), pass.buffers.end(), [](const BufferAccess& a) { return a.write; });
+    for (const ImageAccess& a : pass.images) {
+      if (a.write && (!images[a.image.index].transient || imageNeeded[a.image.index])) needed = true;
+    }
+
+    pass.culled = !needed;
+    if (!needed) continue;
+
+    // A write that doesn't read, like a clear, doesn't need whatever was there before
+    for (const ImageAccess& a : pass.images) {
+      if (!a.write || (a.access & ~vkutil::WriteAccess)) imageNeeded[a.image.index] = true;
+    }
+  }
+}
+
+void RenderGraph::assign_queues()
+{
+  // The compute submission runs before the graphics one, so an async pass can't depend on anything the graphics
+  // queue does earlier in the frame. Transients share memory with graphics passes, they stay on the graphics queue
+  std::vector<bool> imageOnGraphics(images.size(), false);
+  std::vector<bool> bufferOnGraphics(buffers.size(), false);
+
+  asyncPasses = 0;
+
+  for (Pass& pass : passes) {
+    if (pass.culled) continue;
+
+    if (pass.async) {
+      for (const ImageAccess& a : pass.images) {
+        if (imageOnGraphics[a.image.index] || images[a.image.index].transient) pass.async = false;
+      }
+      for (const BufferAccess& a : pass.buffers) {
+        if (bufferOnGraphics[a.buffer.index]) pass.async = false;
+      }
+    }
+
+    if (pass.async) {
+      asyncPasses++;
+      continue;
+    }
+
+    for (const ImageAccess& a : pass.images) imageOnGraphics[a.image.index] = true;
+    for (const BufferAccess& a : pass.buffers) bufferOnGraphics[a.buffer.index] = true;
+  }
+}
+
+void RenderGraph::place_transients()
+{
+  std::vector<uint32_t> requested;
+  for (uint32_t i = 0; i < images.size(); i++) {
+    if (images[i].transient && images[i].firstPass != UINT32_MAX) requested.push_back(i);
+  }
+
+  // The same images with the same lifetimes as last time keep their memory and placement
+  bool same = requested.size() == transients.size();
+  for (size_t i = 0; same && i < requested.size(); i++) {
+    const ImageResource& r = images[requested[i]];
+    same = r.desc == transients[i].desc && r.firstPass == transients[i].firstPass && r.lastPass == transients[i].lastPass;
+  }
+
+  if (!same) {
+    retire_transients();
+
+    std::vector<VkMemoryRequirements> requirements(requested.size());
+
+    for (size_t i = 0; i < requested.size(); i++) {
+      const ImageResource& r = images[requested[i]];
+
+      TransientImage t{};
+      t.desc = r.desc;
+      t.firstPass = r.firstPass;
+      t.lastPass = r.lastPass;
+
+      VkImageCreateInfo imageInfo = vkinit::image_create_info(r.desc.format, r.desc.usage, r.desc.extent);
+      VK_CHECK(vkCreateImage(engine->_device, &imageInfo, nullptr, &t.image));
+      vkGetImageMemoryRequirements(engine->_device, t.image, &requirements[i]);
+
+      transients.push_back(t);
+    }
+
+    // Largest first, each image goes into the first slot it fits whose images are all done before it starts or
+    // only start after it ends
+    std::vector<size_t> order(requested.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return requirements[a].size > requirements[b].size; });
+
+    std::vector<std::vector<size_t>> slotImages;
+
+    for (size_t i : order) {
+      TransientImage& t = transients[i];
+
+      uint32_t slot = 0;
+      for (; slot < slots.size(); slot++) {
+        if (!(slots[slot].requirements.memoryTypeBits & requirements[i].memoryTypeBits)) continue;
+
+        bool overlaps = std::any_of(slotImages[slot].begin(), slotImages[slot].end(), [&](size_t other) {
+          return transients[other].firstPass <= t.lastPass && t.firstPass <= transients[other].lastPass;
+        });
+        if (!overlaps) break;
+      }
+
+      if (slot == slots.size()) {
+        slots.push_back(MemorySlot{ VK_NULL_HANDLE, requirements[i], VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE });
+        slotImages.emplace_back();
+      } else {
+        VkMemoryRequirements& slotRequirements = slots[slot].requirements;
+        slotRequirements.size = std::max(slotRequirements.size, requirements[i].size);
+        slotRequirements.alignment = std::max(slotRequirements.alignment, requirements[i].alignment);
+        slotRequirements.memoryTypeBits &= requirements[i].memoryTypeBits;
+      }
+
+      t.slot = slot;
+      slotImages[slot].push_back(i);
+    }
+
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    allocInfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    for (MemorySlot& slot : slots) {
+      VK_CHECK(vmaAllocateMemory(engine->_allocator, &slot.requirements, &allocInfo, &slot.allocation, nullptr));
+    }
+
+    for (TransientImage& t : transients) {
+      VK_CHECK(vmaBindImageMemory(engine->_allocator, slots[t.slot].allocation, t.image));
+
+      VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(t.desc.format, t.image, t.desc.aspect);
+      VK_CHECK(vkCreateImageView(engine->_device, &viewInfo, nullptr, &t.view));
+
+      engine->_imageStates.track(t.image, t.desc.aspect);
+    }
+  }
+
+  for (size_t i = 0; i < requested.size(); i++) {
+    ImageResource& r = images[requested[i]];
+    r.image = transients[i].image;
+    r.view = transients[i].view;
+    r.slot = transients[i].slot;
+  }
+}
+
+void RenderGraph::retire_transients()
+{
+  if (transients.empty()) return;
+
+  // Frames still in flight may use them, so they go once this frame's slot comes around again
+  std::vector<TransientImage> retired = std::move(transients);
+  std::vector<MemorySlot> retiredSlots = std::move(slots);
+  transients.clear();
+  slots.clear();
+
+  for (TransientImage& t : retired) {
+    engine->_imageStates.forget(t.image);
+  }
+
+  VulkanEngine* owner = engine;
+  engine->get_current_frame()._deletionQueue.push_function([owner, retired, retiredSlots]() {
+    for (const TransientImage& t : retired) {
+      vkDestroyImageView(owner->_device, t.view, nullptr);
+      vkDestroyImage(owner->_device, t.image, nullptr);
+    }
+    for (const MemorySlot& slot : retiredSlots) {
+      vmaFreeMemory(owner->_allocator, slot.allocation);
+    }
+  });
+}
+
+void RenderGraph::compile()
+{
+  cull_passes();
+  assign_queues();
+
+  for (ImageResource& r : images) {
+    r.firstPass = UINT32_MAX;
+    r.lastPass = 0;
+  }
+  for (uint32_t i = 0; i < passes.size(); i++) {
+    if (passes[i].culled) continue;
+    for (const ImageAccess& a : passes[i].images) {
+      ImageResource& r = images[a.image.index];
+      r.firstPass = std::min(r.firstPass, i);
+      r.lastPass = std::max(r.lastPass, i);
+    }
+  }
+
+  place_transients();
+
+  // Walk the passes in order with the tracker, so every pass gets the barriers from the state the one before left
+  vkutil::ImageStateTracker& tracker = engine->_imageStates;
+
+  // Everything starts out last used by the graphics queue, the compute submission waits for the previous frame's
+  std::vector<bool> imageOnCompute(images.size(), false);
+  std::vector<bool> bufferOnCompute(buffers.size(), false);
+
+  barriers.clear();
+  for (uint32_t i = 0; i < passes.size(); i++) {
+    vkutil::BarrierBatch& batch = barriers.emplace_back(tracker);
+    Pass& pass = passes[i];
+    if (pass.culled) continue;
+
+    for (const ImageAccess& a : pass.images) {
+      ImageResource& r = images[a.image.index];
+
+      // Contents are undefined either way, but whatever used the memory last has to be done with it
+      if (r.transient && r.firstPass == i) {
+        MemorySlot& slot = slots[r.slot];
+        tracker.set_state(r.image, vkutil::ImageState{ VK_IMAGE_LAYOUT_UNDEFINED, slot.stage, slot.access });
+      }
+
+      // Switching queues, the semaphore between the submissions already waits for the earlier uses and makes their
+      // writes visible. What's left is the layout transition, ordered after the semaphore wait through this use's stages
+      if (imageOnCompute[a.image.index] != pass.async) {
+        if (!pass.async) asyncWaitStage |= a.stage & ~VK_PIPELINE_STAGE_2_HOST_BIT;
+        tracker.set_state(r.image, vkutil::ImageState{ tracker.state(r.image).layout, a.stage, VK_ACCESS_2_NONE });
+        imageOnCompute[a.image.index] = pass.async;
+      }
+
+      batch.image(r.image, a.layout, a.stage, a.access);
+    }
+
+    // Same rules as the images. Buffer state starts fresh every frame, their earlier uses were waited for on the host
+    for (const BufferAccess& a : pass.buffers) {
+      BufferResource& b = buffers[a.buffer.index];
+
+      if (bufferOnCompute[a.buffer.index] != pass.async) {
+        if (!pass.async) asyncWaitStage |= a.stage & ~VK_PIPELINE_STAGE_2_HOST_BIT;
+        b.stage = VK_PIPELINE_STAGE_2_NONE;
+        b.access = VK_ACCESS_2_NONE;
+        bufferOnCompute[a.buffer.index] = pass.async;
+      }
+
+      bool readOnly = !(b.access & vkutil::WriteAccess) && !(a.access & vkutil::WriteAccess);
+
+      if (b.stage == VK_PIPELINE_STAGE_2_NONE) {
+        b.stage = a.stage;
+        b.access = a.access;
+      } else if (readOnly) {
+        bool covered = !(a.stage & ~b.stage) && !(a.access & ~b.access);
+        if (!covered) batch.buffer(b.buffer, b.stage, VK_ACCESS_2_NONE, a.stage, a.access);
+        b.stage |= a.stage;
+        b.access |= a.access;
+      } else {
+        batch.buffer(b.buffer, b.stage, b.access & vkutil::WriteAccess, a.stage, a.access);
+        b.stage = a.stage;
+        b.access = a.access;
+      }
+    }
+
+    for (const ImageAccess& a : pass.images) {
+      ImageResource& r = images[a.image.index];
+      if (r.transient && r.lastPass == i) {
+        const vkutil::ImageState& state = tracker.state(r.image);
+        slots[r.slot].stage = state.stage;
+        slots[r.slot].access = state.access;
+      }
+    }
+  }
+
+  // Nothing on the graphics queue reads the async results, it still has to wait so the frame's fence covers them
+  if (asyncPasses > 0 && asyncWaitStage == VK_PIPELINE_STAGE_2_NONE) asyncWaitStage = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+}
+
+void RenderGraph::execute(VkCommandBuffer cmd, VkCommandBuffer computeCmd)
+{
+  for (uint32_t i = 0; i < passes.size(); i++) {
+    if (passes[i].culled) continue;
+
+    VkCommandBuffer passCmd = passes[i].async ? computeCmd : cmd;
+    barriers[i].flush(passCmd);
+    if (passes[i].execute) passes[i].execute(passCmd);
+  }
+}
+
+std::string RenderGraph::dump() const
+{
+  auto image_name = [&](VkImage image) -> std::string {
+    for (const ImageResource& r : images) {
+      if (r.image == image) return r.name;
+    }
+    return "?";
+  };
+  auto buffer_name = [&](VkBuffer buffer) -> std::string {
+    for (const BufferResource& b : buffers) {
+      if (b.buffer == buffer) return b.name;
+    }
+    return "?";
+  };
+
+  std::string out = fmt::format("Render graph: {} passes, {} async", passes.size(), asyncPasses);
+  if (asyncPasses > 0) out += fmt::format(", graphics waits at stages {:#x}", asyncWaitStage);
+  out += "\n";
+
+  for (uint32_t i = 0; i < passes.size(); i++) {
+    const Pass& pass = passes[i];
+    out += fmt::format("  {:2} {}{}\n", i, pass.name, pass.culled ? " (culled)" : pass.async ? " (async compute)" : "");
+    if (pass.culled) continue;
+
+    for (const ImageAccess& a : pass.images) {
+      out += fmt::format("       {} {} as {}\n", a.write ? "writes" : "reads ", images[a.image.index].name, string_VkImageLayout(a.layout));
+    }
+    for (const BufferAccess& a : pass.buffers) {
+      out += fmt::format("       {} {}\n", a.write ? "writes" : "reads ", buffers[a.buffer.index].name);
+    }
+
+    for (const VkImageMemoryBarrier2& b : barriers[i].image_barriers()) {
+      out += fmt::format("       barrier {}: {} -> {}, stages {:#x} -> {:#x}, access {:#x} -> {:#x}\n", image_name(b.image),
+                         string_VkImageLayout(b.oldLayout), string_VkImageLayout(b.newLayout), b.srcStageMask, b.dstStageMask,
+                         b.srcAccessMask, b.dstAccessMask);
+    }
+    for (const VkBufferMemoryBarrier2& b : barriers[i].buffer_barriers()) {
+      out += fmt::format("       barrier {}: stages {:#x} -> {:#x}, access {:#x} -> {:#x}\n", buffer_name(b.buffer), b.srcStageMask,
+                         b.dstStageMask, b.srcAccessMask, b.dstAccessMask);
+    }
+  }
+
+  VkDeviceSize imageBytes = 0;
+  VkDeviceSize slotBytes = 0;
+
+  out += "Transient images:\n";
+  for (const ImageResource& r : images) {
+    if (!r.transient) continue;
+    if (r.firstPass == UINT32_MAX) {
+      out += fmt::format("  {} unused\n", r.name);
+      continue;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(engine->_device, r.image, &requirements);
+    imageBytes += requirements.size;
+
+    out += fmt::format("  {} {}x{} {}, passes {}-{}, slot {}, {} KiB\n", r.name, r.desc.extent.width, r.desc.extent.height,
+                       string_VkFormat(r.desc.format), r.firstPass, r.lastPass, r.slot, requirements.size / 1024);
+  }
+  for (const MemorySlot& slot : slots) {
+    slotBytes += slot.requirements.size;
+  }
+  out += fmt::format("  {} KiB of images in {} slots of {} KiB\n", imageBytes / 1024, slots.size(), slotBytes / 1024);
+
+  return out;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vk_types.h>
+#include <vk_barriers.h>
+
+// Forward declaration
+class VulkanEngine;
+
+// Handles into the graph of the frame they were created in
+struct RGImage {
+  uint32_t index = UINT32_MAX;
+  bool valid() const { return index != UINT32_MAX; }
+};
+
+struct RGBuffer {
+  uint32_t index = UINT32_MAX;
+  bool valid() const { return index != UINT32_MAX; }
+};
+
+// Image owned by the graph that only lives between its first and last use in a frame
+struct RGImageDesc {
+  VkExtent3D extent;
+  VkFormat format;
+  VkImageUsageFlags usage;
+  VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+
+  bool operator==(const RGImageDesc& other) const;
+};
+
+// Frame graph, rebuilt every frame. Passes declare how they use images and buffers, compile culls the passes whose
+// results nobody uses, places the transient images in shared memory when their lifetimes don't overlap and works out
+// one barrier batch per pass. Imported images keep their state in the engine's ImageStateTracker between frames.
+// Async compute passes are recorded into a second command buffer for the compute queue. It's submitted before the
+// graphics one, after the previous frame's graphics work, and the graphics submission waits for it at the stages that
+// first use its results. Resources they touch have to be shared by both queue families
+struct RenderGraph {
+  using ExecuteFn = std::function<void(VkCommandBuffer cmd)>;
+
+  struct ImageAccess {
+    RGImage image;
+    bool write;
+    VkImageLayout layout;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+  };
+
+  struct BufferAccess {
+    RGBuffer buffer;
+    bool write;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+  };
+
+  struct Pass {
+    std::string name;
+    ExecuteFn execute;
+
+    std::vector<ImageAccess> images;
+    std::vector<BufferAccess> buffers;
+    // Kept even when nothing in the graph reads what it writes
+    bool sideEffect = false;
+    bool culled = false;
+    // Runs on the compute queue. Passes that touch anything an earlier graphics pass of the frame used, or a transient
+    // image, stay on the graphics queue since the compute submission runs ahead of it
+    bool async = false;
+
+    // One use per resource and pass, with the union of the accesses when the pass both reads and writes it
+    Pass& read(RGImage image, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+    Pass& write(RGImage image, VkImageLayout layout, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+    Pass& read(RGBuffer buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+    Pass& write(RGBuffer buffer, VkPipelineStageFlags2 stage, VkAccessFlags2 access);
+    Pass& side_effect() { sideEffect = true; return *this; }
+    Pass& async_compute(bool enable = true) { async = enable; return *this; }
+  };
+
+  void init(VulkanEngine* engine);
+  void destroy();
+
+  // Starts the next frame's graph, transient memory is kept as long as the next frame asks for the same images
+  void reset();
+
+  // Imported images are assumed to be read outside the graph, so their writers are never culled. Discarded ones
+  // start the frame from UNDEFINED
+  RGImage import_image(const char* name, VkImage image, VkImageView view, VkExtent3D extent, bool discard = false);
+  RGImage create_image(const char* name, const RGImageDesc& desc);
+  RGBuffer import_buffer(const char* name, VkBuffer buffer);
+
+  Pass& add_pass(const char* name, ExecuteFn execute = nullptr);
+
+  void compile();
+  // computeCmd is only recorded into when has_async_work, otherwise it can be null
+  void execute(VkCommandBuffer cmd, VkCommandBuffer computeCmd);
+
+  bool has_async_work() const { return asyncPasses > 0; }
+  // Graphics stages that have to wait for the compute submission
+  VkPipelineStageFlags2 async_wait_stage() const { return asyncWaitStage; }
+
+  // Only valid after compile
+  VkImage image(RGImage handle) const { return images[handle.index].image; }
+  VkImageView view(RGImage handle) const { return images[handle.index].view; }
+  VkBuffer buffer(RGBuffer handle) const { return buffers[handle.index].buffer; }
+
+  // Passes, transient placement and barriers of the compiled graph
+  std::string dump() const;
+
+private:
+  struct ImageResource {
+    std::string name;
+    bool transient;
+    bool discard;
+    RGImageDesc desc;
+    VkImage image;
+    VkImageView view;
+    // Range of kept passes using it, and the memory slot a transient image is placed in
+    uint32_t firstPass;
+    uint32_t lastPass;
+    uint32_t slot;
+  };
+
+  struct BufferResource {
+    std::string name;
+    VkBuffer buffer;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+  };
+
+  // Transient images of the previous frames and the memory they share, rebuilt when the requested set changes
+  struct TransientImage {
+    RGImageDesc desc;
+    uint32_t firstPass;
+    uint32_t lastPass;
+    VkImage image;
+    VkImageView view;
+    uint32_t slot;
+  };
+
+  struct MemorySlot {
+    VmaAllocation allocation;
+    VkMemoryRequirements requirements;
+    // Last use of the memory by any image placed in it, the next image waits for it
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+  };
+
+  void cull_passes();
+  void assign_queues();
+  void place_transients();
+  void retire_transients();
+
+  VulkanEngine* engine;
+
+  std::vector<ImageResource> images;
+  std::vector<BufferResource> buffers;
+  std::deque<Pass> passes;
+  std::vector<vkutil::BarrierBatch> barriers;
+  uint32_t asyncPasses;
+  VkPipelineStageFlags2 asyncWaitStage;
+
+  std::vector<TransientImage> transients;
+  std::vector<MemorySlot> slots;
+};
@@ -0,0 +1,179 @@
+#include <vk_shader_reload.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+bool ShaderReloader::init(const char* sourceDir, const char* outputDir)
+{
+  this->sourceDir = sourceDir;
+  this->outputDir = outputDir;
+
+#ifdef __linux__
+  inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotifyFd < 0) {
+    fmt::println("Shader reloading disabled, inotify is not available");
+    return false;
+  }
+
+  // Editors either write the file in place or move a new one over it
+  if (inotify_add_watch(inotifyFd, sourceDir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    fmt::println("Shader reloading disabled, can't watch {}", sourceDir);
+    close(inotifyFd);
+    inotifyFd = -1;
+    return false;
+  }
+  return true;
+#else
+  fmt::println("Shader reloading is only supported on Linux");
+  return false;
+#endif
+}
+
+void ShaderReloader::watch(std::initializer_list<const char*> spvPaths, Rebuild&& rebuild)
+{
+  Watch w;
+  w.shaders.assign(spvPaths.begin(), spvPaths.end());
+  w.rebuild = std::move(rebuild);
+  watches.push_back(std::move(w));
+}
+
+void ShaderReloader::start()
+{
+  if (inotifyFd < 0) return;
+
+  running = true;
+  thread = std::thread(&ShaderReloader::run, this);
+}
+
+void ShaderReloader::apply()
+{
+  std::vector<std::function<void()>> swaps;
+  {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    swaps.swap(pending);
+  }
+
+  for (std::function<void()>& swap : swaps) {
+    swap();
+  }
+}
+
+void ShaderReloader::destroy()
+{
+  running = false;
+  if (thread.joinable()) thread.join();
+
+  // Rebuilds that finished in the meantime still own their pipelines, swapping them in hands them to the usual cleanup
+  apply();
+
+#ifdef __linux__
+  if (inotifyFd >= 0) close(inotifyFd);
+#endif
+  inotifyFd = -1;
+  watches.clear();
+}
+
+void ShaderReloader::run()
+{
+#ifdef __linux__
+  while (running) {
+    // Wakes up regularly to notice destroy
+    pollfd pfd = { inotifyFd, POLLIN, 0 };
+    if (poll(&pfd, 1, 200) <= 0) continue;
+
+    // Saving often takes a few writes, let them settle so one save compiles once
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::set<std::string> changed;
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+      for (char* ptr = buffer; ptr < buffer + length;) {
+        const inotify_event* event = (const inotify_event*)ptr;
+        if (event->len > 0) changed.insert(event->name);
+        ptr += sizeof(inotify_event) + event->len;
+      }
+    }
+
+    std::set<std::string> sources;
+    for (const std::string& file : changed) {
+      for (std::string& source : affected_sources(file)) {
+        sources.insert(std::move(source));
+      }
+    }
+
+    std::set<std::string> compiled;
+    for (const std::string& source : sources) {
+      std::string spvPath;
+      if (compile(source, spvPath)) compiled.insert(spvPath);
+    }
+    if (compiled.empty()) continue;
+
+    for (Watch& w : watches) {
+      bool affected = std::any_of(w.shaders.begin(), w.shaders.end(), [&](const std::string& s) { return compiled.contains(s); });
+      if (!affected) continue;
+
+      std::function<void()> swap = w.rebuild();
+      if (!swap) {
+        fmt::println("Keeping the old pipelines of {}, the new ones failed to build", w.shaders.front());
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock(pendingMutex);
+      pending.push_back(std::move(swap));
+    }
+  }
+#endif
+}
+
+std::vector<std::string> ShaderReloader::affected_sources(const std::string& changed) const
+{
+  std::filesystem::path path(changed);
+  std::string extension = path.extension().string();
+
+  if (extension == ".comp" || extension == ".frag" || extension == ".vert") return { changed };
+  // Editor swap and backup files end up here too
+  if (extension != ".glsl") return {};
+
+  std::vector<std::string> sources;
+  std::string directive = "#include \"" + changed + "\"";
+  for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(sourceDir)) {
+    std::string sourceExtension = entry.path().extension().string();
+    if (sourceExtension != ".comp" && sourceExtension != ".frag" && sourceExtension != ".vert") continue;
+
+    std::ifstream file(entry.path());
+    std::stringstream text;
+    text << file.rdbuf();
+    if (text.str().find(directive) != std::string::npos) sources.push_back(entry.path().filename().string());
+  }
+  return sources;
+}
+
+bool ShaderReloader::compile(const std::string& source, std::string& spvPath) const
+{
+  spvPath = outputDir + "/" + source + ".spv";
+  // Compiled next to the output and moved over it, so a failed compile keeps the old SPIR-V and loads never see half a file
+  std::string tempPath = spvPath + ".tmp";
+
+  fmt::println("Compiling {}/{} -> {}", sourceDir, source, spvPath);
+  std::string command = fmt::format("glslangValidator -V \"{}/{}\" -o \"{}\"", sourceDir, source, tempPath);
+  if (std::system(command.c_str()) != 0) {
+    std::error_code error;
+    std::filesystem::remove(tempPath, error);
+    return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(tempPath, spvPath, error);
+  return !error;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vk_types.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Watches the shader sources, recompiles the ones that change and rebuilds the pipelines built from them on a
+// background thread. The render loop swaps the new pipelines in between frames, so it never waits on a compile
+class ShaderReloader {
+public:
+  // Creates the replacement pipelines on the reload thread and returns the function that swaps them in, which runs on
+  // the render thread. An empty function keeps the current pipelines, when the new ones fail to build
+  using Rebuild = std::function<std::function<void()>()>;
+
+  // sourceDir holds the GLSL sources, compiled into outputDir/<name>.spv like build-shaders.sh does
+  bool init(const char* sourceDir, const char* outputDir);
+  // Registers pipelines built from the given compiled shaders, before start
+  void watch(std::initializer_list<const char*> spvPaths, Rebuild&& rebuild);
+  void start();
+
+  // Swaps in every rebuild that finished since the last call
+  void apply();
+  void destroy();
+
+private:
+  struct Watch {
+    std::vector<std::string> shaders;
+    Rebuild rebuild;
+  };
+
+  void run();
+  // Sources to recompile for a changed file, every shader that includes it when it's an include file
+  std::vector<std::string> affected_sources(const std::string& changed) const;
+  bool compile(const std::string& source, std::string& spvPath) const;
+
+  std::string sourceDir;
+  std::string outputDir;
+  std::vector<Watch> watches;
+
+  int inotifyFd = -1;
+  std::thread thread;
+  std::atomic<bool> running{false};
+
+  std::mutex pendingMutex;
+  std::vector<std::function<void()>> pending;
+};
@@ -46,6 +46,22 @@ struct GPUMeshBuffers {
   AllocatedBuffer indexBuffer;
   AllocatedBuffer vertexBuffer;
   VkDeviceAddress vertexBufferAddress;
+  // UINT16 whenever every vertex of the mesh can be addressed with it
+  VkIndexType indexType;
+  // Cluster bounds read by the culling compute pass, null for meshes without clusters
+  AllocatedBuffer meshletBuffer;
+  VkDeviceAddress meshletBufferAddress;
+};
+
+// Cluster as seen by the culling pass, the triangles are a range of the mesh index buffer
+struct GPUMeshlet {
+  // Object space bounding sphere, radius in w
+  glm::vec4 sphere;
+  // Normal cone axis, cutoff in w
+  glm::vec4 cone;
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  uint32_t pad[2];
 };
 
 // Push constants for mest object draws
@@ -60,15 +76,19 @@ enum class MaterialPass :uint8_t {
   Other
 };
 
-struct MaterialPipeline {
-  VkPipeline pipeline;
-  VkPipelineLayout layout;
-};
+// MaterialInstance features, the shader variants are picked through specialization constants of mesh.frag
+constexpr uint32_t MaterialAlphaTest = 1 << 0;
+constexpr uint32_t MaterialColorTexture = 1 << 1;
+// The generic variant, right for every material but slower than the one made for it
+constexpr uint32_t MaterialAllFeatures = MaterialAlphaTest | MaterialColorTexture;
 
+// The pipeline is picked per draw from the material's permutation, see MaterialPipelineKey
 struct MaterialInstance {
-  MaterialPipeline* pipeline;
   VkDescriptorSet materialSet;
   MaterialPass passType;
+  // Back faces and back facing clusters are only culled for single sided materials
+  bool doubleSided;
+  uint32_t features = MaterialAllFeatures;
 };
 
 struct DrawContext;